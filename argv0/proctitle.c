@@ -0,0 +1,62 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include "proctitle.h"
+
+// fake requests served between rate updates
+#define REQS_PER_TICK 100000
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a worker loop publishing its request rate in the title, check it with
+// `ps` or `cat /proc/<pid>/cmdline` while it runs
+int main(int argc, char* argv[])
+{
+    double seconds = (argc > 1) ? strtod(argv[1], NULL) : 10;
+    if (seconds <= 0)
+    {
+        fprintf(stderr, "Usage: %s [seconds]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    proctitle_t title;
+    if (proctitle_init(&title, argc, argv, "worker: starting") != 0)
+        return EXIT_FAILURE;
+
+    printf("pid %d, title %s\n", getpid(),
+           title.mapped ? "in its own page" : "over argv");
+    fflush(stdout);
+
+    double start = now_seconds();
+    double tick_start = start;
+    double title_time = 0;
+    unsigned long long updates = 0;
+    // volatile keeps the fake work from being folded away
+    volatile unsigned long long reqs = 0;
+    while (tick_start - start < seconds)
+    {
+        for (int i = 0; i < REQS_PER_TICK; i++)
+            reqs++;
+
+        // the title is refreshed after every batch, the cost is measured
+        double now = now_seconds();
+        double rate = REQS_PER_TICK / (now - tick_start);
+        proctitle_set(&title, "worker: %.0f req/s, %llu total", rate,
+                      (unsigned long long) reqs);
+        tick_start = now_seconds();
+        title_time += tick_start - now;
+        updates++;
+    }
+
+    printf("%llu title updates, %.1f ns each\n", updates,
+           updates ? title_time * 1e9 / updates : 0.0);
+    return 0;
+}
@@ -0,0 +1,190 @@
+#ifndef ARGV0_PROCTITLE_H
+#define ARGV0_PROCTITLE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <linux/prctl.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Process titles shown by /proc/<pid>/cmdline, e.g. "worker: 1234 req/s".
+// proctitle_init points the kernel's argument bounds at a preallocated page
+// with one PR_SET_MM_MAP call; after that an update is a plain write into
+// that page, no syscall, no allocation and environ is never moved.
+// The last byte of the region stays non-zero, which makes the kernel print
+// the arguments up to the first NUL as setproctitle(3) does.
+// Titles are inherited by fork, a server sets one up before forking workers.
+////////////////////////////////////////////////////////////////////////////////
+
+#define PRINT_ERROR(str) do {perror(str); return EXIT_FAILURE;} while(0);
+
+// the kernel shows at most one page of a rewritten title
+#define PROCTITLE_MAX 256
+
+typedef struct proctitle
+{
+    char*  region;  // arg_start of the process
+    size_t cap;     // title and its NUL fit in cap - 1 bytes
+    int    mapped;  // region is our own page, not the original argv
+} proctitle_t;
+
+// "... (comm) state ppid ..." fields counted from 1 as in proc(5)
+static inline int proctitle_stat_fields(unsigned long long* values,
+                                        const int* fields, int num_fields)
+{
+    char buff[1024];
+    int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        PRINT_ERROR("[proctitle_stat_fields] Open stat failed\n");
+
+    ssize_t len = read(fd, buff, sizeof(buff) - 1);
+    close(fd);
+    if (len <= 0)
+        PRINT_ERROR("[proctitle_stat_fields] Read stat failed\n");
+    buff[len] = '\0';
+
+    // comm may hold spaces and parens, fields restart after the last ')'
+    char* pos = strrchr(buff, ')');
+    if (pos == NULL)
+    {
+        fprintf(stderr, "[proctitle_stat_fields] Bad stat format\n");
+        return EXIT_FAILURE;
+    }
+    pos++;
+
+    // field is the last one passed, comm is 2
+    int field = 2;
+    for (int i = 0; i < num_fields; i++)
+    {
+        while (field + 1 < fields[i] && *pos != '\0')
+        {
+            while (*pos == ' ')
+                pos++;
+            while (*pos != ' ' && *pos != '\0')
+                pos++;
+            field++;
+        }
+        if (*pos == '\0')
+        {
+            fprintf(stderr, "[proctitle_stat_fields] Stat is too short\n");
+            return EXIT_FAILURE;
+        }
+        values[i] = strtoull(pos, &pos, 10);
+        field++;
+    }
+
+    return 0;
+}
+
+// moves arg_start/arg_end to region with one PR_SET_MM_MAP, which needs no
+// capability but a kernel with CONFIG_CHECKPOINT_RESTORE
+static inline int proctitle_map(char* region, size_t cap)
+{
+    // startcode endcode startstack, start_data end_data start_brk
+    // arg_start arg_end env_start env_end
+    static const int fields[] = {26, 27, 28, 45, 46, 47, 48, 49, 50, 51};
+    unsigned long long values[sizeof(fields) / sizeof(fields[0])];
+    if (proctitle_stat_fields(values, fields,
+                              sizeof(fields) / sizeof(fields[0])) != 0)
+        return EXIT_FAILURE;
+
+    struct prctl_mm_map map = {
+        .start_code  = values[0],
+        .end_code    = values[1],
+        .start_stack = values[2],
+        .start_data  = values[3],
+        .end_data    = values[4],
+        .start_brk   = values[5],
+        .brk         = (unsigned long) sbrk(0),
+        .arg_start   = (unsigned long) region,
+        .arg_end     = (unsigned long) region + cap,
+        .env_start   = values[8],
+        .env_end     = values[9],
+        .auxv        = NULL,  // kept as is
+        .auxv_size   = 0,
+        .exe_fd      = (unsigned) -1,
+    };
+
+    errno = 0;
+    if (prctl(PR_SET_MM, PR_SET_MM_MAP, (unsigned long) &map, sizeof(map),
+              0) != 0)
+        return EXIT_FAILURE;
+    return 0;
+}
+
+// sets up title with an initial text, argv is only touched as a fallback
+// when the kernel refuses PR_SET_MM_MAP: the title is then written over the
+// original arguments and is as long as they are, so copy what is still
+// needed of them first
+static inline int proctitle_init(proctitle_t* title, int argc, char* argv[],
+                                 const char* initial)
+{
+    if (title == NULL || argv == NULL || argc < 1 || initial == NULL)
+    {
+        fprintf(stderr, "[proctitle_init] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(title, 0, sizeof(*title));
+
+    errno = 0;
+    char* region = (char*) mmap(NULL, PROCTITLE_MAX, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+        PRINT_ERROR("[proctitle_init] Mapping of title region failed\n");
+
+    memset(region, ' ', PROCTITLE_MAX);
+    region[0] = '\0';
+    if (proctitle_map(region, PROCTITLE_MAX) == 0)
+    {
+        title->region = region;
+        title->cap    = PROCTITLE_MAX;
+        title->mapped = 1;
+    }
+    else
+    {
+        munmap(region, PROCTITLE_MAX);
+
+        // the kernel lays the arguments out back to back
+        char* end = argv[argc - 1] + strlen(argv[argc - 1]) + 1;
+        title->region = argv[0];
+        title->cap    = end - argv[0];
+        if (title->cap < 2)
+        {
+            fprintf(stderr, "[proctitle_init] No room for a title\n");
+            return EXIT_FAILURE;
+        }
+        memset(title->region, ' ', title->cap);
+        title->region[0] = '\0';
+    }
+
+    size_t len = strlen(initial);
+    if (len > title->cap - 2)
+        len = title->cap - 2;
+    memcpy(title->region, initial, len);
+    title->region[len] = '\0';
+    return 0;
+}
+
+// replaces the title, longer text is cut; formatting goes straight into the
+// region so the old title is never seen past the new NUL
+static inline int proctitle_set(proctitle_t* title, const char* format, ...)
+{
+    if (title == NULL || title->region == NULL || format == NULL)
+        return EXIT_FAILURE;
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(title->region, title->cap - 1, format, args);
+    va_end(args);
+
+    return (len < 0) ? EXIT_FAILURE : 0;
+}
+
+#endif // ARGV0_PROCTITLE_H
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Reproducible ext2_reader benchmark: builds both tools, generates the same
+# images from fixed seeds and runs the bench mode on each of them.
+# Usage: ./bench.sh [work_dir] [iterations]
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+WORK=${1:-/tmp/ext2_bench}
+ITERS=${2:-3}
+
+mkdir -p "$WORK"
+gcc -Wall -O2 -o "$WORK/ext2_gen" "$DIR/ext2_gen.c" -lm
+gcc -Wall -O2 -pthread -o "$WORK/read_ext2" "$DIR/ext2_reader.c"
+
+# name block_size revision files fanout size_dist fragmentation sparse_size;
+# the sparse file has holes down to whole indirect subtrees
+while read -r name bs rev files fanout dist frag sparse; do
+    img="$WORK/$name.img"
+    "$WORK/ext2_gen" -b "$bs" -r "$rev" -n "$files" -d "$fanout" \
+                     -s "$dist" -f "$frag" -H "$sparse" -x 1 -S 256 \
+                     "$img" > /dev/null
+    echo "== $name"
+    "$WORK/read_ext2" "$img" bench "$ITERS"
+    "$WORK/read_ext2" "$img" bench 1 cold
+done <<IMAGES
+small_1k    1024 0 5000  100  exp:4096        0  20971520
+small_4k    4096 1 5000  100  exp:4096        0  20971520
+mixed_2k    2048 1 2000  50   uniform:0:131072 25 20971520
+wide_dir_1k 1024 1 10000 5000 fixed:512       0  0
+large_1k    1024 1 4     4    fixed:33554432  50 0
+large_4k    4096 1 4     4    fixed:33554432  50 0
+IMAGES
@@ -0,0 +1,359 @@
+#ifndef EXT2_DIGEST_H
+#define EXT2_DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Streaming digests used by the hashing modes of ext2_reader.
+// Every algorithm has the same init/update/final shape so a pipeline stage can
+// switch between them through digest_t without knowing which one it runs.
+////////////////////////////////////////////////////////////////////////////////
+
+enum DIGEST_ALGO{
+    DIGEST_SHA256 = 0,
+    DIGEST_XXH64  = 1,
+};
+
+#define SHA256_DIGEST_SIZE 32
+#define XXH64_DIGEST_SIZE  8
+#define DIGEST_MAX_SIZE    SHA256_DIGEST_SIZE
+
+////////////////////////////////////////////////////////////////////////////////
+// SHA-256 (FIPS 180-4)
+////////////////////////////////////////////////////////////////////////////////
+typedef struct sha256_ctx
+{
+    uint32_t state[8];
+    uint64_t total;
+    uint8_t  block[64];
+    size_t   filled;
+} sha256_ctx_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_compress(uint32_t* state, const uint8_t* block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+               ((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t s1  = SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25);
+        uint32_t ch  = (e & f) ^ (~e & g);
+        uint32_t t1  = h + s1 + ch + sha256_k[i] + w[i];
+        uint32_t s0  = SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2  = s0 + maj;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void sha256_init(sha256_ctx_t* ctx)
+{
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->total  = 0;
+    ctx->filled = 0;
+}
+
+static void sha256_update(sha256_ctx_t* ctx, const uint8_t* data, size_t size)
+{
+    ctx->total += size;
+
+    if (ctx->filled > 0)
+    {
+        size_t part = 64 - ctx->filled;
+        if (part > size)
+            part = size;
+
+        memcpy(ctx->block + ctx->filled, data, part);
+        ctx->filled += part;
+        data += part;
+        size -= part;
+
+        if (ctx->filled < 64)
+            return;
+
+        sha256_compress(ctx->state, ctx->block);
+        ctx->filled = 0;
+    }
+
+    for (; size >= 64; data += 64, size -= 64)
+        sha256_compress(ctx->state, data);
+
+    memcpy(ctx->block, data, size);
+    ctx->filled = size;
+}
+
+static void sha256_final(sha256_ctx_t* ctx, uint8_t* out)
+{
+    uint64_t bits = ctx->total * 8;
+
+    ctx->block[ctx->filled++] = 0x80;
+    if (ctx->filled > 56)
+    {
+        memset(ctx->block + ctx->filled, 0, 64 - ctx->filled);
+        sha256_compress(ctx->state, ctx->block);
+        ctx->filled = 0;
+    }
+
+    memset(ctx->block + ctx->filled, 0, 56 - ctx->filled);
+    for (int i = 0; i < 8; i++)
+        ctx->block[56 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_compress(ctx->state, ctx->block);
+
+    for (int i = 0; i < 8; i++)
+    {
+        out[4 * i]     = (uint8_t)(ctx->state[i] >> 24);
+        out[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        out[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        out[4 * i + 3] = (uint8_t)(ctx->state[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// XXH64
+////////////////////////////////////////////////////////////////////////////////
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+typedef struct xxh64_ctx
+{
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t  block[32];
+    size_t   filled;
+} xxh64_ctx_t;
+
+static inline uint64_t xxh64_read64(const uint8_t* p)
+{
+    uint64_t val;
+    memcpy(&val, p, sizeof(val));
+    return val; // ext2 hosts are little endian, same as the xxhash spec
+}
+
+static inline uint32_t xxh64_read32(const uint8_t* p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc  = XXH_ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh64_init(xxh64_ctx_t* ctx, uint64_t seed)
+{
+    ctx->v[0]   = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    ctx->v[1]   = seed + XXH_PRIME64_2;
+    ctx->v[2]   = seed;
+    ctx->v[3]   = seed - XXH_PRIME64_1;
+    ctx->seed   = seed;
+    ctx->total  = 0;
+    ctx->filled = 0;
+}
+
+static inline void xxh64_stripe(uint64_t* v, const uint8_t* p)
+{
+    v[0] = xxh64_round(v[0], xxh64_read64(p));
+    v[1] = xxh64_round(v[1], xxh64_read64(p + 8));
+    v[2] = xxh64_round(v[2], xxh64_read64(p + 16));
+    v[3] = xxh64_round(v[3], xxh64_read64(p + 24));
+}
+
+static void xxh64_update(xxh64_ctx_t* ctx, const uint8_t* data, size_t size)
+{
+    ctx->total += size;
+
+    if (ctx->filled > 0)
+    {
+        size_t part = 32 - ctx->filled;
+        if (part > size)
+            part = size;
+
+        memcpy(ctx->block + ctx->filled, data, part);
+        ctx->filled += part;
+        data += part;
+        size -= part;
+
+        if (ctx->filled < 32)
+            return;
+
+        xxh64_stripe(ctx->v, ctx->block);
+        ctx->filled = 0;
+    }
+
+    for (; size >= 32; data += 32, size -= 32)
+        xxh64_stripe(ctx->v, data);
+
+    memcpy(ctx->block, data, size);
+    ctx->filled = size;
+}
+
+static uint64_t xxh64_digest(const xxh64_ctx_t* ctx)
+{
+    uint64_t h64 = 0;
+    if (ctx->total >= 32)
+    {
+        h64 = XXH_ROTL64(ctx->v[0], 1)  + XXH_ROTL64(ctx->v[1], 7) +
+              XXH_ROTL64(ctx->v[2], 12) + XXH_ROTL64(ctx->v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h64 = xxh64_merge_round(h64, ctx->v[i]);
+    }
+    else
+        h64 = ctx->seed + XXH_PRIME64_5;
+
+    h64 += ctx->total;
+
+    const uint8_t* p   = ctx->block;
+    const uint8_t* end = ctx->block + ctx->filled;
+
+    for (; p + 8 <= end; p += 8)
+    {
+        h64 ^= xxh64_round(0, xxh64_read64(p));
+        h64  = XXH_ROTL64(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+
+    if (p + 4 <= end)
+    {
+        h64 ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+        h64  = XXH_ROTL64(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    for (; p < end; p++)
+    {
+        h64 ^= (*p) * XXH_PRIME64_5;
+        h64  = XXH_ROTL64(h64, 11) * XXH_PRIME64_1;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= XXH_PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= XXH_PRIME64_3;
+    h64 ^= h64 >> 32;
+
+    return h64;
+}
+
+static inline uint64_t xxh64(const uint8_t* data, size_t size, uint64_t seed)
+{
+    xxh64_ctx_t ctx;
+    xxh64_init(&ctx, seed);
+    xxh64_update(&ctx, data, size);
+    return xxh64_digest(&ctx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// algorithm-agnostic wrapper
+////////////////////////////////////////////////////////////////////////////////
+typedef struct digest
+{
+    int algo;
+    union {
+        sha256_ctx_t sha256;
+        xxh64_ctx_t  xxh64;
+    } ctx;
+} digest_t;
+
+static inline size_t digest_size(int algo)
+{
+    return (algo == DIGEST_XXH64) ? XXH64_DIGEST_SIZE : SHA256_DIGEST_SIZE;
+}
+
+static void digest_init(digest_t* dg, int algo)
+{
+    dg->algo = algo;
+    if (algo == DIGEST_XXH64)
+        xxh64_init(&dg->ctx.xxh64, 0);
+    else
+        sha256_init(&dg->ctx.sha256);
+}
+
+static void digest_update(digest_t* dg, const uint8_t* data, size_t size)
+{
+    if (dg->algo == DIGEST_XXH64)
+        xxh64_update(&dg->ctx.xxh64, data, size);
+    else
+        sha256_update(&dg->ctx.sha256, data, size);
+}
+
+// writes digest_size(algo) bytes, xxh64 is stored big endian as xxhsum prints
+static void digest_final(digest_t* dg, uint8_t* out)
+{
+    if (dg->algo == DIGEST_XXH64)
+    {
+        uint64_t h64 = xxh64_digest(&dg->ctx.xxh64);
+        for (int i = 0; i < 8; i++)
+            out[i] = (uint8_t)(h64 >> (56 - 8 * i));
+    }
+    else
+        sha256_final(&dg->ctx.sha256, out);
+}
+
+static void digest_to_hex(const uint8_t* digest, size_t size, char* hex)
+{
+    static const char hex_chars[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++)
+    {
+        hex[2 * i]     = hex_chars[digest[i] >> 4];
+        hex[2 * i + 1] = hex_chars[digest[i] & 0x0F];
+    }
+    hex[2 * size] = '\0';
+}
+
+#endif // EXT2_DIGEST_H
@@ -9,8 +9,76 @@ const size_t BOOT_RECORD = 1024;
 
 #define EXT2_SUPER_MAGIC 0xEF53
 
+#define EXT2_S_IFMT  0xF000
 #define EXT2_S_IFDIR 0x4000
 #define EXT2_S_IFREG 0x8000
+#define EXT2_S_IFLNK 0xA000
+#define EXT2_S_IFCHR 0x2000
+#define EXT2_S_IFBLK 0x6000
+#define EXT2_S_IFIFO 0x1000
+
+#define EXT2_S_ISDIR(mode) (((mode) & EXT2_S_IFMT) == EXT2_S_IFDIR)
+#define EXT2_S_ISREG(mode) (((mode) & EXT2_S_IFMT) == EXT2_S_IFREG)
+
+#define EXT2_ROOT_INO 2
+
+#define EXT2_NAME_LEN 255
+
+// features understood by the reader
+#define EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+
+// uninit_bg: bg_flags and bg_itable_unused are valid, the kernel leaves
+// the bitmaps and inode tables they mark unwritten
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM      0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+
+#define EXT4_FEATURE_INCOMPAT_EXTENTS        0x0040
+#define EXT4_FEATURE_INCOMPAT_64BIT          0x0080
+#define EXT4_FEATURE_INCOMPAT_FLEX_BG        0x0200
+
+#define EXT2_FEATURE_INCOMPAT_SUPP (EXT2_FEATURE_INCOMPAT_FILETYPE | \
+                                    EXT4_FEATURE_INCOMPAT_EXTENTS  | \
+                                    EXT4_FEATURE_INCOMPAT_64BIT    | \
+                                    EXT4_FEATURE_INCOMPAT_FLEX_BG)
+
+// bg_flags
+#define EXT4_BG_INODE_UNINIT 0x0001 // inode bitmap and table not initialized
+#define EXT4_BG_BLOCK_UNINIT 0x0002 // block bitmap not initialized
+#define EXT4_BG_INODE_ZEROED 0x0004 // inode table zeroed
+
+#define EXT2_MIN_DESC_SIZE 32
+#define EXT4_MIN_DESC_SIZE_64BIT 64
+
+// i_flags: i_block holds an extent tree instead of block pointers
+#define EXT4_EXTENTS_FL 0x00080000
+
+#define EXT4_EXT_MAGIC     0xF30A
+#define EXT4_EXT_MAX_DEPTH 5
+#define EXT4_EXT_INIT_MAX_LEN 32768 // longer ee_len marks unwritten extent
+
+struct ext4_extent_header {
+	__le16	eh_magic;	/* EXT4_EXT_MAGIC */
+	__le16	eh_entries;	/* Number of valid entries */
+	__le16	eh_max;		/* Capacity of the node */
+	__le16	eh_depth;	/* 0 - entries are leaves */
+	__le32	eh_generation;
+};
+
+struct ext4_extent {
+	__le32	ee_block;	/* First logical block */
+	__le16	ee_len;		/* Number of blocks */
+	__le16	ee_start_hi;	/* Physical block, high 16 bits */
+	__le32	ee_start_lo;	/* Physical block, low 32 bits */
+};
+
+struct ext4_extent_idx {
+	__le32	ei_block;	/* First logical block of the subtree */
+	__le32	ei_leaf_lo;	/* Node block, low 32 bits */
+	__le16	ei_leaf_hi;	/* Node block, high 16 bits */
+	__u16	ei_unused;
+};
 
 // pointer to blocks and inderect blocks
 #define	EXT2_NDIR_BLOCKS		12
@@ -85,10 +153,13 @@ struct ext2_super_block {
 	__u32	s_hash_seed[4];		/* HTREE hash seed */
 	__u8	s_def_hash_version;	/* Default hash version to use */
 	__u8	s_reserved_char_pad;
-	__u16	s_reserved_word_pad;
+	__le16	s_desc_size;		/* Group descriptor size (64bit) */
 	__le32	s_default_mount_opts;
  	__le32	s_first_meta_bg; 	/* First metablock block group */
-	__u32	s_reserved[190];	/* Padding to the end of the block */
+	__le32	s_mkfs_time;		/* When the filesystem was created */
+	__le32	s_jnl_blocks[17];	/* Backup of the journal inode */
+	__le32	s_blocks_count_hi;	/* Blocks count, high 32 bits (64bit) */
+	__u32	s_reserved[171];	/* Padding to the end of the block */
 };
 
 struct ext2_inode {
@@ -153,8 +224,12 @@ struct ext2_group_desc
 	__le16	bg_free_blocks_count;	/* Free blocks count */
 	__le16	bg_free_inodes_count;	/* Free inodes count */
 	__le16	bg_used_dirs_count;	/* Directories count */
-	__le16	bg_pad;
-	__le32	bg_reserved[3];
+	__le16	bg_flags;		/* EXT4_BG_* flags */
+	__le32	bg_exclude_bitmap_lo;	/* Snapshot exclusion bitmap */
+	__le16	bg_block_bitmap_csum_lo;	/* Block bitmap checksum */
+	__le16	bg_inode_bitmap_csum_lo;	/* Inode bitmap checksum */
+	__le16	bg_itable_unused;	/* Unused inodes at the table end */
+	__le16	bg_checksum;		/* Descriptor checksum */
 };
 
 struct ext2_dir_entry {
@@ -0,0 +1,865 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/types.h>
+#include <fcntl.h>
+#include "ext2.h"
+#include <assert.h>
+#include <asm/byteorder.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// Synthetic ext2 image generator.
+// Builds a complete image in a plain file without mkfs: every group carries a
+// superblock and descriptor table copy, bitmaps and an inode table. Output is
+// fully determined by the arguments, so the same command line always gives
+// the same image for benchmarking.
+////////////////////////////////////////////////////////////////////////////////
+
+enum ERROR_CODES{
+    E_SUCCESS  = 0,
+    E_BADARGS  = -1,
+    E_BADALLOC = -2,
+    E_BADIO    = -3,
+    E_ERROR    = -4,
+};
+
+#define GEN_TIMESTAMP 1600000000
+
+enum SIZE_DIST{
+    DIST_FIXED   = 0,
+    DIST_UNIFORM = 1,
+    DIST_EXP     = 2,
+};
+
+typedef struct ext2_super_block super_block_t;
+typedef struct ext2_inode inode_t;
+typedef struct ext2_group_desc group_desc_t;
+typedef struct ext2_dir_entry_2 ext2_dir_entry_2;
+
+typedef struct gen_params
+{
+    const char* path;
+    size_t      block_size;
+    unsigned    revision;
+    size_t      inode_size;
+    int         filetype;
+    size_t      image_size;
+    size_t      num_files;
+    size_t      fanout;
+    int         dist;
+    size_t      size_a;     // fixed size, uniform min or exp mean
+    size_t      size_b;     // uniform max
+    unsigned    frag;       // percent of blocks allocated at a random place
+    size_t      sparse_size; // size of the sparse file in the root, 0 - none
+    uint64_t    seed;
+} gen_params_t;
+
+typedef struct gen_fs
+{
+    gen_params_t* params;
+    int           fd;
+    size_t        block_size;
+    size_t        first_data_block;
+    size_t        num_blocks;
+    size_t        num_groups;
+    size_t        blocks_per_group;
+    size_t        inodes_per_group;
+    size_t        num_inodes;
+    size_t        gdt_blocks;
+    size_t        itable_blocks;
+    uint8_t*      block_used;   // one byte per block
+    size_t        alloc_cursor;
+    size_t        free_blocks;
+    size_t        next_ino;
+    uint8_t*      inode_table;  // whole inode table, written at the end
+    group_desc_t* descs;
+    uint8_t*      buff;
+    uint64_t      rng;
+} gen_fs_t;
+
+typedef struct gen_dir
+{
+    uint32_t ino;
+    uint32_t parent;
+    uint8_t* data;
+    size_t   size;      // bytes used in data, always whole blocks
+    size_t   last_rec;  // offset of the last entry, its rec_len is stretched
+    size_t   cap;
+    size_t   num_subdirs;
+} gen_dir_t;
+
+static uint64_t gen_rand(gen_fs_t* fs)
+{
+    // xorshift64*
+    fs->rng ^= fs->rng >> 12;
+    fs->rng ^= fs->rng << 25;
+    fs->rng ^= fs->rng >> 27;
+    return fs->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static size_t gen_file_size(gen_fs_t* fs)
+{
+    gen_params_t* params = fs->params;
+    switch (params->dist)
+    {
+        case DIST_UNIFORM:
+            return params->size_a +
+                   gen_rand(fs) % (params->size_b - params->size_a + 1);
+
+        case DIST_EXP:
+        {
+            // inverse CDF with 53 bit uniform value
+            double u = (double)(gen_rand(fs) >> 11) / (double)(1ULL << 53);
+            double size = -(double)params->size_a * log(1.0 - u);
+            return (size > (double)UINT32_MAX) ? UINT32_MAX : (size_t)size;
+        }
+    }
+
+    return params->size_a;
+}
+
+static int gen_write(gen_fs_t* fs, const void* data, size_t size, off_t offset)
+{
+    assert(fs != NULL);
+
+    errno = 0;
+    ssize_t done = pwrite(fs->fd, data, size, offset);
+    if (done != (ssize_t)size)
+    {
+        perror("[gen_write] Writing image failed\n");
+        return E_BADIO;
+    }
+
+    return E_SUCCESS;
+}
+
+static inode_t* gen_inode(gen_fs_t* fs, uint32_t ino)
+{
+    assert(fs != NULL);
+    assert(ino >= 1 && ino <= fs->num_inodes);
+
+    return (inode_t*)(fs->inode_table + (ino - 1) * fs->params->inode_size);
+}
+
+static int gen_alloc_inode(gen_fs_t* fs, uint32_t* ino)
+{
+    assert(fs != NULL);
+    assert(ino != NULL);
+
+    if (fs->next_ino > fs->num_inodes)
+    {
+        fprintf(stderr, "[gen_alloc_inode] Out of inodes\n");
+        return E_ERROR;
+    }
+
+    *ino = fs->next_ino++;
+    return E_SUCCESS;
+}
+
+static int gen_alloc_block(gen_fs_t* fs, uint32_t* block)
+{
+    assert(fs != NULL);
+    assert(block != NULL);
+
+    if (fs->free_blocks == 0)
+    {
+        fprintf(stderr, "[gen_alloc_block] Image is too small\n");
+        return E_ERROR;
+    }
+
+    if (fs->params->frag > 0 && gen_rand(fs) % 100 < fs->params->frag)
+        fs->alloc_cursor = fs->first_data_block + gen_rand(fs) %
+                           (fs->num_blocks - fs->first_data_block);
+
+    while (fs->block_used[fs->alloc_cursor])
+    {
+        fs->alloc_cursor++;
+        if (fs->alloc_cursor == fs->num_blocks)
+            fs->alloc_cursor = fs->first_data_block;
+    }
+
+    fs->block_used[fs->alloc_cursor] = 1;
+    fs->free_blocks--;
+    *block = fs->alloc_cursor;
+    return E_SUCCESS;
+}
+
+// allocates blocks for size bytes in the order ext2 does (indirect block
+// before the data it maps) and writes data, data may be NULL for random bytes;
+// a sparse file gets only its first and last block, everything between is a
+// hole with 0 pointers, whole indirect subtrees included
+static int gen_write_file(gen_fs_t* fs, inode_t* inode, const uint8_t* data,
+                          size_t size, int sparse)
+{
+    assert(fs != NULL);
+    assert(inode != NULL);
+
+    size_t block_size = fs->block_size;
+    size_t ids_per_block = block_size / 4;
+    size_t num_blocks = (size + block_size - 1) / block_size;
+    size_t meta_blocks = 0;
+
+    // indirect blocks which are being filled at level 1..3, ind_key is the
+    // index of the block among those of its level in the current tree
+    uint32_t  ind_id[4] = {};
+    uint32_t* ind[4] = {};
+    size_t    ind_key[4] = {};
+    int       cur_depth = 0;
+    size_t    data_blocks = 0;
+    int       ret = E_SUCCESS;
+
+    for (int i = 1; i <= 3; i++)
+    {
+        errno = 0;
+        ind[i] = (uint32_t*) malloc(block_size);
+        if (ind[i] == NULL)
+        {
+            perror("[gen_write_file] Allocation of indirect block failed\n");
+            ret = E_BADALLOC;
+        }
+    }
+
+    for (size_t blk = 0; blk < num_blocks && ret == E_SUCCESS; blk++)
+    {
+        if (sparse && blk != 0 && blk != num_blocks - 1)
+            continue;
+
+        int depth = 0;
+        size_t rel = blk;
+        if (rel >= EXT2_NDIR_BLOCKS)
+        {
+            rel -= EXT2_NDIR_BLOCKS;
+            depth = 1;
+            size_t span = ids_per_block;
+            while (rel >= span && depth < 3)
+            {
+                rel -= span;
+                span *= ids_per_block;
+                depth++;
+            }
+        }
+
+        // an indirect block of level L maps ipb^L data blocks, so a new one
+        // starts whenever rel / ipb^L changes, and each tree starts afresh
+        if (depth != cur_depth)
+        {
+            for (int level = 1; level <= 3; level++)
+                ind_key[level] = SIZE_MAX;
+            cur_depth = depth;
+        }
+
+        for (int level = depth; level >= 1 && ret == E_SUCCESS; level--)
+        {
+            size_t level_span = 1;
+            for (int i = 0; i < level; i++)
+                level_span *= ids_per_block;
+
+            if (ind_key[level] == rel / level_span)
+                continue;
+
+            uint32_t id = 0;
+            ret = gen_alloc_block(fs, &id);
+            if (ret != E_SUCCESS)
+                break;
+            meta_blocks++;
+
+            if (level == depth)
+                inode->i_block[EXT2_NDIR_BLOCKS + depth - 1] = __cpu_to_le32(id);
+            else
+                ind[level + 1][(rel / level_span) % ids_per_block] =
+                    __cpu_to_le32(id);
+
+            if (ind_id[level] != 0)
+                ret = gen_write(fs, ind[level], block_size,
+                                (off_t)ind_id[level] * block_size);
+            ind_id[level]  = id;
+            ind_key[level] = rel / level_span;
+            memset(ind[level], 0, block_size);
+        }
+        if (ret != E_SUCCESS)
+            break;
+
+        uint32_t id = 0;
+        ret = gen_alloc_block(fs, &id);
+        if (ret != E_SUCCESS)
+            break;
+
+        data_blocks++;
+
+        if (depth == 0)
+            inode->i_block[blk] = __cpu_to_le32(id);
+        else
+            ind[1][rel % ids_per_block] = __cpu_to_le32(id);
+
+        size_t part = block_size;
+        if ((blk + 1) * block_size > size)
+            part = size - blk * block_size;
+
+        if (data != NULL)
+            memcpy(fs->buff, data + blk * block_size, part);
+        else
+            for (size_t i = 0; i < part; i += 8)
+            {
+                uint64_t val = gen_rand(fs);
+                memcpy(fs->buff + i, &val, (part - i < 8) ? part - i : 8);
+            }
+        memset(fs->buff + part, 0, block_size - part);
+
+        ret = gen_write(fs, fs->buff, block_size, (off_t)id * block_size);
+    }
+
+    for (int level = 1; level <= 3; level++)
+    {
+        if (ret == E_SUCCESS && ind_id[level] != 0)
+            ret = gen_write(fs, ind[level], block_size,
+                            (off_t)ind_id[level] * block_size);
+        free(ind[level]);
+    }
+
+    inode->i_size   = __cpu_to_le32(size);
+    inode->i_blocks = __cpu_to_le32((data_blocks + meta_blocks) *
+                                    (block_size / 512));
+    return ret;
+}
+
+static void gen_init_inode(inode_t* inode, uint16_t mode, uint16_t links)
+{
+    assert(inode != NULL);
+
+    inode->i_mode        = __cpu_to_le16(mode);
+    inode->i_links_count = __cpu_to_le16(links);
+    inode->i_atime       = __cpu_to_le32(GEN_TIMESTAMP);
+    inode->i_ctime       = __cpu_to_le32(GEN_TIMESTAMP);
+    inode->i_mtime       = __cpu_to_le32(GEN_TIMESTAMP);
+}
+
+static int gen_dir_add(gen_fs_t* fs, gen_dir_t* dir, uint32_t ino,
+                       uint8_t file_type, const char* name)
+{
+    assert(fs != NULL);
+    assert(dir != NULL);
+
+    size_t block_size = fs->block_size;
+    size_t name_len = strlen(name);
+    size_t rec_len = (8 + name_len + 3) & ~(size_t)3;
+
+    // the last entry of a block owns the rest of it
+    size_t block_start = (dir->size == 0) ? 0 : dir->size - block_size;
+    size_t pos = block_start;
+    if (dir->size != 0)
+    {
+        ext2_dir_entry_2* last = (ext2_dir_entry_2*)(dir->data + dir->last_rec);
+        size_t last_name = (fs->params->revision == EXT2_GOOD_OLD_REV) ?
+            __le16_to_cpu(((struct ext2_dir_entry*)last)->name_len) :
+            last->name_len;
+        size_t last_len = (8 + last_name + 3) & ~(size_t)3;
+        pos = dir->last_rec + last_len;
+
+        if (pos + rec_len > block_start + block_size)
+            pos = dir->size;
+        else
+            last->rec_len = __cpu_to_le16(last_len);
+    }
+
+    if (pos == dir->size)
+    {
+        if (dir->size + block_size > dir->cap)
+        {
+            size_t new_cap = (dir->cap == 0) ? block_size : 2 * dir->cap;
+            errno = 0;
+            uint8_t* new_data = (uint8_t*) realloc(dir->data, new_cap);
+            if (new_data == NULL)
+            {
+                perror("[gen_dir_add] Reallocation of directory failed\n");
+                return E_BADALLOC;
+            }
+            dir->data = new_data;
+            dir->cap  = new_cap;
+        }
+
+        memset(dir->data + dir->size, 0, block_size);
+        block_start = dir->size;
+        dir->size  += block_size;
+    }
+
+    ext2_dir_entry_2* entry = (ext2_dir_entry_2*)(dir->data + pos);
+    entry->inode   = __cpu_to_le32(ino);
+    entry->rec_len = __cpu_to_le16(block_start + block_size - pos);
+    if (fs->params->revision == EXT2_GOOD_OLD_REV)
+        ((struct ext2_dir_entry*)entry)->name_len = __cpu_to_le16(name_len);
+    else
+    {
+        entry->name_len  = name_len;
+        entry->file_type = fs->params->filetype ? file_type : 0;
+    }
+    memcpy(entry->name, name, name_len);
+
+    dir->last_rec = pos;
+    return E_SUCCESS;
+}
+
+static int gen_layout(gen_fs_t* fs)
+{
+    assert(fs != NULL);
+
+    gen_params_t* params = fs->params;
+    size_t block_size = params->block_size;
+
+    fs->block_size       = block_size;
+    fs->first_data_block = (block_size == 1024) ? 1 : 0;
+    fs->blocks_per_group = 8 * block_size;
+    fs->num_blocks       = params->image_size / block_size;
+    fs->num_groups       = (fs->num_blocks - fs->first_data_block +
+                            fs->blocks_per_group - 1) / fs->blocks_per_group;
+
+    size_t inodes_per_block = block_size / params->inode_size;
+    size_t need_inodes = EXT2_GOOD_OLD_FIRST_INO + 2 + params->num_files +
+                         params->num_files / (params->fanout ? params->fanout : 1) + 1;
+    size_t want_inodes = params->image_size / 8192;
+    if (want_inodes < need_inodes)
+        want_inodes = need_inodes;
+
+    size_t ipg = (want_inodes + fs->num_groups - 1) / fs->num_groups;
+    ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+    ipg = (ipg + 7) & ~(size_t)7;
+    if (ipg > 8 * block_size)
+    {
+        fprintf(stderr, "[gen_layout] Too many files for image size\n");
+        return E_BADARGS;
+    }
+
+    fs->inodes_per_group = ipg;
+    fs->num_inodes       = ipg * fs->num_groups;
+    fs->gdt_blocks       = (fs->num_groups * sizeof(group_desc_t) +
+                            block_size - 1) / block_size;
+    fs->itable_blocks    = ipg * params->inode_size / block_size;
+
+    // last group has to hold at least its metadata and one data block
+    size_t overhead = 1 + fs->gdt_blocks + 2 + fs->itable_blocks;
+    size_t last_start = fs->first_data_block +
+                        (fs->num_groups - 1) * fs->blocks_per_group;
+    if (fs->num_blocks - last_start <= overhead)
+    {
+        fs->num_blocks = last_start;
+        fs->num_groups--;
+        fs->num_inodes = ipg * fs->num_groups;
+        if (fs->num_groups == 0 || fs->num_inodes < need_inodes)
+        {
+            fprintf(stderr, "[gen_layout] Image is too small\n");
+            return E_BADARGS;
+        }
+    }
+
+    errno = 0;
+    fs->block_used  = (uint8_t*) calloc(fs->num_blocks, 1);
+    fs->inode_table = (uint8_t*) calloc(fs->num_inodes, params->inode_size);
+    fs->descs       = (group_desc_t*) calloc(fs->gdt_blocks * block_size, 1);
+    fs->buff        = (uint8_t*) malloc(block_size);
+    if (fs->block_used == NULL || fs->inode_table == NULL ||
+        fs->descs == NULL || fs->buff == NULL)
+    {
+        perror("[gen_layout] Allocation failed\n");
+        return E_BADALLOC;
+    }
+
+    for (size_t blk = 0; blk < fs->first_data_block; blk++)
+        fs->block_used[blk] = 1;
+
+    fs->free_blocks = fs->num_blocks - fs->first_data_block;
+    for (size_t group = 0; group < fs->num_groups; group++)
+    {
+        size_t start = fs->first_data_block + group * fs->blocks_per_group;
+        group_desc_t* desc = &fs->descs[group];
+        desc->bg_block_bitmap = __cpu_to_le32(start + 1 + fs->gdt_blocks);
+        desc->bg_inode_bitmap = __cpu_to_le32(start + 2 + fs->gdt_blocks);
+        desc->bg_inode_table  = __cpu_to_le32(start + 3 + fs->gdt_blocks);
+
+        for (size_t blk = start; blk < start + overhead; blk++)
+            fs->block_used[blk] = 1;
+        fs->free_blocks -= overhead;
+    }
+
+    fs->alloc_cursor = fs->first_data_block;
+    fs->next_ino     = EXT2_GOOD_OLD_FIRST_INO + 1;
+    return E_SUCCESS;
+}
+
+static int gen_write_metadata(gen_fs_t* fs, size_t num_dirs)
+{
+    assert(fs != NULL);
+
+    gen_params_t* params = fs->params;
+    size_t block_size = fs->block_size;
+    size_t used_inodes = fs->next_ino - 1;
+
+    super_block_t sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.s_inodes_count      = __cpu_to_le32(fs->num_inodes);
+    sb.s_blocks_count      = __cpu_to_le32(fs->num_blocks);
+    sb.s_free_blocks_count = __cpu_to_le32(fs->free_blocks);
+    sb.s_free_inodes_count = __cpu_to_le32(fs->num_inodes - used_inodes);
+    sb.s_first_data_block  = __cpu_to_le32(fs->first_data_block);
+    sb.s_log_block_size    = __cpu_to_le32(__builtin_ctzl(block_size) - 10);
+    sb.s_log_frag_size     = sb.s_log_block_size;
+    sb.s_blocks_per_group  = __cpu_to_le32(fs->blocks_per_group);
+    sb.s_frags_per_group   = __cpu_to_le32(fs->blocks_per_group);
+    sb.s_inodes_per_group  = __cpu_to_le32(fs->inodes_per_group);
+    sb.s_wtime             = __cpu_to_le32(GEN_TIMESTAMP);
+    sb.s_max_mnt_count     = __cpu_to_le16(0xFFFF);
+    sb.s_magic             = __cpu_to_le16(EXT2_SUPER_MAGIC);
+    sb.s_state             = __cpu_to_le16(1);
+    sb.s_errors            = __cpu_to_le16(1);
+    sb.s_lastcheck         = __cpu_to_le32(GEN_TIMESTAMP);
+    sb.s_rev_level         = __cpu_to_le32(params->revision);
+    if (params->revision != EXT2_GOOD_OLD_REV)
+    {
+        sb.s_first_ino  = __cpu_to_le32(EXT2_GOOD_OLD_FIRST_INO);
+        sb.s_inode_size = __cpu_to_le16(params->inode_size);
+        if (params->filetype)
+            sb.s_feature_incompat = __cpu_to_le32(EXT2_FEATURE_INCOMPAT_FILETYPE);
+    }
+    for (size_t i = 0; i < sizeof(sb.s_uuid); i++)
+        sb.s_uuid[i] = (uint8_t)(params->seed >> (8 * (i % 8))) ^ (uint8_t)(i * 37);
+
+    errno = 0;
+    uint8_t* bitmap = (uint8_t*) malloc(block_size);
+    if (bitmap == NULL)
+    {
+        perror("[gen_write_metadata] Allocation of bitmap failed\n");
+        return E_BADALLOC;
+    }
+
+    int ret = E_SUCCESS;
+    for (size_t group = 0; group < fs->num_groups && ret == E_SUCCESS; group++)
+    {
+        size_t start = fs->first_data_block + group * fs->blocks_per_group;
+        group_desc_t* desc = &fs->descs[group];
+
+        // block bitmap, bits past the end of the image are set
+        memset(bitmap, 0, block_size);
+        size_t free_blocks = 0;
+        for (size_t i = 0; i < fs->blocks_per_group; i++)
+        {
+            size_t blk = start + i;
+            if (blk >= fs->num_blocks || fs->block_used[blk])
+                bitmap[i / 8] |= 1 << (i % 8);
+            else
+                free_blocks++;
+        }
+        desc->bg_free_blocks_count = __cpu_to_le16(free_blocks);
+        ret = gen_write(fs, bitmap, block_size,
+                  (off_t)__le32_to_cpu(desc->bg_block_bitmap) * block_size);
+
+        // inode bitmap, bits past inodes_per_group are set
+        memset(bitmap, 0, block_size);
+        size_t free_inodes = 0;
+        for (size_t i = 0; i < 8 * block_size; i++)
+        {
+            size_t ino = group * fs->inodes_per_group + i + 1;
+            if (i >= fs->inodes_per_group || ino <= used_inodes)
+                bitmap[i / 8] |= 1 << (i % 8);
+            else
+                free_inodes++;
+        }
+        desc->bg_free_inodes_count = __cpu_to_le16(free_inodes);
+
+        size_t dirs = 0;
+        for (size_t i = 0; i < fs->inodes_per_group; i++)
+        {
+            inode_t* inode = gen_inode(fs, group * fs->inodes_per_group + i + 1);
+            if (EXT2_S_ISDIR(__le16_to_cpu(inode->i_mode)))
+                dirs++;
+        }
+        desc->bg_used_dirs_count = __cpu_to_le16(dirs);
+
+        if (ret == E_SUCCESS)
+            ret = gen_write(fs, bitmap, block_size,
+                  (off_t)__le32_to_cpu(desc->bg_inode_bitmap) * block_size);
+        if (ret == E_SUCCESS)
+            ret = gen_write(fs, fs->inode_table +
+                  group * fs->inodes_per_group * params->inode_size,
+                  fs->itable_blocks * block_size,
+                  (off_t)__le32_to_cpu(desc->bg_inode_table) * block_size);
+    }
+
+    // every group keeps a copy of the superblock and descriptors
+    for (size_t group = 0; group < fs->num_groups && ret == E_SUCCESS; group++)
+    {
+        size_t start = fs->first_data_block + group * fs->blocks_per_group;
+        sb.s_block_group_nr = __cpu_to_le16(group);
+
+        off_t sb_offset = (group == 0) ? BOOT_RECORD : (off_t)start * block_size;
+        ret = gen_write(fs, &sb, sizeof(sb), sb_offset);
+        if (ret == E_SUCCESS)
+            ret = gen_write(fs, fs->descs, fs->gdt_blocks * block_size,
+                            (off_t)(start + 1) * block_size);
+    }
+
+    free(bitmap);
+    return ret;
+}
+
+static int gen_image(gen_params_t* params)
+{
+    assert(params != NULL);
+
+    gen_fs_t fs = {.params = params, .rng = params->seed ? params->seed : 1};
+    int ret = gen_layout(&fs);
+
+    size_t fanout = params->fanout;
+    size_t num_dirs = (params->num_files + fanout - 1) / fanout;
+    if (num_dirs == 0)
+        num_dirs = 1;
+
+    // dirs[0] is the root, dir i > 0 is a child of dir (i - 1) / fanout and
+    // file j lives in dir j / fanout
+    errno = 0;
+    gen_dir_t* dirs = (gen_dir_t*) calloc(num_dirs, sizeof(gen_dir_t));
+    if (dirs == NULL)
+    {
+        perror("[gen_image] Allocation of directories failed\n");
+        ret = E_BADALLOC;
+    }
+
+    if (ret == E_SUCCESS)
+    {
+        errno = 0;
+        fs.fd = open(params->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fs.fd < 0 || ftruncate(fs.fd, (off_t)fs.num_blocks * fs.block_size) < 0)
+        {
+            perror("[gen_image] Creating image failed\n");
+            ret = E_BADIO;
+        }
+    }
+
+    // reserved inodes are plain zeros, except root and lost+found
+    gen_dir_t lost = {.ino = EXT2_GOOD_OLD_FIRST_INO, .parent = EXT2_ROOT_INO};
+    if (ret == E_SUCCESS)
+    {
+        dirs[0].ino    = EXT2_ROOT_INO;
+        dirs[0].parent = EXT2_ROOT_INO;
+        fs.next_ino    = EXT2_GOOD_OLD_FIRST_INO + 1;
+
+        ret = gen_dir_add(&fs, &lost, lost.ino, 2, ".");
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &lost, lost.parent, 2, "..");
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &dirs[0], EXT2_ROOT_INO, 2, ".");
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &dirs[0], EXT2_ROOT_INO, 2, "..");
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &dirs[0], lost.ino, 2, "lost+found");
+        dirs[0].num_subdirs = 1;
+    }
+
+    char name[32];
+    for (size_t i = 1; i < num_dirs && ret == E_SUCCESS; i++)
+    {
+        gen_dir_t* parent = &dirs[(i - 1) / fanout];
+        ret = gen_alloc_inode(&fs, &dirs[i].ino);
+        dirs[i].parent = parent->ino;
+
+        snprintf(name, sizeof(name), "d%lu", i);
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, parent, dirs[i].ino, 2, name);
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &dirs[i], dirs[i].ino, 2, ".");
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &dirs[i], parent->ino, 2, "..");
+        parent->num_subdirs++;
+    }
+
+    uint64_t total_size = 0;
+    for (size_t j = 0; j < params->num_files && ret == E_SUCCESS; j++)
+    {
+        uint32_t ino = 0;
+        ret = gen_alloc_inode(&fs, &ino);
+        if (ret != E_SUCCESS)
+            break;
+
+        snprintf(name, sizeof(name), "f%lu", j);
+        ret = gen_dir_add(&fs, &dirs[j / fanout], ino, 1, name);
+        if (ret != E_SUCCESS)
+            break;
+
+        inode_t* inode = gen_inode(&fs, ino);
+        gen_init_inode(inode, EXT2_S_IFREG | 0644, 1);
+
+        size_t size = gen_file_size(&fs);
+        total_size += size;
+        ret = gen_write_file(&fs, inode, NULL, size, 0);
+    }
+
+    if (ret == E_SUCCESS && params->sparse_size > 0)
+    {
+        uint32_t ino = 0;
+        ret = gen_alloc_inode(&fs, &ino);
+        if (ret == E_SUCCESS)
+            ret = gen_dir_add(&fs, &dirs[0], ino, 1, "sparse");
+        if (ret == E_SUCCESS)
+        {
+            inode_t* inode = gen_inode(&fs, ino);
+            gen_init_inode(inode, EXT2_S_IFREG | 0644, 1);
+            total_size += params->sparse_size;
+            ret = gen_write_file(&fs, inode, NULL, params->sparse_size, 1);
+        }
+    }
+
+    for (size_t i = 0; i < num_dirs && ret == E_SUCCESS; i++)
+    {
+        inode_t* inode = gen_inode(&fs, dirs[i].ino);
+        gen_init_inode(inode, EXT2_S_IFDIR | 0755, 2 + dirs[i].num_subdirs);
+        ret = gen_write_file(&fs, inode, dirs[i].data, dirs[i].size, 0);
+    }
+
+    if (ret == E_SUCCESS)
+    {
+        inode_t* inode = gen_inode(&fs, lost.ino);
+        gen_init_inode(inode, EXT2_S_IFDIR | 0700, 2);
+        ret = gen_write_file(&fs, inode, lost.data, lost.size, 0);
+    }
+
+    if (ret == E_SUCCESS)
+        ret = gen_write_metadata(&fs, num_dirs + 1);
+
+    if (ret == E_SUCCESS)
+        fprintf(stderr, "blocks %lu groups %lu inodes %lu files %lu dirs %lu "
+                        "data %lu bytes\n", fs.num_blocks, fs.num_groups,
+                        fs.num_inodes, params->num_files, num_dirs + 1,
+                        total_size);
+
+    for (size_t i = 0; i < num_dirs && dirs != NULL; i++)
+        free(dirs[i].data);
+    free(dirs);
+    free(lost.data);
+    free(fs.block_used);
+    free(fs.inode_table);
+    free(fs.descs);
+    free(fs.buff);
+    if (fs.fd > 0)
+        close(fs.fd);
+
+    return ret;
+}
+
+static int parse_dist(const char* str, gen_params_t* params)
+{
+    assert(str != NULL);
+    assert(params != NULL);
+
+    unsigned long long a = 0, b = 0;
+    if (sscanf(str, "fixed:%llu", &a) == 1)
+        params->dist = DIST_FIXED;
+    else if (sscanf(str, "uniform:%llu:%llu", &a, &b) == 2 && a <= b)
+        params->dist = DIST_UNIFORM;
+    else if (sscanf(str, "exp:%llu", &a) == 1)
+        params->dist = DIST_EXP;
+    else
+        return E_BADARGS;
+
+    if (a > UINT32_MAX || b > UINT32_MAX)
+        return E_BADARGS;
+
+    params->size_a = a;
+    params->size_b = b;
+    return E_SUCCESS;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Try ./ext2_gen [options] image\n"
+            "  -b block_size   1024, 2048 or 4096 (1024)\n"
+            "  -r revision     0 or 1 (1)\n"
+            "  -I inode_size   128 or 256, revision 1 only (128)\n"
+            "  -t              set filetype feature, revision 1 only\n"
+            "  -S size_mb      image size in MiB (64)\n"
+            "  -n num_files    regular files (1000)\n"
+            "  -d fanout       entries per directory (100)\n"
+            "  -s dist         fixed:N, uniform:MIN:MAX or exp:MEAN (exp:16384)\n"
+            "  -f percent      blocks allocated at random places (0)\n"
+            "  -H size         add /sparse, a file of size bytes with data in\n"
+            "                  its first and last block only (0 - none)\n"
+            "  -x seed         random seed (1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    gen_params_t params = {
+        .block_size = 1024,
+        .revision   = EXT2_DYNAMIC_REV,
+        .inode_size = EXT2_GOOD_OLD_INODE_SIZE,
+        .image_size = 64 << 20,
+        .num_files  = 1000,
+        .fanout     = 100,
+        .dist       = DIST_EXP,
+        .size_a     = 16384,
+        .seed       = 1,
+    };
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "b:r:I:tS:n:d:s:f:H:x:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': params.block_size = strtoul(optarg, NULL, 10); break;
+            case 'r': params.revision   = strtoul(optarg, NULL, 10); break;
+            case 'I': params.inode_size = strtoul(optarg, NULL, 10); break;
+            case 't': params.filetype   = 1;                         break;
+            case 'S': params.image_size = strtoull(optarg, NULL, 10) << 20; break;
+            case 'n': params.num_files  = strtoul(optarg, NULL, 10); break;
+            case 'd': params.fanout     = strtoul(optarg, NULL, 10); break;
+            case 'f': params.frag       = strtoul(optarg, NULL, 10); break;
+            case 'H': params.sparse_size = strtoull(optarg, NULL, 10); break;
+            case 'x': params.seed       = strtoull(optarg, NULL, 10); break;
+            case 's':
+                if (parse_dist(optarg, &params) != E_SUCCESS)
+                {
+                    fprintf(stderr, "[main] Bad size distribution %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    params.path = argv[optind];
+
+    if ((params.block_size != 1024 && params.block_size != 2048 &&
+         params.block_size != 4096) ||
+        params.revision > EXT2_DYNAMIC_REV ||
+        (params.inode_size != 128 && params.inode_size != 256) ||
+        (params.revision == EXT2_GOOD_OLD_REV &&
+         (params.inode_size != 128 || params.filetype)) ||
+        params.fanout < 2 || params.frag > 100 ||
+        params.sparse_size > UINT32_MAX ||
+        params.image_size > ((size_t)params.block_size << 32) - 1)
+    {
+        fprintf(stderr, "[main] Bad parameters\n");
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    int err = gen_image(&params);
+    if (err != E_SUCCESS)
+    {
+        fprintf(stderr, "[main] %d: generating image failed\n", err);
+        exit(EXIT_FAILURE);
+    }
+
+    return 0;
+}
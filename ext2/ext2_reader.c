@@ -11,6 +11,15 @@
 #include <assert.h>
 #include <asm/byteorder.h>
 #include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <fnmatch.h>
+#include "digest.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // FUNCTION FORMAT
@@ -24,12 +33,14 @@ enum ERROR_CODES{
     E_BADALLOC = -2,
     E_BADIO    = -3,
     E_ERROR    = -4,
+    E_STOP     =  1, // callback asks iterator to stop, it is not an error
 };
 
-#ifdef NODEBUG
-#define Dprintf(args...) do {} while(0);
+// debug prints sit on hot paths, so they are compiled in only on request
+#ifdef DEBUG
+#define Dprintf(args...) do {fprintf(stderr, args);} while(0)
 #else
-#define Dprintf(args...) do {printf(args);} while(0);
+#define Dprintf(args...) do {} while(0)
 #endif
 
 typedef struct ext2_super_block super_block_t;
@@ -38,6 +49,35 @@ typedef struct ext2_group_desc group_desc_t;
 typedef struct ext2_dir_entry ext2_dir_entry;
 typedef struct ext2_dir_entry_2 ext2_dir_entry_2;
 
+////////////////////////////////////////////////////////////////////////////////
+// run statistics
+// Counters and per-phase latency histograms kept in ext2_fs_t. Nothing is
+// recorded unless --stats is given. Modes share fs between threads, so
+// updates are relaxed atomics.
+////////////////////////////////////////////////////////////////////////////////
+enum STAT_PHASES{
+    PHASE_SUPERBLOCK = 0, // reading and checking the superblock
+    PHASE_DESC       = 1, // group descriptor lookup
+    PHASE_MAP        = 2, // indirect block reads
+    PHASE_COPY       = 3, // data block reads and copies
+    NUM_PHASES,
+};
+
+// bucket i counts latencies in [2^i, 2^(i+1)) ns
+#define STAT_HIST_BUCKETS 32
+
+typedef struct ext2_stats
+{
+    int      enabled;
+    uint64_t reads;          // read_block() calls and stream preads
+    uint64_t read_bytes;
+    uint64_t indirect_reads;
+    uint64_t allocs;
+    uint64_t phase_count[NUM_PHASES];
+    uint64_t phase_ns[NUM_PHASES];
+    uint64_t hist[NUM_PHASES][STAT_HIST_BUCKETS];
+} ext2_stats_t;
+
 typedef struct ext2_fs
 {
     int            dev_fd;
@@ -49,8 +89,104 @@ typedef struct ext2_fs
     size_t         inodes_per_group;
     size_t         num_inodes;
     size_t         num_blocks;
+    group_desc_t*  descs;       // whole descriptor table, read at open
+    size_t         num_groups;
+    size_t         desc_size;   // on-disk descriptor size, 64 with 64bit
+    int            uninit_bg;   // bg_flags and bg_itable_unused valid
+    ext2_stats_t   stats;
 } ext2_fs_t;
 
+// returning anything but E_SUCCESS stops the iteration
+typedef int (*dir_entry_cb_t)(uint32_t ino, uint8_t file_type,
+                              const char* name, size_t name_len, void* ctx);
+
+// set by main before ext2_open(), every opened fs inherits it
+static int stats_requested = 0;
+
+#define STAT_ADD(fs, field, value)                                       \
+    do {                                                                 \
+        if ((fs)->stats.enabled)                                         \
+            __atomic_fetch_add(&(fs)->stats.field, (value),              \
+                               __ATOMIC_RELAXED);                        \
+    } while(0)
+
+static uint64_t stat_start(ext2_fs_t* fs)
+{
+    if (!fs->stats.enabled)
+        return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stat_stop(ext2_fs_t* fs, int phase, uint64_t start)
+{
+    if (!fs->stats.enabled)
+        return;
+
+    uint64_t ns = stat_start(fs) - start;
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= STAT_HIST_BUCKETS)
+        bucket = STAT_HIST_BUCKETS - 1;
+
+    ext2_stats_t* stats = &fs->stats;
+    __atomic_fetch_add(&stats->phase_count[phase], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->phase_ns[phase], ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->hist[phase][bucket], 1, __ATOMIC_RELAXED);
+}
+
+// folds counters of a secondary fs (diff mode) into the main one
+void ext2_stats_merge(ext2_stats_t* dst, const ext2_stats_t* src)
+{
+    if (dst == NULL || src == NULL)
+        return;
+
+    dst->reads          += src->reads;
+    dst->read_bytes     += src->read_bytes;
+    dst->indirect_reads += src->indirect_reads;
+    dst->allocs         += src->allocs;
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        dst->phase_count[i] += src->phase_count[i];
+        dst->phase_ns[i]    += src->phase_ns[i];
+        for (int j = 0; j < STAT_HIST_BUCKETS; j++)
+            dst->hist[i][j] += src->hist[i][j];
+    }
+}
+
+void ext2_stats_print(FILE* out, const ext2_stats_t* stats)
+{
+    static const char* phase_names[NUM_PHASES] = {
+        "superblock", "desc_lookup", "block_map", "data_copy"
+    };
+
+    if (out == NULL || stats == NULL)
+        return;
+
+    fprintf(out, "{\"reads\": %lu, \"read_bytes\": %lu, "
+                 "\"indirect_reads\": %lu, \"allocs\": %lu, \"phases\": {",
+                 stats->reads, stats->read_bytes, stats->indirect_reads,
+                 stats->allocs);
+
+    for (int i = 0; i < NUM_PHASES; i++)
+    {
+        int last = STAT_HIST_BUCKETS - 1;
+        while (last > 0 && stats->hist[i][last] == 0)
+            last--;
+
+        fprintf(out, "%s\"%s\": {\"count\": %lu, \"total_ns\": %lu, "
+                     "\"hist_log2_ns\": [", (i == 0) ? "" : ", ",
+                     phase_names[i], stats->phase_count[i],
+                     stats->phase_ns[i]);
+        for (int j = 0; j <= last; j++)
+            fprintf(out, "%s%lu", (j == 0) ? "" : ", ", stats->hist[i][j]);
+        fprintf(out, "]}");
+    }
+
+    fprintf(out, "}}\n");
+}
+
 int get_ext2_superblock(int dev_fd, super_block_t* sb)
 {
     if (dev_fd < 0)
@@ -90,7 +226,14 @@ static ssize_t read_block(size_t block_id, ext2_fs_t* fs, uint8_t* buff)
 {
     assert(fs != NULL);
     assert(buff != NULL);
-    assert(block_id < fs->num_blocks);
+
+    // ids come from disk, a corrupted pointer must not read past the image
+    if (block_id >= fs->num_blocks)
+    {
+        fprintf(stderr, "[read_block] Block id %lu is out of range\n",
+                        block_id);
+        return E_ERROR;
+    }
 
     errno = 0;
     ssize_t read = pread(fs->dev_fd, buff, fs->block_size,
@@ -101,9 +244,39 @@ static ssize_t read_block(size_t block_id, ext2_fs_t* fs, uint8_t* buff)
         return E_BADIO;
     }
 
+    STAT_ADD(fs, reads, 1);
+    STAT_ADD(fs, read_bytes, read);
     return read;
 }
 
+// regular files keep the upper half of the size in i_dir_acl (large_file)
+static uint64_t get_inode_size(const inode_t* inode)
+{
+    assert(inode != NULL);
+
+    uint64_t size = __le32_to_cpu(inode->i_size);
+    if (EXT2_S_ISREG(__le16_to_cpu(inode->i_mode)))
+        size |= (uint64_t)__le32_to_cpu(inode->i_dir_acl) << 32;
+
+    return size;
+}
+
+// fast symlinks and device nodes keep their data, not blocks, in i_block
+static int inode_maps_blocks(const inode_t* inode)
+{
+    assert(inode != NULL);
+
+    uint16_t mode = __le16_to_cpu(inode->i_mode);
+    if (EXT2_S_ISREG(mode) || EXT2_S_ISDIR(mode))
+        return 1;
+
+    if ((mode & EXT2_S_IFMT) == EXT2_S_IFLNK)
+        return (__le32_to_cpu(inode->i_flags) & EXT4_EXTENTS_FL) ||
+               get_inode_size(inode) >= sizeof(inode->i_block);
+
+    return 0;
+}
+
 int get_ext2_inode(ext2_fs_t* fs, long long int inode_num, inode_t* ret_inode)
 {
     if (fs == NULL)
@@ -133,35 +306,29 @@ int get_ext2_inode(ext2_fs_t* fs, long long int inode_num, inode_t* ret_inode)
         perror("[get_ext2_inode] Allocating buff failed\n");
         return E_BADALLOC;
     }
+    STAT_ADD(fs, allocs, 1);
 
-    size_t cur_desc_entry_id = 2;
-    if (block_size >= 2048)
-        cur_desc_entry_id = 1;
-
-    size_t db_desc_per_block = block_size / sizeof(group_desc_t);
-    size_t inodes_per_block  = block_size / sizeof(inode_t);
+    size_t inodes_per_block  = block_size / fs->inode_size;
 
+    uint64_t start = stat_start(fs);
     size_t desc_bg_num = (inode_num - 1) / fs->inodes_per_group;
     size_t local_inode_num = (inode_num - 1) % fs->inodes_per_group;
-    size_t desc_bg_id  = cur_desc_entry_id + desc_bg_num / db_desc_per_block;
-    size_t desc_bg_pos_in_id = desc_bg_num % db_desc_per_block;
-
-    ssize_t read = read_block(desc_bg_id, fs, buff);
-    if (read < 0)
+    if (desc_bg_num >= fs->num_groups)
     {
-        fprintf(stderr, "[get_ext2_inode] %ld: "
-                        "reading block %lu group table failed\n",
-                        read, desc_bg_id);
+        fprintf(stderr, "[get_ext2_inode] Bad group %lu of inode %lld\n",
+                        desc_bg_num, inode_num);
         free(buff);
-        return E_BADALLOC;
+        return E_ERROR;
     }
 
-    group_desc_t cur_bg = ((group_desc_t*)buff)[desc_bg_pos_in_id];
+    group_desc_t cur_bg = fs->descs[desc_bg_num];
+    stat_stop(fs, PHASE_DESC, start);
+
     size_t inode_id = __le32_to_cpu(cur_bg.bg_inode_table) +
                       local_inode_num / inodes_per_block;
     size_t inode_pos_in_id = local_inode_num % inodes_per_block;
 
-    read = read_block(inode_id, fs, buff);
+    ssize_t read = read_block(inode_id, fs, buff);
     if (read < 0)
     {
         fprintf(stderr, "[get_ext2_inode] %ld: "
@@ -170,7 +337,9 @@ int get_ext2_inode(ext2_fs_t* fs, long long int inode_num, inode_t* ret_inode)
         return E_BADALLOC;
     }
 
-    memcpy(ret_inode, &((inode_t*)buff)[inode_pos_in_id], sizeof(inode_t));
+    // on-disk inodes may be larger than inode_t, the tail is extra fields
+    memcpy(ret_inode, buff + inode_pos_in_id * fs->inode_size,
+           sizeof(inode_t));
 
     free(buff);
     return E_SUCCESS;
@@ -253,9 +422,13 @@ static int parse_inderect_block(ext2_fs_t* fs, uint32_t id,
                "Allocaton of normal block buffer failed\n");
         return E_BADALLOC;
     }
+    STAT_ADD(fs, allocs, 1);
 
 
+    uint64_t start = stat_start(fs);
     ssize_t ret = read_block(id, fs, (uint8_t*)id_buff);
+    stat_stop(fs, PHASE_MAP, start);
+    STAT_ADD(fs, indirect_reads, 1);
     if (ret < 0)
     {
         fprintf(stderr, "[parse_inderect_block] %ld: "
@@ -312,9 +485,13 @@ static int parse_2_inderect_block(ext2_fs_t* fs, uint32_t id,
                "Allocaton of normal block buffer failed\n");
         return E_BADALLOC;
     }
+    STAT_ADD(fs, allocs, 1);
 
 
+    uint64_t start = stat_start(fs);
     ssize_t ret = read_block(id, fs, (uint8_t*)id_buff);
+    stat_stop(fs, PHASE_MAP, start);
+    STAT_ADD(fs, indirect_reads, 1);
     if (ret < 0)
     {
         fprintf(stderr, "[parse_2_inderect_block] %ld: "
@@ -356,8 +533,12 @@ static int parse_3_inderect_block(ext2_fs_t* fs, uint32_t id,
                "Allocaton of normal block buffer failed\n");
         return E_BADALLOC;
     }
+    STAT_ADD(fs, allocs, 1);
 
+    uint64_t start = stat_start(fs);
     ssize_t ret = read_block(id, fs, (uint8_t*)id_buff);
+    stat_stop(fs, PHASE_MAP, start);
+    STAT_ADD(fs, indirect_reads, 1);
     if (ret < 0)
     {
         fprintf(stderr, "[parse_3_inderect_block] %ld: "
@@ -384,6 +565,11 @@ static int parse_3_inderect_block(ext2_fs_t* fs, uint32_t id,
     return E_SUCCESS;
 }
 
+// extent mapped inodes and all regular files go through the block mapper,
+// defined below
+static int read_extent_dir(ext2_fs_t* fs, inode_t* inode);
+static int read_mapped_file(ext2_fs_t* fs, inode_t* inode, uint8_t* file);
+
 static int read_dir(ext2_fs_t* fs, inode_t* inode)
 {
     assert(fs != NULL);
@@ -395,12 +581,16 @@ static int read_dir(ext2_fs_t* fs, inode_t* inode)
         return E_ERROR;
     }
 
+    if (__le32_to_cpu(inode->i_flags) & EXT4_EXTENTS_FL)
+        return read_extent_dir(fs, inode);
+
     uint8_t* buff = (uint8_t*) malloc(fs->block_size);
     if (buff == NULL)
     {
         perror("[read_dir] Allocation of buffer failed\n");
         return E_BADALLOC;
     }
+    STAT_ADD(fs, allocs, 1);
 
     uint32_t curr_block_num = __le32_to_cpu(inode->i_blocks) /
                               (fs->block_size / 512);
@@ -472,158 +662,13 @@ static int read_dir(ext2_fs_t* fs, inode_t* inode)
         }
     }
 
+    free(buff);
     return E_SUCCESS;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // regular file
 ////////////////////////////////////////////////////////////////////////////////
-static int read_inderect_block(ext2_fs_t* fs, uint32_t id, uint8_t* file,
-                               uint32_t* cur_pos, uint32_t* remain_size,
-                               uint8_t* buff)
-{
-    assert(fs != NULL);
-    assert(file != NULL);
-    assert(cur_pos != NULL);
-    assert(remain_size != NULL);
-    assert(buff != NULL);
-
-    errno = 0;
-    uint32_t* id_buff = (uint32_t*) malloc(fs->block_size);
-    if (id_buff == NULL)
-    {
-        perror("[read_inderect_block]"
-               "Allocaton of normal block buffer failed\n");
-        return E_BADALLOC;
-    }
-
-    ssize_t ret = read_block(id, fs, (uint8_t*)id_buff);
-    if (ret < 0)
-    {
-        fprintf(stderr, "[read_inderect_block] %ld: "
-                        "reading inderect block failed\n", ret);
-        free(id_buff);
-        return E_BADIO;
-    }
-
-    uint32_t ids_per_block = fs->block_size / 4;
-    for (uint32_t i = 0; i < ids_per_block && *remain_size > 0; i++)
-    {
-        int ret = read_block(id_buff[i], fs, buff);
-        if (ret < 0)
-        {
-            fprintf(stderr, "[read_inderect_block] %d: "
-                            "read normal block failed\n", ret);
-            free(id_buff);
-            return E_BADIO;
-        }
-
-        uint32_t cur_read = fs->block_size;
-        if (*remain_size < cur_read)
-            cur_read = *remain_size;
-
-        memcpy(file + *cur_pos, buff, cur_read);
-
-        *remain_size -= cur_read;
-        *cur_pos     += cur_read;
-    }
-
-    free(id_buff);
-    return E_SUCCESS;
-}
-
-static int read_2_inderect_block(ext2_fs_t* fs, uint32_t id, uint8_t* file,
-                                 uint32_t* cur_pos, uint32_t* remain_size,
-                                 uint8_t* buff)
-{
-    assert(fs != NULL);
-    assert(file != NULL);
-    assert(cur_pos != NULL);
-    assert(remain_size != NULL);
-    assert(buff != NULL);
-
-    errno = 0;
-    uint32_t* id_buff = (uint32_t*) malloc(fs->block_size);
-    if (id_buff == NULL)
-    {
-        perror("[read_2_inderect_block]"
-               "Allocaton of normal block buffer failed\n");
-        return E_BADALLOC;
-    }
-
-    ssize_t ret = read_block(id, fs, (uint8_t*)id_buff);
-    if (ret < 0)
-    {
-        fprintf(stderr, "[read_2_inderect_block] %ld: "
-                        "reading inderect block failed\n", ret);
-        free(id_buff);
-        return E_BADIO;
-    }
-
-    uint32_t ids_per_block = fs->block_size / 4;
-    for (uint32_t i = 0; i < ids_per_block && *remain_size > 0; i++)
-    {
-        int ret = read_inderect_block(fs, id_buff[i], file, cur_pos,
-                                      remain_size, buff);
-        if (ret < 0)
-        {
-            fprintf(stderr, "[read_2_inderect_block] %d: "
-                            "read indirect block failed\n", ret);
-            free(id_buff);
-            return E_BADIO;
-        }
-    }
-
-    free(id_buff);
-    return E_SUCCESS;
-}
-
-static int read_3_inderect_block(ext2_fs_t* fs, uint32_t id, uint8_t* file,
-                                 uint32_t* cur_pos, uint32_t* remain_size,
-                                 uint8_t* buff)
-{
-    assert(fs != NULL);
-    assert(file != NULL);
-    assert(cur_pos != NULL);
-    assert(remain_size != NULL);
-    assert(buff != NULL);
-
-    errno = 0;
-    uint32_t* id_buff = (uint32_t*) malloc(fs->block_size);
-    if (id_buff == NULL)
-    {
-        perror("[read_3_inderect_block]"
-               "Allocaton of normal block buffer failed\n");
-        return E_BADALLOC;
-    }
-
-    ssize_t ret = read_block(id, fs, (uint8_t*)id_buff);
-    if (ret < 0)
-    {
-        fprintf(stderr, "[read_3_inderect_block] %ld: "
-                        "reading inderect block failed\n", ret);
-        free(id_buff);
-        return E_BADIO;
-    }
-
-    uint32_t ids_per_block = fs->block_size / 4;
-    for (uint32_t i = 0; i < ids_per_block && *remain_size > 0; i++)
-    {
-        int ret = read_2_inderect_block(fs, id_buff[i], file, cur_pos,
-                                        remain_size, buff);
-        if (ret < 0)
-        {
-            fprintf(stderr, "[read_3_inderect_block] %d: "
-                            "read indirect block failed\n", ret);
-            free(id_buff);
-            return E_BADIO;
-        }
-    }
-
-    free(id_buff);
-    return E_SUCCESS;
-}
-
 // not static because I think it can be used outside of this lib
 ssize_t read_reg_file(ext2_fs_t* fs, inode_t* inode, uint8_t* file)
 {
@@ -645,78 +690,17 @@ ssize_t read_reg_file(ext2_fs_t* fs, inode_t* inode, uint8_t* file)
         return E_BADARGS;
     }
 
-    uint32_t remain_size = __le32_to_cpu(inode->i_size);
-
-    uint8_t* buff = (uint8_t*) malloc(fs->block_size);
-    if (buff == NULL)
-    {
-        perror("[read_reg_file] Allocation of buffer failed\n");
-        return E_BADALLOC;
-    }
-
-    uint32_t cur_pos = 0;
-    for (uint32_t i = 0; i < 12 && remain_size > 0; i++)
-    {
-        int ret = read_block(__le32_to_cpu(inode->i_block[i]), fs, buff);
-        if (ret < 0)
-        {
-            fprintf(stderr, "[read_reg_file] %d: "
-                            "read normal block failed\n", ret);
-            free(buff);
-            return E_BADIO;
-        }
-
-        uint32_t cur_read = fs->block_size;
-        if (remain_size < cur_read)
-            cur_read = remain_size;
-
-        memcpy(file + cur_pos, buff, cur_read);
-
-        remain_size -= cur_read;
-        cur_pos     += cur_read;
-    }
-
-    if (remain_size > 0)
-    {
-        int ret = read_inderect_block(fs, __le32_to_cpu(inode->i_block[12]),
-                                      file, &cur_pos, &remain_size, buff);
-        if (ret != E_SUCCESS)
-        {
-            fprintf(stderr, "[read_reg_file] %d: "
-                            "read inderect block failed\n", ret);
-            free(buff);
-            return E_ERROR;
-        }
-    }
-
-    if (remain_size > 0)
-    {
-        int ret = read_2_inderect_block(fs, __le32_to_cpu(inode->i_block[13]),
-                                        file, &cur_pos, &remain_size, buff);
-        if (ret != E_SUCCESS)
-        {
-            fprintf(stderr, "[read_reg_file] %d: "
-                            "read doubly-inderect block failed\n", ret);
-            free(buff);
-            return E_ERROR;
-        }
-    }
-
-    if (remain_size > 0)
+    uint64_t file_size = get_inode_size(inode);
+    if (file_size > UINT32_MAX)
     {
-        int ret = read_3_inderect_block(fs, __le32_to_cpu(inode->i_block[12]),
-                                        file, &cur_pos, &remain_size, buff);
-        if (ret != E_SUCCESS)
-        {
-            fprintf(stderr, "[read_reg_file] %d: "
-                            "read triply-inderect block failed\n", ret);
-            free(buff);
-            return E_ERROR;
-        }
+        fprintf(stderr, "[read_reg_file] File is too large, "
+                        "use the hash or tar mode\n");
+        return E_ERROR;
     }
 
-    free(buff);
-    return E_SUCCESS;
+    // the mapper reports holes, 0 pointers at any indirection level, as runs
+    // to zero-fill instead of blocks to read
+    return read_mapped_file(fs, inode, file);
 }
 
 int read_inode(ext2_fs_t* fs, inode_t* inode)
@@ -742,7 +726,14 @@ int read_inode(ext2_fs_t* fs, inode_t* inode)
     }
     else if (mode & EXT2_S_IFREG)
     {
-        uint32_t file_size = __le32_to_cpu(inode->i_size);
+        uint64_t file_size = get_inode_size(inode);
+        if (file_size > UINT32_MAX)
+        {
+            fprintf(stderr, "[read_inode] File is too large, "
+                            "use the hash or tar mode\n");
+            return E_ERROR;
+        }
+
         errno = 0;
         uint8_t* file = (uint8_t*) malloc(file_size);
         if (file == NULL)
@@ -750,6 +741,7 @@ int read_inode(ext2_fs_t* fs, inode_t* inode)
             perror("[read_inode] allocation of file buffer returned error\n");
             return E_BADALLOC;
         }
+        STAT_ADD(fs, allocs, 1);
 
         ssize_t ret = read_reg_file(fs, inode, file);
         if (ret < 0)
@@ -769,83 +761,4912 @@ int read_inode(ext2_fs_t* fs, inode_t* inode)
     return E_ERROR;
 }
 
-int main(int argc, char* argv[])
+
+////////////////////////////////////////////////////////////////////////////////
+// file system open/close
+////////////////////////////////////////////////////////////////////////////////
+// get_ext2_inode() needs a descriptor for every lookup, keep them all in memory
+static int load_group_descs(ext2_fs_t* fs)
 {
-    if (argc != 3)
+    assert(fs != NULL);
+
+    uint32_t first_data_block = __le32_to_cpu(fs->sb->s_first_data_block);
+    if (fs->blocks_per_group == 0 || fs->num_blocks <= first_data_block)
     {
-        fprintf(stderr, "[main] Bad number of input arguments."
-                        "Try ./read_ext2 device inode_number\n");
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "[load_group_descs] Bad superblock geometry\n");
+        return E_ERROR;
     }
 
+    fs->num_groups = (fs->num_blocks - first_data_block +
+                      fs->blocks_per_group - 1) / fs->blocks_per_group;
+
+    size_t table_size = fs->num_groups * fs->desc_size;
+    size_t table_blocks = (table_size + fs->block_size - 1) / fs->block_size;
+
     errno = 0;
-    int dev_fd = open(argv[1], O_RDONLY); // will fail if file doesn't exist
-    if (dev_fd < 0)
+    fs->descs = (group_desc_t*) malloc(table_blocks * fs->block_size);
+    if (fs->descs == NULL)
     {
-        perror("[main] Opening device failed\n");
-        exit(EXIT_FAILURE);
+        perror("[load_group_descs] Allocation of descriptor table failed\n");
+        return E_BADALLOC;
     }
+    STAT_ADD(fs, allocs, 1);
 
-    super_block_t super_block;
-    int err = get_ext2_superblock(dev_fd, &super_block);
-    if (err != E_SUCCESS)
+    uint64_t start = stat_start(fs);
+    size_t table_block = first_data_block + 1;
+    errno = 0;
+    ssize_t read = pread(fs->dev_fd, fs->descs, table_blocks * fs->block_size,
+                         table_block * fs->block_size);
+    stat_stop(fs, PHASE_DESC, start);
+    if (read < (ssize_t)table_size)
     {
-        fprintf(stderr, "[main] %d: Getting superblock failed\n", err);
-        exit(EXIT_FAILURE);
+        perror("[load_group_descs] Reading group descriptors failed\n");
+        free(fs->descs);
+        fs->descs = NULL;
+        return E_BADIO;
     }
+    STAT_ADD(fs, reads, 1);
+    STAT_ADD(fs, read_bytes, read);
 
-    if (__le32_to_cpu(super_block.s_rev_level) != EXT2_GOOD_OLD_REV &&
-        super_block.s_feature_incompat != 0)
+    // 64bit descriptors only add high halves, which are zero below 2^32
+    // blocks, so keep the ext2 part of each one
+    if (fs->desc_size != sizeof(group_desc_t))
     {
-        fprintf(stderr, "[main] Unsupported file system: incopatible features: "
-                        "0x%.8X\n", __le32_to_cpu(super_block.s_feature_incompat));
-        exit(EXIT_FAILURE);
+        for (size_t i = 0; i < fs->num_groups; i++)
+            memmove(&fs->descs[i], (uint8_t*)fs->descs + i * fs->desc_size,
+                    sizeof(group_desc_t));
     }
 
-    ext2_fs_t fs = {
-        fs.dev_fd           = dev_fd,
-        fs.sb               = &super_block,
-        fs.revision         = __le32_to_cpu(super_block.s_rev_level),
-        fs.block_size       = ((size_t)1024) <<
-                              __le32_to_cpu(super_block.s_log_block_size),
-        fs.inode_size       = EXT2_GOOD_OLD_INODE_SIZE,
-        fs.blocks_per_group = __le32_to_cpu(super_block.s_blocks_per_group),
-        fs.inodes_per_group = __le32_to_cpu(super_block.s_inodes_per_group),
-        fs.num_inodes       = __le32_to_cpu(super_block.s_inodes_count),
-        fs.num_blocks       = __le32_to_cpu(super_block.s_blocks_count)
-    };
-
-    if (fs.revision != EXT2_GOOD_OLD_REV)
-        fs.inode_size = __le32_to_cpu(super_block.s_inode_size);
+    return E_SUCCESS;
+}
 
-    Dprintf("block_size = %lu\n", fs.block_size);
+int ext2_open(const char* dev_path, ext2_fs_t* fs)
+{
+    if (dev_path == NULL || fs == NULL)
+    {
+        fprintf(stderr, "[ext2_open] Bad input pointers\n");
+        return E_BADARGS;
+    }
 
     errno = 0;
-    long long int inode_number = strtoll(argv[2], NULL, 10);
-    if (errno != 0)
+    int dev_fd = open(dev_path, O_RDONLY); // will fail if file doesn't exist
+    if (dev_fd < 0)
     {
-        perror("[main] Reading inode_number failed\n");
-        exit(EXIT_FAILURE);
+        perror("[ext2_open] Opening device failed\n");
+        return E_BADIO;
     }
 
-    inode_t req_inode;
-    err = get_ext2_inode(&fs, inode_number, &req_inode);
+    errno = 0;
+    super_block_t* sb = (super_block_t*) malloc(sizeof(super_block_t));
+    if (sb == NULL)
+    {
+        perror("[ext2_open] Allocation of superblock failed\n");
+        close(dev_fd);
+        return E_BADALLOC;
+    }
+
+    memset(&fs->stats, 0, sizeof(fs->stats));
+    fs->stats.enabled = stats_requested;
+    fs->dev_fd        = dev_fd;
+
+    uint64_t start = stat_start(fs);
+    int err = get_ext2_superblock(dev_fd, sb);
+    stat_stop(fs, PHASE_SUPERBLOCK, start);
+    if (err != E_SUCCESS)
+    {
+        fprintf(stderr, "[ext2_open] %d: Getting superblock failed\n", err);
+        free(sb);
+        close(dev_fd);
+        return err;
+    }
+
+    // read-only access ignores the other ro_compat features: sparse_super
+    // only moves backup copies, large_file is handled by get_inode_size(),
+    // gdt_csum and metadata_csum mark uninitialized inode tables, see
+    // group_inodes_used()
+    uint32_t incompat = __le32_to_cpu(sb->s_feature_incompat);
+    if (__le32_to_cpu(sb->s_rev_level) != EXT2_GOOD_OLD_REV &&
+        (incompat & ~EXT2_FEATURE_INCOMPAT_SUPP) != 0)
+    {
+        fprintf(stderr, "[ext2_open] Unsupported file system: "
+                        "incopatible features: 0x%.8X\n",
+                        incompat & ~EXT2_FEATURE_INCOMPAT_SUPP);
+        free(sb);
+        close(dev_fd);
+        return E_ERROR;
+    }
+
+    fs->dev_fd           = dev_fd;
+    fs->sb               = sb;
+    fs->revision         = __le32_to_cpu(sb->s_rev_level);
+    fs->block_size       = ((size_t)1024) << __le32_to_cpu(sb->s_log_block_size);
+    fs->inode_size       = EXT2_GOOD_OLD_INODE_SIZE;
+    fs->blocks_per_group = __le32_to_cpu(sb->s_blocks_per_group);
+    fs->inodes_per_group = __le32_to_cpu(sb->s_inodes_per_group);
+    fs->num_inodes       = __le32_to_cpu(sb->s_inodes_count);
+    fs->num_blocks       = __le32_to_cpu(sb->s_blocks_count);
+
+    if (fs->revision != EXT2_GOOD_OLD_REV)
+        fs->inode_size = __le16_to_cpu(sb->s_inode_size);
+
+    fs->desc_size = EXT2_MIN_DESC_SIZE;
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+    {
+        fs->desc_size = __le16_to_cpu(sb->s_desc_size);
+        if (__le32_to_cpu(sb->s_blocks_count_hi) != 0)
+        {
+            fprintf(stderr, "[ext2_open] File systems above 2^32 blocks "
+                            "are not supported\n");
+            free(sb);
+            close(dev_fd);
+            return E_ERROR;
+        }
+    }
+
+    if (fs->desc_size < EXT2_MIN_DESC_SIZE || fs->desc_size > fs->block_size ||
+        (fs->desc_size & (fs->desc_size - 1)) != 0)
+    {
+        fprintf(stderr, "[ext2_open] Bad group descriptor size %lu\n",
+                        fs->desc_size);
+        free(sb);
+        close(dev_fd);
+        return E_ERROR;
+    }
+
+    if (fs->inode_size < EXT2_GOOD_OLD_INODE_SIZE ||
+        fs->inode_size > fs->block_size ||
+        (fs->inode_size & (fs->inode_size - 1)) != 0)
+    {
+        fprintf(stderr, "[ext2_open] Bad inode size %lu\n", fs->inode_size);
+        free(sb);
+        close(dev_fd);
+        return E_ERROR;
+    }
+
+    // group numbers are divisions by these, and a group's bitmaps are one
+    // block each
+    if (fs->inodes_per_group == 0 || fs->blocks_per_group == 0 ||
+        fs->inodes_per_group > 8 * fs->block_size ||
+        fs->blocks_per_group > 8 * fs->block_size)
+    {
+        fprintf(stderr, "[ext2_open] Bad group size: %lu inodes, %lu blocks\n",
+                        fs->inodes_per_group, fs->blocks_per_group);
+        free(sb);
+        close(dev_fd);
+        return E_ERROR;
+    }
+
+    fs->uninit_bg = (__le32_to_cpu(sb->s_feature_ro_compat) &
+                     (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+                      EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    Dprintf("block_size = %lu\n", fs->block_size);
+
+    err = load_group_descs(fs);
+    if (err != E_SUCCESS)
+    {
+        fprintf(stderr, "[ext2_open] %d: Loading group descriptors failed\n",
+                        err);
+        free(sb);
+        close(dev_fd);
+        return err;
+    }
+
+    return E_SUCCESS;
+}
+
+void ext2_close(ext2_fs_t* fs)
+{
+    if (fs == NULL)
+        return;
+
+    close(fs->dev_fd);
+    free(fs->sb);
+    free(fs->descs);
+    fs->dev_fd = -1;
+    fs->sb     = NULL;
+    fs->descs  = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// block mapper
+// Walks i_block and the indirect trees of an inode and reports its data as
+// runs of physically contiguous blocks. Holes are reported with phys_block 0.
+////////////////////////////////////////////////////////////////////////////////
+typedef int (*block_run_cb_t)(ext2_fs_t* fs, uint32_t file_block,
+                              uint32_t phys_block, uint32_t len, void* ctx);
+
+typedef struct block_mapper
+{
+    ext2_fs_t*     fs;
+    block_run_cb_t cb;
+    void*          ctx;
+    uint32_t       remain;     // data blocks which are still not mapped
+    uint32_t       file_block; // next logical block
+    uint32_t       run_file;   // pending run
+    uint32_t       run_phys;
+    uint32_t       run_len;
+    uint32_t*      id_buff[3]; // one buffer per indirection level
+} block_mapper_t;
+
+static int mapper_flush(block_mapper_t* mapper)
+{
+    if (mapper->run_len == 0)
+        return E_SUCCESS;
+
+    int ret = mapper->cb(mapper->fs, mapper->run_file, mapper->run_phys,
+                         mapper->run_len, mapper->ctx);
+    mapper->run_len = 0;
+    return ret;
+}
+
+static int mapper_emit(block_mapper_t* mapper, uint32_t phys_block,
+                       uint32_t len)
+{
+    assert(mapper != NULL);
+
+    if (len > mapper->remain)
+        len = mapper->remain;
+
+    int is_hole = (phys_block == 0);
+    if (mapper->run_len > 0 &&
+        ((is_hole && mapper->run_phys == 0) ||
+         (!is_hole && mapper->run_phys != 0 &&
+          mapper->run_phys + mapper->run_len == phys_block)))
+    {
+        mapper->run_len += len;
+    }
+    else
+    {
+        int ret = mapper_flush(mapper);
+        if (ret != E_SUCCESS)
+            return ret;
+
+        mapper->run_file = mapper->file_block;
+        mapper->run_phys = phys_block;
+        mapper->run_len  = len;
+    }
+
+    mapper->file_block += len;
+    mapper->remain     -= len;
+    return E_SUCCESS;
+}
+
+static int mapper_walk(block_mapper_t* mapper, uint32_t id, int level)
+{
+    assert(mapper != NULL);
+    assert(level >= 0 && level <= 3);
+
+    if (level == 0)
+    {
+        if (id >= mapper->fs->num_blocks)
+        {
+            fprintf(stderr, "[mapper_walk] Bad data block id %u\n", id);
+            return E_ERROR;
+        }
+        return mapper_emit(mapper, id, 1);
+    }
+
+    uint32_t ids_per_block = mapper->fs->block_size / 4;
+    if (id == 0)
+    {
+        // whole subtree is a hole
+        uint64_t span = ids_per_block;
+        for (int i = 1; i < level; i++)
+            span *= ids_per_block;
+        if (span > mapper->remain)
+            span = mapper->remain;
+
+        return mapper_emit(mapper, 0, (uint32_t)span);
+    }
+
+    if (id >= mapper->fs->num_blocks)
+    {
+        fprintf(stderr, "[mapper_walk] Bad indirect block id %u\n", id);
+        return E_ERROR;
+    }
+
+    uint32_t* id_buff = mapper->id_buff[level - 1];
+    uint64_t start = stat_start(mapper->fs);
+    ssize_t read = read_block(id, mapper->fs, (uint8_t*)id_buff);
+    stat_stop(mapper->fs, PHASE_MAP, start);
+    STAT_ADD(mapper->fs, indirect_reads, 1);
+    if (read < 0)
+    {
+        fprintf(stderr, "[mapper_walk] %ld: "
+                        "reading indirect block %u failed\n", read, id);
+        return E_BADIO;
+    }
+
+    for (uint32_t i = 0; i < ids_per_block && mapper->remain > 0; i++)
+    {
+        int ret = mapper_walk(mapper, __le32_to_cpu(id_buff[i]), level - 1);
+        if (ret != E_SUCCESS)
+            return ret;
+    }
+
+    return E_SUCCESS;
+}
+
+// extents map straight to runs, gaps between them and unwritten extents are
+// reported as holes; scratch holds one block per index level
+static int mapper_walk_extents(block_mapper_t* mapper, const uint8_t* node,
+                               size_t node_size, int depth, uint8_t* scratch)
+{
+    assert(mapper != NULL);
+    assert(node != NULL);
+
+    ext2_fs_t* fs = mapper->fs;
+    const struct ext4_extent_header* hdr =
+        (const struct ext4_extent_header*) node;
+    size_t entries = __le16_to_cpu(hdr->eh_entries);
+
+    if (__le16_to_cpu(hdr->eh_magic) != EXT4_EXT_MAGIC ||
+        __le16_to_cpu(hdr->eh_depth) != depth ||
+        sizeof(*hdr) + entries * sizeof(struct ext4_extent) > node_size)
+    {
+        fprintf(stderr, "[mapper_walk_extents] Corrupted extent node\n");
+        return E_ERROR;
+    }
+
+    if (depth == 0)
+    {
+        const struct ext4_extent* ext = (const struct ext4_extent*)(hdr + 1);
+        for (size_t i = 0; i < entries && mapper->remain > 0; i++)
+        {
+            uint32_t first = __le32_to_cpu(ext[i].ee_block);
+            uint32_t len   = __le16_to_cpu(ext[i].ee_len);
+            uint32_t phys  = __le32_to_cpu(ext[i].ee_start_lo);
+
+            int unwritten = (len > EXT4_EXT_INIT_MAX_LEN);
+            if (unwritten)
+                len -= EXT4_EXT_INIT_MAX_LEN;
+            if (len == 0)
+                continue;
+
+            if (first < mapper->file_block || ext[i].ee_start_hi != 0 ||
+                (!unwritten && (phys == 0 || phys + len > fs->num_blocks)))
+            {
+                fprintf(stderr, "[mapper_walk_extents] Bad extent %u+%u -> %u\n",
+                                first, len, phys);
+                return E_ERROR;
+            }
+
+            int ret = E_SUCCESS;
+            if (first > mapper->file_block)
+                ret = mapper_emit(mapper, 0, first - mapper->file_block);
+            if (ret == E_SUCCESS && mapper->remain > 0)
+                ret = mapper_emit(mapper, unwritten ? 0 : phys, len);
+            if (ret != E_SUCCESS)
+                return ret;
+        }
+
+        return E_SUCCESS;
+    }
+
+    const struct ext4_extent_idx* idx = (const struct ext4_extent_idx*)(hdr + 1);
+    uint8_t* child = scratch + (depth - 1) * fs->block_size;
+    for (size_t i = 0; i < entries && mapper->remain > 0; i++)
+    {
+        uint32_t leaf = __le32_to_cpu(idx[i].ei_leaf_lo);
+        if (idx[i].ei_leaf_hi != 0 || leaf == 0 || leaf >= fs->num_blocks)
+        {
+            fprintf(stderr, "[mapper_walk_extents] Bad index block %u\n", leaf);
+            return E_ERROR;
+        }
+
+        uint64_t start = stat_start(fs);
+        ssize_t read = read_block(leaf, fs, child);
+        stat_stop(fs, PHASE_MAP, start);
+        STAT_ADD(fs, indirect_reads, 1);
+        if (read < 0)
+        {
+            fprintf(stderr, "[mapper_walk_extents] %ld: "
+                            "reading index block %u failed\n", read, leaf);
+            return E_BADIO;
+        }
+
+        int ret = mapper_walk_extents(mapper, child, fs->block_size,
+                                      depth - 1, scratch);
+        if (ret != E_SUCCESS)
+            return ret;
+    }
+
+    return E_SUCCESS;
+}
+
+static int map_extents(block_mapper_t* mapper, inode_t* inode)
+{
+    assert(mapper != NULL);
+    assert(inode != NULL);
+
+    const struct ext4_extent_header* hdr =
+        (const struct ext4_extent_header*) inode->i_block;
+    int depth = __le16_to_cpu(hdr->eh_depth);
+    if (depth > EXT4_EXT_MAX_DEPTH)
+    {
+        fprintf(stderr, "[map_extents] Bad extent tree depth %d\n", depth);
+        return E_ERROR;
+    }
+
+    uint8_t* scratch = NULL;
+    if (depth > 0)
+    {
+        errno = 0;
+        scratch = (uint8_t*) malloc(depth * mapper->fs->block_size);
+        if (scratch == NULL)
+        {
+            perror("[map_extents] Allocation of index buffers failed\n");
+            return E_BADALLOC;
+        }
+        STAT_ADD(mapper->fs, allocs, 1);
+    }
+
+    int ret = mapper_walk_extents(mapper, (const uint8_t*)inode->i_block,
+                                  sizeof(inode->i_block), depth, scratch);
+
+    // blocks past the last extent are a sparse tail
+    if (ret == E_SUCCESS && mapper->remain > 0)
+        ret = mapper_emit(mapper, 0, mapper->remain);
+    if (ret == E_SUCCESS)
+        ret = mapper_flush(mapper);
+
+    free(scratch);
+    return ret;
+}
+
+int map_file_blocks(ext2_fs_t* fs, inode_t* inode, block_run_cb_t cb, void* ctx)
+{
+    if (fs == NULL || inode == NULL || cb == NULL)
+    {
+        fprintf(stderr, "[map_file_blocks] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    uint64_t size = get_inode_size(inode);
+    block_mapper_t mapper = {
+        .fs         = fs,
+        .cb         = cb,
+        .ctx        = ctx,
+        .remain     = (uint32_t)((size + fs->block_size - 1) / fs->block_size),
+        .file_block = 0,
+        .run_len    = 0,
+    };
+
+    if (mapper.remain == 0)
+        return E_SUCCESS;
+
+    if (__le32_to_cpu(inode->i_flags) & EXT4_EXTENTS_FL)
+        return map_extents(&mapper, inode);
+
+    for (int i = 0; i < 3; i++)
+    {
+        errno = 0;
+        mapper.id_buff[i] = (uint32_t*) malloc(fs->block_size);
+        if (mapper.id_buff[i] == NULL)
+        {
+            perror("[map_file_blocks] Allocation of indirect buffer failed\n");
+            for (int j = 0; j < i; j++)
+                free(mapper.id_buff[j]);
+            return E_BADALLOC;
+        }
+        STAT_ADD(fs, allocs, 1);
+    }
+
+    int ret = E_SUCCESS;
+    for (uint32_t i = 0; i < EXT2_NDIR_BLOCKS && mapper.remain > 0 &&
+                         ret == E_SUCCESS; i++)
+        ret = mapper_walk(&mapper, __le32_to_cpu(inode->i_block[i]), 0);
+
+    if (ret == E_SUCCESS && mapper.remain > 0)
+        ret = mapper_walk(&mapper, __le32_to_cpu(inode->i_block[EXT2_IND_BLOCK]), 1);
+    if (ret == E_SUCCESS && mapper.remain > 0)
+        ret = mapper_walk(&mapper, __le32_to_cpu(inode->i_block[EXT2_DIND_BLOCK]), 2);
+    if (ret == E_SUCCESS && mapper.remain > 0)
+        ret = mapper_walk(&mapper, __le32_to_cpu(inode->i_block[EXT2_TIND_BLOCK]), 3);
+    if (ret == E_SUCCESS)
+        ret = mapper_flush(&mapper);
+
+    for (int i = 0; i < 3; i++)
+        free(mapper.id_buff[i]);
+
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// streaming file reader
+// Pulls file data with one pread per contiguous run instead of buffering the
+// whole file like read_reg_file() does.
+////////////////////////////////////////////////////////////////////////////////
+typedef struct block_run
+{
+    uint32_t file_block;
+    uint32_t phys_block; // 0 - hole
+    uint32_t len;
+} block_run_t;
+
+typedef struct file_stream
+{
+    ext2_fs_t*   fs;
+    block_run_t* runs;
+    size_t       num_runs;
+    size_t       cap_runs;
+    size_t       cur_run;
+    uint64_t     size;
+    uint64_t     pos;
+} file_stream_t;
+
+static int collect_run(ext2_fs_t* fs, uint32_t file_block, uint32_t phys_block,
+                       uint32_t len, void* ctx)
+{
+    file_stream_t* stream = (file_stream_t*) ctx;
+    assert(stream != NULL);
+
+    if (stream->num_runs == stream->cap_runs)
+    {
+        size_t new_cap = (stream->cap_runs == 0) ? 16 : 2 * stream->cap_runs;
+        errno = 0;
+        block_run_t* new_runs = (block_run_t*) realloc(stream->runs,
+                                                new_cap * sizeof(block_run_t));
+        if (new_runs == NULL)
+        {
+            perror("[collect_run] Reallocation of runs failed\n");
+            return E_BADALLOC;
+        }
+        STAT_ADD(fs, allocs, 1);
+
+        stream->runs     = new_runs;
+        stream->cap_runs = new_cap;
+    }
+
+    block_run_t* run = &stream->runs[stream->num_runs++];
+    run->file_block = file_block;
+    run->phys_block = phys_block;
+    run->len        = len;
+
+    return E_SUCCESS;
+}
+
+int file_stream_open(ext2_fs_t* fs, inode_t* inode, file_stream_t* stream)
+{
+    if (fs == NULL || inode == NULL || stream == NULL)
+    {
+        fprintf(stderr, "[file_stream_open] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    memset(stream, 0, sizeof(*stream));
+    stream->fs   = fs;
+    stream->size = get_inode_size(inode);
+
+    int ret = map_file_blocks(fs, inode, collect_run, stream);
+    if (ret != E_SUCCESS)
+    {
+        fprintf(stderr, "[file_stream_open] %d: mapping blocks failed\n", ret);
+        free(stream->runs);
+        stream->runs = NULL;
+        return ret;
+    }
+
+    return E_SUCCESS;
+}
+
+void file_stream_close(file_stream_t* stream)
+{
+    if (stream == NULL)
+        return;
+
+    free(stream->runs);
+    stream->runs     = NULL;
+    stream->num_runs = 0;
+}
+
+// returns number of bytes read, 0 at the end of file
+ssize_t file_stream_read(file_stream_t* stream, uint8_t* buff, size_t size)
+{
+    if (stream == NULL || buff == NULL)
+    {
+        fprintf(stderr, "[file_stream_read] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    size_t block_size = stream->fs->block_size;
+    size_t done = 0;
+
+    while (done < size && stream->pos < stream->size &&
+           stream->cur_run < stream->num_runs)
+    {
+        block_run_t* run = &stream->runs[stream->cur_run];
+        uint64_t run_start = (uint64_t)run->file_block * block_size;
+        uint64_t run_end   = run_start + (uint64_t)run->len * block_size;
+
+        if (stream->pos >= run_end)
+        {
+            stream->cur_run++;
+            continue;
+        }
+
+        uint64_t chunk = run_end - stream->pos;
+        if (chunk > size - done)
+            chunk = size - done;
+        if (chunk > stream->size - stream->pos)
+            chunk = stream->size - stream->pos;
+
+        uint64_t start = stat_start(stream->fs);
+        if (run->phys_block == 0)
+            memset(buff + done, 0, chunk);
+        else
+        {
+            off_t offset = (off_t)run->phys_block * block_size +
+                           (stream->pos - run_start);
+            errno = 0;
+            ssize_t read = pread(stream->fs->dev_fd, buff + done, chunk, offset);
+            if (read < 0)
+            {
+                perror("[file_stream_read] Reading run failed\n");
+                return E_BADIO;
+            }
+            if ((uint64_t)read != chunk)
+            {
+                fprintf(stderr, "[file_stream_read] Short read of run\n");
+                return E_BADIO;
+            }
+            STAT_ADD(stream->fs, reads, 1);
+            STAT_ADD(stream->fs, read_bytes, read);
+        }
+        stat_stop(stream->fs, PHASE_COPY, start);
+
+        done        += chunk;
+        stream->pos += chunk;
+    }
+
+    return (ssize_t)done;
+}
+
+static int read_mapped_file(ext2_fs_t* fs, inode_t* inode, uint8_t* file)
+{
+    assert(fs != NULL);
+    assert(inode != NULL);
+    assert(file != NULL);
+
+    file_stream_t stream;
+    int ret = file_stream_open(fs, inode, &stream);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    ssize_t read = file_stream_read(&stream, file, stream.size);
+    if (read != (ssize_t)stream.size)
+    {
+        fprintf(stderr, "[read_mapped_file] Reading file failed\n");
+        ret = E_BADIO;
+    }
+
+    file_stream_close(&stream);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// directory iterator
+////////////////////////////////////////////////////////////////////////////////
+#define DIR_READ_BLOCKS 16
+
+static int iterate_dir_block(ext2_fs_t* fs, const uint8_t* block,
+                             dir_entry_cb_t cb, void* ctx)
+{
+    assert(fs != NULL);
+    assert(block != NULL);
+
+    size_t cur_pos = 0;
+    while (cur_pos + 8 <= fs->block_size)
+    {
+        const ext2_dir_entry_2* entry = (const ext2_dir_entry_2*)(block + cur_pos);
+        uint16_t rec_len  = __le16_to_cpu(entry->rec_len);
+        size_t   name_len = entry->name_len;
+        uint8_t  type     = entry->file_type;
+
+        if (fs->revision == EXT2_GOOD_OLD_REV)
+        {
+            name_len = __le16_to_cpu(((const ext2_dir_entry*)entry)->name_len);
+            type     = 0;
+        }
+
+        if (rec_len < 8 || cur_pos + rec_len > fs->block_size ||
+            8 + name_len > rec_len)
+        {
+            fprintf(stderr, "[iterate_dir_block] Corrupted entry at %lu\n",
+                            cur_pos);
+            return E_ERROR;
+        }
+
+        uint32_t ino = __le32_to_cpu(entry->inode);
+        if (ino != 0)
+        {
+            int ret = cb(ino, type, entry->name, name_len, ctx);
+            if (ret != E_SUCCESS)
+                return ret;
+        }
+
+        cur_pos += rec_len;
+    }
+
+    return E_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Lookup kernel: walks the rec_len chain in place, rejects entries by
+// name_len and the first four name bytes, only survivors get a full compare.
+////////////////////////////////////////////////////////////////////////////////
+typedef struct name_key
+{
+    const char* name;
+    size_t      len;
+    size_t      head_len;  // min(len, 4)
+    uint32_t    head;      // first head_len bytes of the name, zero padded
+} name_key_t;
+
+static void make_name_key(name_key_t* key, const char* name, size_t len)
+{
+    assert(key != NULL);
+    assert(name != NULL);
+
+    key->name     = name;
+    key->len      = len;
+    key->head_len = (len < 4) ? len : 4;
+    key->head     = 0;
+    memcpy(&key->head, name, key->head_len);
+}
+
+static inline int names_equal(const char* lhs, const char* rhs, size_t len)
+{
+#ifdef __SSE2__
+    while (len >= 16)
+    {
+        __m128i lhs_vec = _mm_loadu_si128((const __m128i*)lhs);
+        __m128i rhs_vec = _mm_loadu_si128((const __m128i*)rhs);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(lhs_vec, rhs_vec)) != 0xFFFF)
+            return 0;
+
+        lhs += 16;
+        rhs += 16;
+        len -= 16;
+    }
+#endif
+    return memcmp(lhs, rhs, len) == 0;
+}
+
+// name must be key->len bytes long
+static inline int name_key_match(const name_key_t* key, const char* name)
+{
+    uint32_t head = 0;
+    if (key->head_len == 4)
+        memcpy(&head, name, 4);
+    else
+        memcpy(&head, name, key->head_len);
+
+    if (head != key->head)
+        return 0;
+
+    return key->len <= 4 || names_equal(name + 4, key->name + 4, key->len - 4);
+}
+
+static int find_dir_block(ext2_fs_t* fs, const uint8_t* block,
+                          const name_key_t* key, uint32_t* ino)
+{
+    assert(fs != NULL);
+    assert(block != NULL);
+    assert(key != NULL);
+    assert(ino != NULL);
+
+    *ino = 0;
+    if (key->len == 0)
+        return E_SUCCESS;
+
+    size_t cur_pos = 0;
+    while (cur_pos + 8 <= fs->block_size)
+    {
+        const ext2_dir_entry_2* entry = (const ext2_dir_entry_2*)(block + cur_pos);
+        uint16_t rec_len  = __le16_to_cpu(entry->rec_len);
+        size_t   name_len = entry->name_len;
+        if (fs->revision == EXT2_GOOD_OLD_REV)
+            name_len = __le16_to_cpu(((const ext2_dir_entry*)entry)->name_len);
+
+        if (rec_len < 8 || cur_pos + rec_len > fs->block_size ||
+            8 + name_len > rec_len)
+        {
+            fprintf(stderr, "[find_dir_block] Corrupted entry at %lu\n",
+                            cur_pos);
+            return E_ERROR;
+        }
+
+        if (name_len == key->len && entry->inode != 0 &&
+            name_key_match(key, entry->name))
+        {
+            *ino = __le32_to_cpu(entry->inode);
+            return E_SUCCESS;
+        }
+
+        cur_pos += rec_len;
+    }
+
+    return E_SUCCESS;
+}
+
+// returning anything but E_SUCCESS stops the iteration
+typedef int (*dir_block_cb_t)(ext2_fs_t* fs, const uint8_t* block, void* ctx);
+
+static int for_each_dir_block(ext2_fs_t* fs, inode_t* inode,
+                              dir_block_cb_t cb, void* ctx)
+{
+    assert(fs != NULL);
+    assert(inode != NULL);
+    assert(cb != NULL);
+
+    if (!EXT2_S_ISDIR(__le16_to_cpu(inode->i_mode)))
+    {
+        fprintf(stderr, "[for_each_dir_block] Inode is not a directory\n");
+        return E_BADARGS;
+    }
+
+    size_t buff_size = fs->block_size * DIR_READ_BLOCKS;
+    errno = 0;
+    uint8_t* buff = (uint8_t*) malloc(buff_size);
+    if (buff == NULL)
+    {
+        perror("[for_each_dir_block] Allocation of buffer failed\n");
+        return E_BADALLOC;
+    }
+    STAT_ADD(fs, allocs, 1);
+
+    file_stream_t stream;
+    int ret = file_stream_open(fs, inode, &stream);
+    if (ret != E_SUCCESS)
+    {
+        free(buff);
+        return ret;
+    }
+
+    ssize_t read = 0;
+    while (ret == E_SUCCESS &&
+           (read = file_stream_read(&stream, buff, buff_size)) > 0)
+    {
+        for (size_t pos = 0; pos + fs->block_size <= (size_t)read &&
+                             ret == E_SUCCESS; pos += fs->block_size)
+            ret = cb(fs, buff + pos, ctx);
+    }
+
+    if (read < 0)
+        ret = E_BADIO;
+
+    file_stream_close(&stream);
+    free(buff);
+    return ret;
+}
+
+static int print_block_cb(ext2_fs_t* fs, const uint8_t* block, void* ctx)
+{
+    if (fs->revision == EXT2_GOOD_OLD_REV)
+        return parse_dir_block((uint8_t*)block, fs->block_size);
+
+    return parse_dir_block_2((uint8_t*)block, fs->block_size);
+}
+
+static int read_extent_dir(ext2_fs_t* fs, inode_t* inode)
+{
+    assert(fs != NULL);
+    assert(inode != NULL);
+
+    return for_each_dir_block(fs, inode, print_block_cb, NULL);
+}
+
+typedef struct dir_entry_iter
+{
+    dir_entry_cb_t cb;
+    void*          ctx;
+} dir_entry_iter_t;
+
+static int iterate_block_cb(ext2_fs_t* fs, const uint8_t* block, void* ctx)
+{
+    dir_entry_iter_t* iter = (dir_entry_iter_t*) ctx;
+    assert(iter != NULL);
+
+    return iterate_dir_block(fs, block, iter->cb, iter->ctx);
+}
+
+int iterate_dir(ext2_fs_t* fs, inode_t* inode, dir_entry_cb_t cb, void* ctx)
+{
+    if (fs == NULL || inode == NULL || cb == NULL)
+    {
+        fprintf(stderr, "[iterate_dir] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    dir_entry_iter_t iter = {.cb = cb, .ctx = ctx};
+    return for_each_dir_block(fs, inode, iterate_block_cb, &iter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// subtree walker
+// Entries of every directory are collected first, so a directory stream is
+// closed before descending and the recursion depth costs no I/O buffers.
+////////////////////////////////////////////////////////////////////////////////
+#define EXT2_PATH_MAX 4096
+
+// returning anything but E_SUCCESS stops the walk
+typedef int (*tree_cb_t)(ext2_fs_t* fs, const char* path, uint32_t ino,
+                         inode_t* inode, void* ctx);
+
+typedef struct dir_list_entry
+{
+    uint32_t ino;
+    uint32_t name_off;
+    uint16_t name_len;
+} dir_list_entry_t;
+
+typedef struct dir_list
+{
+    dir_list_entry_t* entries;
+    size_t            num;
+    size_t            cap;
+    char*             names;
+    size_t            names_size;
+    size_t            names_cap;
+} dir_list_t;
+
+static int collect_dir_entry(uint32_t ino, uint8_t file_type,
+                             const char* name, size_t name_len, void* ctx)
+{
+    dir_list_t* list = (dir_list_t*) ctx;
+    assert(list != NULL);
+
+    if ((name_len == 1 && name[0] == '.') ||
+        (name_len == 2 && name[0] == '.' && name[1] == '.'))
+        return E_SUCCESS;
+
+    if (list->num == list->cap)
+    {
+        size_t new_cap = (list->cap == 0) ? 64 : 2 * list->cap;
+        errno = 0;
+        dir_list_entry_t* new_entries = (dir_list_entry_t*)
+                         realloc(list->entries, new_cap * sizeof(*new_entries));
+        if (new_entries == NULL)
+        {
+            perror("[collect_dir_entry] Reallocation of entries failed\n");
+            return E_BADALLOC;
+        }
+        list->entries = new_entries;
+        list->cap     = new_cap;
+    }
+
+    if (list->names_size + name_len + 1 > list->names_cap)
+    {
+        size_t new_cap = (list->names_cap == 0) ? 4096 : 2 * list->names_cap;
+        while (new_cap < list->names_size + name_len + 1)
+            new_cap *= 2;
+
+        errno = 0;
+        char* new_names = (char*) realloc(list->names, new_cap);
+        if (new_names == NULL)
+        {
+            perror("[collect_dir_entry] Reallocation of names failed\n");
+            return E_BADALLOC;
+        }
+        list->names     = new_names;
+        list->names_cap = new_cap;
+    }
+
+    dir_list_entry_t* entry = &list->entries[list->num++];
+    entry->ino      = ino;
+    entry->name_off = list->names_size;
+    entry->name_len = name_len;
+
+    memcpy(list->names + list->names_size, name, name_len);
+    list->names[list->names_size + name_len] = '\0';
+    list->names_size += name_len + 1;
+
+    return E_SUCCESS;
+}
+
+static int walk_dir(ext2_fs_t* fs, char* path, size_t path_len,
+                    inode_t* dir_inode, tree_cb_t cb, void* ctx)
+{
+    assert(fs != NULL);
+    assert(path != NULL);
+    assert(dir_inode != NULL);
+
+    dir_list_t list = {};
+    int ret = iterate_dir(fs, dir_inode, collect_dir_entry, &list);
+
+    for (size_t i = 0; i < list.num && ret == E_SUCCESS; i++)
+    {
+        dir_list_entry_t* entry = &list.entries[i];
+        size_t sep = (path_len > 0 && path[path_len - 1] == '/') ? 0 : 1;
+        if (path_len + sep + entry->name_len + 1 > EXT2_PATH_MAX)
+        {
+            fprintf(stderr, "[walk_dir] Path is too long, skipping %s\n",
+                            list.names + entry->name_off);
+            continue;
+        }
+
+        if (sep)
+            path[path_len] = '/';
+        memcpy(path + path_len + sep, list.names + entry->name_off,
+               entry->name_len + 1);
+        size_t child_len = path_len + sep + entry->name_len;
+
+        inode_t child;
+        ret = get_ext2_inode(fs, entry->ino, &child);
+        if (ret != E_SUCCESS)
+        {
+            fprintf(stderr, "[walk_dir] %d: getting inode %u failed\n",
+                            ret, entry->ino);
+            break;
+        }
+
+        ret = cb(fs, path, entry->ino, &child, ctx);
+        if (ret == E_SUCCESS && EXT2_S_ISDIR(__le16_to_cpu(child.i_mode)))
+            ret = walk_dir(fs, path, child_len, &child, cb, ctx);
+
+        path[path_len] = '\0';
+    }
+
+    free(list.entries);
+    free(list.names);
+    return ret;
+}
+
+int walk_tree(ext2_fs_t* fs, uint32_t ino, const char* root_path,
+              tree_cb_t cb, void* ctx)
+{
+    if (fs == NULL || root_path == NULL || cb == NULL)
+    {
+        fprintf(stderr, "[walk_tree] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    size_t root_len = strnlen(root_path, EXT2_PATH_MAX);
+    if (root_len == EXT2_PATH_MAX)
+    {
+        fprintf(stderr, "[walk_tree] Root path is too long\n");
+        return E_BADARGS;
+    }
+
+    inode_t root;
+    int ret = get_ext2_inode(fs, ino, &root);
+    if (ret != E_SUCCESS)
+    {
+        fprintf(stderr, "[walk_tree] %d: getting root inode failed\n", ret);
+        return ret;
+    }
+
+    char* path = (char*) malloc(EXT2_PATH_MAX);
+    if (path == NULL)
+    {
+        perror("[walk_tree] Allocation of path buffer failed\n");
+        return E_BADALLOC;
+    }
+    memcpy(path, root_path, root_len + 1);
+
+    ret = cb(fs, path, ino, &root, ctx);
+    if (ret == E_SUCCESS && EXT2_S_ISDIR(__le16_to_cpu(root.i_mode)))
+        ret = walk_dir(fs, path, root_len, &root, cb, ctx);
+
+    free(path);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// path resolution
+////////////////////////////////////////////////////////////////////////////////
+typedef struct name_lookup
+{
+    name_key_t key;
+    uint32_t   ino;
+} name_lookup_t;
+
+static int lookup_block_cb(ext2_fs_t* fs, const uint8_t* block, void* ctx)
+{
+    name_lookup_t* lookup = (name_lookup_t*) ctx;
+    assert(lookup != NULL);
+
+    int ret = find_dir_block(fs, block, &lookup->key, &lookup->ino);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    return (lookup->ino != 0) ? E_STOP : E_SUCCESS;
+}
+
+int lookup_name(ext2_fs_t* fs, inode_t* dir, const char* name, size_t name_len,
+                uint32_t* ino)
+{
+    if (fs == NULL || dir == NULL || name == NULL || ino == NULL)
+    {
+        fprintf(stderr, "[lookup_name] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    name_lookup_t lookup = {.ino = 0};
+    make_name_key(&lookup.key, name, name_len);
+
+    int ret = for_each_dir_block(fs, dir, lookup_block_cb, &lookup);
+    if (ret == E_STOP)
+    {
+        *ino = lookup.ino;
+        return E_SUCCESS;
+    }
+
+    return (ret == E_SUCCESS) ? E_ERROR : ret;
+}
+
+int resolve_path(ext2_fs_t* fs, const char* path, uint32_t* ino)
+{
+    if (fs == NULL || path == NULL || ino == NULL)
+    {
+        fprintf(stderr, "[resolve_path] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    uint32_t cur_ino = EXT2_ROOT_INO;
+    const char* pos = path;
+    while (*pos != '\0')
+    {
+        while (*pos == '/')
+            pos++;
+
+        size_t name_len = strcspn(pos, "/");
+        if (name_len == 0)
+            break;
+
+        inode_t dir;
+        int ret = get_ext2_inode(fs, cur_ino, &dir);
+        if (ret != E_SUCCESS)
+            return ret;
+
+        if (!EXT2_S_ISDIR(__le16_to_cpu(dir.i_mode)))
+        {
+            fprintf(stderr, "[resolve_path] %.*s is not a directory\n",
+                            (int)(pos - path), path);
+            return E_ERROR;
+        }
+
+        ret = lookup_name(fs, &dir, pos, name_len, &cur_ino);
+        if (ret != E_SUCCESS)
+        {
+            fprintf(stderr, "[resolve_path] %.*s not found\n",
+                            (int)(pos - path + name_len), path);
+            return E_ERROR;
+        }
+
+        pos += name_len;
+    }
+
+    *ino = cur_ino;
+    return E_SUCCESS;
+}
+
+// target is either an inode number or an absolute path inside the image
+int parse_target(ext2_fs_t* fs, const char* target, uint32_t* ino)
+{
+    if (fs == NULL || target == NULL || ino == NULL)
+    {
+        fprintf(stderr, "[parse_target] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    if (target[0] == '/')
+        return resolve_path(fs, target, ino);
+
+    errno = 0;
+    char* endptr = NULL;
+    long long int inode_number = strtoll(target, &endptr, 10);
+    if (errno != 0 || endptr == target || *endptr != '\0' ||
+        inode_number <= 0 || inode_number > (long long int)fs->num_inodes)
+    {
+        fprintf(stderr, "[parse_target] Bad target %s, "
+                        "expected inode number or absolute path\n", target);
+        return E_BADARGS;
+    }
+
+    *ino = inode_number;
+    return E_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bounded queue
+////////////////////////////////////////////////////////////////////////////////
+typedef struct bqueue
+{
+    void**          items;
+    size_t          cap;
+    size_t          head;
+    size_t          num;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} bqueue_t;
+
+static int bqueue_init(bqueue_t* queue, size_t cap)
+{
+    assert(queue != NULL);
+
+    errno = 0;
+    queue->items = (void**) calloc(cap, sizeof(void*));
+    if (queue->items == NULL)
+    {
+        perror("[bqueue_init] Allocation of queue failed\n");
+        return E_BADALLOC;
+    }
+
+    queue->cap  = cap;
+    queue->head = 0;
+    queue->num  = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return E_SUCCESS;
+}
+
+static void bqueue_destroy(bqueue_t* queue)
+{
+    assert(queue != NULL);
+
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+}
+
+static void bqueue_push(bqueue_t* queue, void* item)
+{
+    assert(queue != NULL);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->num == queue->cap)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+
+    queue->items[(queue->head + queue->num) % queue->cap] = item;
+    queue->num++;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void* bqueue_pop(bqueue_t* queue)
+{
+    assert(queue != NULL);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->num == 0)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+
+    void* item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->cap;
+    queue->num--;
+
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// hash mode
+// reader thread -> hash_q -> hasher thread -> out_q -> output thread
+// Data chunks circulate through free_q, so at most HASH_NUM_CHUNKS chunks are
+// in flight and the reader blocks instead of buffering whole files.
+////////////////////////////////////////////////////////////////////////////////
+#define HASH_CHUNK_SIZE (256 * 1024)
+#define HASH_NUM_CHUNKS 16
+
+typedef struct hash_file
+{
+    char*    path;
+    uint32_t ino;
+    uint64_t size;
+    int      error;
+    uint8_t  digest[DIGEST_MAX_SIZE];
+} hash_file_t;
+
+typedef struct hash_chunk
+{
+    hash_file_t* file;
+    uint8_t*     data;
+    size_t       size;
+    int          is_first;
+    int          is_last;
+} hash_chunk_t;
+
+typedef struct hash_pipeline
+{
+    ext2_fs_t*    fs;
+    int           algo;
+    uint32_t      root_ino;
+    int           reader_ret;
+    size_t        num_failed; // files which failed to read, output thread
+    hash_chunk_t* chunks;
+    bqueue_t      free_q;
+    bqueue_t      hash_q;
+    bqueue_t      out_q;
+} hash_pipeline_t;
+
+static int hash_tree_cb(ext2_fs_t* fs, const char* path, uint32_t ino,
+                        inode_t* inode, void* ctx)
+{
+    hash_pipeline_t* pipe = (hash_pipeline_t*) ctx;
+    assert(pipe != NULL);
+
+    if (!EXT2_S_ISREG(__le16_to_cpu(inode->i_mode)))
+        return E_SUCCESS;
+
+    errno = 0;
+    hash_file_t* file = (hash_file_t*) calloc(1, sizeof(hash_file_t));
+    if (file == NULL || (file->path = strdup(path)) == NULL)
+    {
+        perror("[hash_tree_cb] Allocation of file record failed\n");
+        free(file);
+        return E_BADALLOC;
+    }
+    file->ino  = ino;
+    file->size = get_inode_size(inode);
+
+    file_stream_t stream;
+    int ret = file_stream_open(fs, inode, &stream);
+    if (ret != E_SUCCESS)
+        file->error = ret;
+
+    int is_first = 1;
+    int is_last  = 0;
+    while (!is_last)
+    {
+        hash_chunk_t* chunk = (hash_chunk_t*) bqueue_pop(&pipe->free_q);
+        ssize_t read = 0;
+        if (file->error == E_SUCCESS)
+            read = file_stream_read(&stream, chunk->data, HASH_CHUNK_SIZE);
+
+        if (read < 0)
+        {
+            file->error = (int)read;
+            read = 0;
+        }
+
+        chunk->file     = file;
+        chunk->size     = read;
+        chunk->is_first = is_first;
+        chunk->is_last  = (file->error != E_SUCCESS || stream.pos >= stream.size);
+        is_first = 0;
+        is_last  = chunk->is_last;
+
+        bqueue_push(&pipe->hash_q, chunk);
+    }
+
+    if (ret == E_SUCCESS)
+        file_stream_close(&stream);
+
+    return E_SUCCESS;
+}
+
+static void* hash_reader_thread(void* arg)
+{
+    hash_pipeline_t* pipe = (hash_pipeline_t*) arg;
+
+    pipe->reader_ret = walk_tree(pipe->fs, pipe->root_ino, "", hash_tree_cb, pipe);
+    bqueue_push(&pipe->hash_q, NULL);
+
+    return NULL;
+}
+
+static void* hash_hasher_thread(void* arg)
+{
+    hash_pipeline_t* pipe = (hash_pipeline_t*) arg;
+    digest_t digest;
+
+    hash_chunk_t* chunk = NULL;
+    while ((chunk = (hash_chunk_t*) bqueue_pop(&pipe->hash_q)) != NULL)
+    {
+        hash_file_t* file = chunk->file;
+        if (chunk->is_first)
+            digest_init(&digest, pipe->algo);
+
+        digest_update(&digest, chunk->data, chunk->size);
+
+        int is_last = chunk->is_last;
+        bqueue_push(&pipe->free_q, chunk);
+
+        if (is_last)
+        {
+            digest_final(&digest, file->digest);
+            bqueue_push(&pipe->out_q, file);
+        }
+    }
+    bqueue_push(&pipe->out_q, NULL);
+
+    return NULL;
+}
+
+static void* hash_output_thread(void* arg)
+{
+    hash_pipeline_t* pipe = (hash_pipeline_t*) arg;
+    size_t size = digest_size(pipe->algo);
+    char hex[2 * DIGEST_MAX_SIZE + 1];
+
+    hash_file_t* file = NULL;
+    while ((file = (hash_file_t*) bqueue_pop(&pipe->out_q)) != NULL)
+    {
+        if (file->error != E_SUCCESS)
+        {
+            fprintf(stderr, "[hash_output_thread] %d: reading %s failed\n",
+                            file->error, file->path);
+            pipe->num_failed++;
+        }
+        else
+        {
+            digest_to_hex(file->digest, size, hex);
+            printf("%s %u %lu %s\n", hex, file->ino, file->size,
+                   (file->path[0] == '\0') ? "/" : file->path);
+        }
+
+        free(file->path);
+        free(file);
+    }
+    fflush(stdout);
+
+    return NULL;
+}
+
+static int hash_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "[hash_mode] Try ./read_ext2 device hash "
+                        "sha256|xxh64 inode_number|/path\n");
+        return E_BADARGS;
+    }
+
+    hash_pipeline_t pipe = {.fs = fs};
+    if (strcmp(argv[0], "sha256") == 0)
+        pipe.algo = DIGEST_SHA256;
+    else if (strcmp(argv[0], "xxh64") == 0)
+        pipe.algo = DIGEST_XXH64;
+    else
+    {
+        fprintf(stderr, "[hash_mode] Unknown digest %s\n", argv[0]);
+        return E_BADARGS;
+    }
+
+    int ret = parse_target(fs, argv[1], &pipe.root_ino);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    errno = 0;
+    pipe.chunks = (hash_chunk_t*) calloc(HASH_NUM_CHUNKS, sizeof(hash_chunk_t));
+    uint8_t* data = (uint8_t*) malloc((size_t)HASH_NUM_CHUNKS * HASH_CHUNK_SIZE);
+    if (pipe.chunks == NULL || data == NULL)
+    {
+        perror("[hash_mode] Allocation of chunks failed\n");
+        free(pipe.chunks);
+        free(data);
+        return E_BADALLOC;
+    }
+
+    ret = bqueue_init(&pipe.free_q, HASH_NUM_CHUNKS);
+    if (ret == E_SUCCESS)
+        ret = bqueue_init(&pipe.hash_q, HASH_NUM_CHUNKS + 1);
+    if (ret == E_SUCCESS)
+        ret = bqueue_init(&pipe.out_q, HASH_NUM_CHUNKS + 1);
+    if (ret != E_SUCCESS)
+    {
+        free(pipe.chunks);
+        free(data);
+        return ret;
+    }
+
+    for (size_t i = 0; i < HASH_NUM_CHUNKS; i++)
+    {
+        pipe.chunks[i].data = data + i * HASH_CHUNK_SIZE;
+        bqueue_push(&pipe.free_q, &pipe.chunks[i]);
+    }
+
+    // every stage ends on the NULL of the one before, a stage which did
+    // not start gets its NULL pushed here so the started ones still finish
+    pthread_t reader, hasher, output;
+    int started = 0;
+    if (pthread_create(&output, NULL, hash_output_thread, &pipe) == 0)
+        started++;
+    if (started == 1 &&
+        pthread_create(&hasher, NULL, hash_hasher_thread, &pipe) == 0)
+        started++;
+    if (started == 2 &&
+        pthread_create(&reader, NULL, hash_reader_thread, &pipe) == 0)
+        started++;
+
+    if (started < 3)
+        fprintf(stderr, "[hash_mode] Starting pipeline thread failed\n");
+    if (started == 2)
+        bqueue_push(&pipe.hash_q, NULL);
+    if (started == 1)
+        bqueue_push(&pipe.out_q, NULL);
+
+    if (started > 2)
+        pthread_join(reader, NULL);
+    if (started > 1)
+        pthread_join(hasher, NULL);
+    if (started > 0)
+        pthread_join(output, NULL);
+
+    bqueue_destroy(&pipe.free_q);
+    bqueue_destroy(&pipe.hash_q);
+    bqueue_destroy(&pipe.out_q);
+    free(pipe.chunks);
+    free(data);
+
+    if (started < 3)
+        return E_ERROR;
+    if (pipe.reader_ret != E_SUCCESS)
+        return pipe.reader_ret;
+    // a manifest missing files must not look complete
+    if (pipe.num_failed > 0)
+    {
+        fprintf(stderr, "[hash_mode] %zu files failed to read\n",
+                pipe.num_failed);
+        return E_BADIO;
+    }
+    return E_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// inode table scanner
+// Reads the group descriptor table once, then the inode bitmap and inode
+// table of every group in large chunks. Chunks without used inodes are skipped.
+////////////////////////////////////////////////////////////////////////////////
+#define INODE_TABLE_READ_BLOCKS 64
+
+// returning anything but E_SUCCESS stops the scan
+typedef int (*inode_cb_t)(ext2_fs_t* fs, uint32_t ino, inode_t* inode,
+                          void* ctx);
+
+int read_group_descs(ext2_fs_t* fs, group_desc_t** descs, size_t* num_groups)
+{
+    if (fs == NULL || descs == NULL || num_groups == NULL)
+    {
+        fprintf(stderr, "[read_group_descs] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    // the table was read by ext2_open(), hand out a private copy
+    size_t table_size = fs->num_groups * sizeof(group_desc_t);
+
+    errno = 0;
+    group_desc_t* table = (group_desc_t*) malloc(table_size);
+    if (table == NULL)
+    {
+        perror("[read_group_descs] Allocation of table failed\n");
+        return E_BADALLOC;
+    }
+    STAT_ADD(fs, allocs, 1);
+
+    memcpy(table, fs->descs, table_size);
+    *descs      = table;
+    *num_groups = fs->num_groups;
+    return E_SUCCESS;
+}
+
+// number of leading inodes of a group whose table slots were ever written,
+// with uninit_bg the rest of the bitmap and table may hold stale data
+static size_t group_inodes_used(const ext2_fs_t* fs, const group_desc_t* desc)
+{
+    if (!fs->uninit_bg)
+        return fs->inodes_per_group;
+    if (__le16_to_cpu(desc->bg_flags) & EXT4_BG_INODE_UNINIT)
+        return 0;
+
+    size_t unused = __le16_to_cpu(desc->bg_itable_unused);
+    if (unused > fs->inodes_per_group)
+        return 0;
+    return fs->inodes_per_group - unused;
+}
+
+int iterate_inodes(ext2_fs_t* fs, inode_cb_t cb, void* ctx)
+{
+    if (fs == NULL || cb == NULL)
+    {
+        fprintf(stderr, "[iterate_inodes] Bad input pointers\n");
+        return E_BADARGS;
+    }
+
+    group_desc_t* descs = NULL;
+    size_t num_groups = 0;
+    int ret = read_group_descs(fs, &descs, &num_groups);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    size_t inodes_per_block = fs->block_size / fs->inode_size;
+    size_t chunk_inodes = inodes_per_block * INODE_TABLE_READ_BLOCKS;
+
+    errno = 0;
+    uint8_t* bitmap = (uint8_t*) malloc(fs->block_size);
+    uint8_t* table  = (uint8_t*) malloc(INODE_TABLE_READ_BLOCKS * fs->block_size);
+    if (bitmap == NULL || table == NULL)
+    {
+        perror("[iterate_inodes] Allocation of buffers failed\n");
+        free(bitmap);
+        free(table);
+        free(descs);
+        return E_BADALLOC;
+    }
+
+    for (size_t group = 0; group < num_groups && ret == E_SUCCESS; group++)
+    {
+        size_t num_used = group_inodes_used(fs, &descs[group]);
+        if (num_used == 0)
+            continue;
+
+        ssize_t read = read_block(__le32_to_cpu(descs[group].bg_inode_bitmap),
+                                  fs, bitmap);
+        if (read < 0)
+        {
+            fprintf(stderr, "[iterate_inodes] %ld: reading bitmap of "
+                            "group %lu failed\n", read, group);
+            ret = E_BADIO;
+            break;
+        }
+
+        size_t table_block = __le32_to_cpu(descs[group].bg_inode_table);
+        for (size_t first = 0; first < num_used && ret == E_SUCCESS;
+             first += chunk_inodes)
+        {
+            size_t last = first + chunk_inodes;
+            if (last > num_used)
+                last = num_used;
+
+            size_t used = 0;
+            for (size_t i = first; i < last && used == 0; i++)
+                used = bitmap[i / 8] & (1 << (i % 8));
+            if (used == 0)
+                continue;
+
+            size_t chunk_size = ((last - first + inodes_per_block - 1) /
+                                 inodes_per_block) * fs->block_size;
+            off_t offset = (table_block + first / inodes_per_block) *
+                           fs->block_size;
+            errno = 0;
+            read = pread(fs->dev_fd, table, chunk_size, offset);
+            if (read != (ssize_t)chunk_size)
+            {
+                perror("[iterate_inodes] Reading inode table failed\n");
+                ret = E_BADIO;
+                break;
+            }
+
+            for (size_t i = first; i < last && ret == E_SUCCESS; i++)
+            {
+                if ((bitmap[i / 8] & (1 << (i % 8))) == 0)
+                    continue;
+
+                size_t ino = group * fs->inodes_per_group + i + 1;
+                if (ino > fs->num_inodes)
+                    break;
+
+                inode_t inode;
+                memcpy(&inode, table + (i - first) * fs->inode_size,
+                       sizeof(inode_t));
+                ret = cb(fs, ino, &inode, ctx);
+            }
+        }
+    }
+
+    free(bitmap);
+    free(table);
+    free(descs);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// dedup mode
+// Keeps an on-disk index from SHA-256 of a data block to the first
+// (image, block) where it was seen. The index outlives many images and a
+// match is never verified against the data, so a 64-bit hash is not enough.
+// Each image also stores signatures of its inodes, so the next image of the
+// same file system (same UUID) hashes only the blocks of inodes whose size,
+// times or block pointers changed.
+//
+// Index file layout (host byte order):
+//   dedup_header_t | dedup_image_t[num_images] | dedup_block_t[num_blocks] |
+//   dedup_inode_t[num_inodes]
+////////////////////////////////////////////////////////////////////////////////
+#define DEDUP_MAGIC       "E2DEDUP"
+#define DEDUP_VERSION     2
+#define DEDUP_NAME_LEN    256
+#define DEDUP_READ_BLOCKS 256
+
+typedef struct dedup_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t num_images;
+    uint64_t num_blocks;
+    uint64_t num_inodes;
+} dedup_header_t;
+
+typedef struct dedup_image
+{
+    char     name[DEDUP_NAME_LEN];
+    uint8_t  uuid[16];
+    uint32_t wtime;
+    uint32_t block_size;
+} dedup_image_t;
+
+typedef struct dedup_block
+{
+    uint8_t  hash[SHA256_DIGEST_SIZE];
+    uint32_t image;
+    uint32_t block;
+} dedup_block_t;
+
+typedef struct dedup_inode
+{
+    uint64_t sig;
+    uint32_t image;
+    uint32_t ino;
+} dedup_inode_t;
+
+typedef struct dedup_index
+{
+    dedup_image_t* images;
+    size_t         num_images;
+    dedup_block_t* blocks;
+    size_t         num_blocks;
+    size_t         cap_blocks;
+    dedup_inode_t* inodes;
+    size_t         num_inodes;
+    size_t         cap_inodes;
+    size_t*        table;      // open addressing, block index + 1, 0 - empty
+    size_t         table_size; // power of two
+} dedup_index_t;
+
+typedef struct dedup_scan
+{
+    dedup_index_t* index;
+    uint32_t       image;
+    uint64_t*      base_sigs;  // by inode number, 0 - not in base image
+    uint8_t*       buff;
+    uint64_t       inodes_total;
+    uint64_t       inodes_skipped;
+    uint64_t       blocks_hashed;
+    uint64_t       blocks_new;
+    uint64_t       blocks_dup;
+} dedup_scan_t;
+
+// the digest is uniform already, its first bytes pick the slot
+static size_t dedup_slot(const uint8_t* hash)
+{
+    uint64_t slot;
+    memcpy(&slot, hash, sizeof(slot));
+    return slot;
+}
+
+static void dedup_hash(const uint8_t* data, size_t size, uint8_t* hash)
+{
+    sha256_ctx_t ctx;
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, size);
+    sha256_final(&ctx, hash);
+}
+
+static int dedup_table_rebuild(dedup_index_t* index, size_t table_size)
+{
+    assert(index != NULL);
+
+    errno = 0;
+    size_t* table = (size_t*) calloc(table_size, sizeof(size_t));
+    if (table == NULL)
+    {
+        perror("[dedup_table_rebuild] Allocation of table failed\n");
+        return E_BADALLOC;
+    }
+
+    free(index->table);
+    index->table      = table;
+    index->table_size = table_size;
+
+    for (size_t i = 0; i < index->num_blocks; i++)
+    {
+        size_t slot = dedup_slot(index->blocks[i].hash) & (table_size - 1);
+        while (table[slot] != 0)
+            slot = (slot + 1) & (table_size - 1);
+        table[slot] = i + 1;
+    }
+
+    return E_SUCCESS;
+}
+
+static dedup_block_t* dedup_find(dedup_index_t* index, const uint8_t* hash)
+{
+    assert(index != NULL);
+
+    size_t mask = index->table_size - 1;
+    for (size_t slot = dedup_slot(hash) & mask; index->table[slot] != 0;
+         slot = (slot + 1) & mask)
+    {
+        dedup_block_t* block = &index->blocks[index->table[slot] - 1];
+        if (memcmp(block->hash, hash, SHA256_DIGEST_SIZE) == 0)
+            return block;
+    }
+
+    return NULL;
+}
+
+static int dedup_add_block(dedup_index_t* index, const uint8_t* hash,
+                           uint32_t image, uint32_t block_id)
+{
+    assert(index != NULL);
+
+    if (index->num_blocks == index->cap_blocks)
+    {
+        size_t new_cap = (index->cap_blocks == 0) ? 1024 : 2 * index->cap_blocks;
+        errno = 0;
+        dedup_block_t* new_blocks = (dedup_block_t*) realloc(index->blocks,
+                                            new_cap * sizeof(dedup_block_t));
+        if (new_blocks == NULL)
+        {
+            perror("[dedup_add_block] Reallocation of blocks failed\n");
+            return E_BADALLOC;
+        }
+        index->blocks     = new_blocks;
+        index->cap_blocks = new_cap;
+    }
+
+    dedup_block_t* block = &index->blocks[index->num_blocks++];
+    memcpy(block->hash, hash, SHA256_DIGEST_SIZE);
+    block->image = image;
+    block->block = block_id;
+
+    // keep load factor under 1/2
+    if (2 * index->num_blocks > index->table_size)
+        return dedup_table_rebuild(index, 2 * index->table_size);
+
+    size_t mask = index->table_size - 1;
+    size_t slot = dedup_slot(hash) & mask;
+    while (index->table[slot] != 0)
+        slot = (slot + 1) & mask;
+    index->table[slot] = index->num_blocks;
+
+    return E_SUCCESS;
+}
+
+static int dedup_add_inode(dedup_index_t* index, uint64_t sig, uint32_t image,
+                           uint32_t ino)
+{
+    assert(index != NULL);
+
+    if (index->num_inodes == index->cap_inodes)
+    {
+        size_t new_cap = (index->cap_inodes == 0) ? 1024 : 2 * index->cap_inodes;
+        errno = 0;
+        dedup_inode_t* new_inodes = (dedup_inode_t*) realloc(index->inodes,
+                                            new_cap * sizeof(dedup_inode_t));
+        if (new_inodes == NULL)
+        {
+            perror("[dedup_add_inode] Reallocation of inodes failed\n");
+            return E_BADALLOC;
+        }
+        index->inodes     = new_inodes;
+        index->cap_inodes = new_cap;
+    }
+
+    dedup_inode_t* inode = &index->inodes[index->num_inodes++];
+    inode->sig   = sig;
+    inode->image = image;
+    inode->ino   = ino;
+
+    return E_SUCCESS;
+}
+
+static void dedup_free(dedup_index_t* index)
+{
+    assert(index != NULL);
+
+    free(index->images);
+    free(index->blocks);
+    free(index->inodes);
+    free(index->table);
+    memset(index, 0, sizeof(*index));
+}
+
+static int read_full(int fd, void* buff, size_t size)
+{
+    uint8_t* pos = (uint8_t*) buff;
+    while (size > 0)
+    {
+        errno = 0;
+        ssize_t done = read(fd, pos, size);
+        if (done <= 0)
+            return E_BADIO;
+
+        pos  += done;
+        size -= done;
+    }
+
+    return E_SUCCESS;
+}
+
+static int write_full(int fd, const void* buff, size_t size)
+{
+    const uint8_t* pos = (const uint8_t*) buff;
+    while (size > 0)
+    {
+        errno = 0;
+        ssize_t done = write(fd, pos, size);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return E_BADIO;
+
+        pos  += done;
+        size -= done;
+    }
+
+    return E_SUCCESS;
+}
+
+static int dedup_load(const char* path, dedup_index_t* index)
+{
+    assert(path != NULL);
+    assert(index != NULL);
+
+    memset(index, 0, sizeof(*index));
+
+    errno = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT)
+        return dedup_table_rebuild(index, 1024);
+    if (fd < 0)
+    {
+        perror("[dedup_load] Opening index failed\n");
+        return E_BADIO;
+    }
+
+    dedup_header_t hdr;
+    int ret = read_full(fd, &hdr, sizeof(hdr));
+    if (ret != E_SUCCESS || memcmp(hdr.magic, DEDUP_MAGIC, sizeof(DEDUP_MAGIC)) ||
+        hdr.version != DEDUP_VERSION)
+    {
+        fprintf(stderr, "[dedup_load] %s is not a dedup index\n", path);
+        close(fd);
+        return E_ERROR;
+    }
+
+    errno = 0;
+    index->images = (dedup_image_t*) malloc((hdr.num_images + 1) *
+                                            sizeof(dedup_image_t));
+    index->blocks = (dedup_block_t*) malloc((hdr.num_blocks + 1) *
+                                            sizeof(dedup_block_t));
+    index->inodes = (dedup_inode_t*) malloc((hdr.num_inodes + 1) *
+                                            sizeof(dedup_inode_t));
+    if (index->images == NULL || index->blocks == NULL || index->inodes == NULL)
+    {
+        perror("[dedup_load] Allocation of index failed\n");
+        close(fd);
+        dedup_free(index);
+        return E_BADALLOC;
+    }
+
+    index->num_images = hdr.num_images;
+    index->num_blocks = index->cap_blocks = hdr.num_blocks;
+    index->num_inodes = index->cap_inodes = hdr.num_inodes;
+
+    ret = read_full(fd, index->images, hdr.num_images * sizeof(dedup_image_t));
+    if (ret == E_SUCCESS)
+        ret = read_full(fd, index->blocks, hdr.num_blocks * sizeof(dedup_block_t));
+    if (ret == E_SUCCESS)
+        ret = read_full(fd, index->inodes, hdr.num_inodes * sizeof(dedup_inode_t));
+    close(fd);
+
+    if (ret != E_SUCCESS)
+    {
+        fprintf(stderr, "[dedup_load] %s is truncated\n", path);
+        dedup_free(index);
+        return ret;
+    }
+
+    // image numbers are used as indexes into images later
+    int bad = 0;
+    for (size_t i = 0; i < index->num_blocks && !bad; i++)
+        bad = (index->blocks[i].image >= index->num_images);
+    for (size_t i = 0; i < index->num_inodes && !bad; i++)
+        bad = (index->inodes[i].image >= index->num_images);
+    if (bad)
+    {
+        fprintf(stderr, "[dedup_load] %s refers to a missing image\n", path);
+        dedup_free(index);
+        return E_ERROR;
+    }
+
+    size_t table_size = 1024;
+    while (table_size < 2 * index->num_blocks + 2)
+        table_size *= 2;
+
+    return dedup_table_rebuild(index, table_size);
+}
+
+// writes to a temporary file first, so a failed run keeps the old index
+static int dedup_save(const char* path, dedup_index_t* index)
+{
+    assert(path != NULL);
+    assert(index != NULL);
+
+    char tmp_path[PATH_MAX] = {};
+    int len = snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+    if (len < 0 || len >= PATH_MAX)
+    {
+        fprintf(stderr, "[dedup_save] Index path is too long\n");
+        return E_BADARGS;
+    }
+
+    errno = 0;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror("[dedup_save] Creating index failed\n");
+        return E_BADIO;
+    }
+
+    dedup_header_t hdr = {
+        .magic      = DEDUP_MAGIC,
+        .version    = DEDUP_VERSION,
+        .num_images = index->num_images,
+        .num_blocks = index->num_blocks,
+        .num_inodes = index->num_inodes,
+    };
+
+    int ret = write_full(fd, &hdr, sizeof(hdr));
+    if (ret == E_SUCCESS)
+        ret = write_full(fd, index->images,
+                         index->num_images * sizeof(dedup_image_t));
+    if (ret == E_SUCCESS)
+        ret = write_full(fd, index->blocks,
+                         index->num_blocks * sizeof(dedup_block_t));
+    if (ret == E_SUCCESS)
+        ret = write_full(fd, index->inodes,
+                         index->num_inodes * sizeof(dedup_inode_t));
+
+    if (close(fd) < 0 || ret != E_SUCCESS)
+    {
+        perror("[dedup_save] Writing index failed\n");
+        unlink(tmp_path);
+        return E_BADIO;
+    }
+
+    errno = 0;
+    if (rename(tmp_path, path) < 0)
+    {
+        perror("[dedup_save] Replacing index failed\n");
+        unlink(tmp_path);
+        return E_BADIO;
+    }
+
+    return E_SUCCESS;
+}
+
+static uint64_t inode_signature(inode_t* inode)
+{
+    assert(inode != NULL);
+
+    struct {
+        __le16 mode;
+        __le32 size;
+        __le32 size_high;
+        __le32 mtime;
+        __le32 ctime;
+        __le32 generation;
+        __le32 block[EXT2_N_BLOCKS];
+    } key;
+
+    memset(&key, 0, sizeof(key));
+    key.mode       = inode->i_mode;
+    key.size       = inode->i_size;
+    key.size_high  = inode->i_dir_acl;
+    key.mtime      = inode->i_mtime;
+    key.ctime      = inode->i_ctime;
+    key.generation = inode->i_generation;
+    memcpy(key.block, inode->i_block, sizeof(key.block));
+
+    uint64_t sig = xxh64((const uint8_t*)&key, sizeof(key), 0);
+    return (sig == 0) ? 1 : sig;
+}
+
+static int dedup_run_cb(ext2_fs_t* fs, uint32_t file_block, uint32_t phys_block,
+                        uint32_t len, void* ctx)
+{
+    dedup_scan_t* scan = (dedup_scan_t*) ctx;
+    assert(scan != NULL);
+
+    if (phys_block == 0)
+        return E_SUCCESS;
+
+    while (len > 0)
+    {
+        uint32_t count = (len < DEDUP_READ_BLOCKS) ? len : DEDUP_READ_BLOCKS;
+        if ((size_t)phys_block + count > fs->num_blocks)
+        {
+            fprintf(stderr, "[dedup_run_cb] Run %u+%u is out of image\n",
+                            phys_block, count);
+            return E_ERROR;
+        }
+
+        errno = 0;
+        ssize_t read = pread(fs->dev_fd, scan->buff, count * fs->block_size,
+                             (off_t)phys_block * fs->block_size);
+        if (read != (ssize_t)(count * fs->block_size))
+        {
+            perror("[dedup_run_cb] Reading run failed\n");
+            return E_BADIO;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint8_t hash[SHA256_DIGEST_SIZE];
+            char hex[2 * SHA256_DIGEST_SIZE + 1];
+            dedup_hash(scan->buff + i * fs->block_size, fs->block_size, hash);
+            digest_to_hex(hash, SHA256_DIGEST_SIZE, hex);
+            scan->blocks_hashed++;
+
+            dedup_block_t* found = dedup_find(scan->index, hash);
+            if (found != NULL)
+            {
+                scan->blocks_dup++;
+                printf("dup %u %s %s %u\n", phys_block + i, hex,
+                       scan->index->images[found->image].name, found->block);
+                continue;
+            }
+
+            scan->blocks_new++;
+            printf("new %u %s\n", phys_block + i, hex);
+            int ret = dedup_add_block(scan->index, hash, scan->image,
+                                      phys_block + i);
+            if (ret != E_SUCCESS)
+                return ret;
+        }
+
+        phys_block += count;
+        len        -= count;
+    }
+
+    return E_SUCCESS;
+}
+
+static int dedup_inode_cb(ext2_fs_t* fs, uint32_t ino, inode_t* inode, void* ctx)
+{
+    dedup_scan_t* scan = (dedup_scan_t*) ctx;
+    assert(scan != NULL);
+
+    uint16_t mode = __le16_to_cpu(inode->i_mode);
+    if (!EXT2_S_ISREG(mode) && !EXT2_S_ISDIR(mode))
+        return E_SUCCESS;
+
+    scan->inodes_total++;
+    uint64_t sig = inode_signature(inode);
+    int ret = dedup_add_inode(scan->index, sig, scan->image, ino);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    if (scan->base_sigs != NULL && scan->base_sigs[ino] == sig)
+    {
+        scan->inodes_skipped++;
+        return E_SUCCESS;
+    }
+
+    ret = map_file_blocks(fs, inode, dedup_run_cb, scan);
+    if (ret != E_SUCCESS)
+        fprintf(stderr, "[dedup_inode_cb] %d: hashing inode %u failed\n",
+                        ret, ino);
+
+    return ret;
+}
+
+static int dedup_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc < 1 || argc > 2)
+    {
+        fprintf(stderr, "[dedup_mode] Try ./read_ext2 device dedup "
+                        "index_file [image_name]\n");
+        return E_BADARGS;
+    }
+
+    const char* index_path = argv[0];
+    const char* image_name = (argc == 2) ? argv[1] : "";
+
+    dedup_index_t index;
+    int ret = dedup_load(index_path, &index);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    // the newest image of the same file system is the base for this one
+    long long int base = -1;
+    for (size_t i = 0; i < index.num_images; i++)
+        if (memcmp(index.images[i].uuid, fs->sb->s_uuid, 16) == 0 &&
+            index.images[i].block_size == fs->block_size)
+            base = i;
+
+    dedup_scan_t scan = {.index = &index, .image = index.num_images};
+
+    errno = 0;
+    scan.buff = (uint8_t*) malloc(DEDUP_READ_BLOCKS * fs->block_size);
+    dedup_image_t* new_images = (dedup_image_t*) realloc(index.images,
+                                  (index.num_images + 1) * sizeof(dedup_image_t));
+    if (scan.buff == NULL || new_images == NULL)
+    {
+        perror("[dedup_mode] Allocation failed\n");
+        free(scan.buff);
+        dedup_free(&index);
+        return E_BADALLOC;
+    }
+    index.images = new_images;
+
+    dedup_image_t* image = &index.images[index.num_images++];
+    memset(image, 0, sizeof(*image));
+    strncpy(image->name, image_name, DEDUP_NAME_LEN - 1);
+    memcpy(image->uuid, fs->sb->s_uuid, 16);
+    image->wtime      = __le32_to_cpu(fs->sb->s_wtime);
+    image->block_size = fs->block_size;
+
+    // signatures of older images of this file system are not needed anymore
+    size_t kept = 0;
+    if (base >= 0)
+    {
+        errno = 0;
+        scan.base_sigs = (uint64_t*) calloc(fs->num_inodes + 1, sizeof(uint64_t));
+        if (scan.base_sigs == NULL)
+        {
+            perror("[dedup_mode] Allocation of base signatures failed\n");
+            free(scan.buff);
+            dedup_free(&index);
+            return E_BADALLOC;
+        }
+    }
+
+    for (size_t i = 0; i < index.num_inodes; i++)
+    {
+        dedup_inode_t* old = &index.inodes[i];
+        if (memcmp(index.images[old->image].uuid, fs->sb->s_uuid, 16) != 0)
+        {
+            index.inodes[kept++] = *old;
+            continue;
+        }
+
+        if ((long long int)old->image == base && old->ino <= fs->num_inodes)
+            scan.base_sigs[old->ino] = old->sig;
+    }
+    index.num_inodes = kept;
+
+    ret = iterate_inodes(fs, dedup_inode_cb, &scan);
+    fflush(stdout);
+
+    if (ret == E_SUCCESS)
+        ret = dedup_save(index_path, &index);
+
+    fprintf(stderr, "inodes %lu unchanged %lu blocks hashed %lu new %lu dup %lu\n",
+                    scan.inodes_total, scan.inodes_skipped, scan.blocks_hashed,
+                    scan.blocks_new, scan.blocks_dup);
+
+    free(scan.base_sigs);
+    free(scan.buff);
+    dedup_free(&index);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// diff mode
+// Phase 1 compares the inode bitmaps and inode tables of both images block by
+// block. Equal table blocks are skipped with one memcmp, differing blocks are
+// compared slot by slot and classified into per-inode flags.
+// Phase 2 walks the directory tree once. Only directories which changed are
+// read from the old image and merged by name, and file contents are compared
+// only for inodes whose i_mtime, i_size or block pointers changed.
+////////////////////////////////////////////////////////////////////////////////
+enum DIFF_FLAGS{
+    DIFF_OLD_USED = 0x01,
+    DIFF_NEW_USED = 0x02,
+    DIFF_OLD_DIR  = 0x04,
+    DIFF_NEW_DIR  = 0x08,
+    DIFF_CHANGED  = 0x10, // any byte of the inode differs
+    DIFF_DATA     = 0x20, // i_mtime, i_size or i_block differ
+    DIFF_REPLACED = 0x40, // inode was freed and reused for another file
+    DIFF_REPORTED = 0x80, // removal of the inode was already printed
+};
+
+#define DIFF_READ_SIZE (1024 * 1024)
+
+typedef struct diff_ctx
+{
+    ext2_fs_t* old_fs;
+    ext2_fs_t* new_fs;
+    uint8_t*   flags;   // by inode number
+    char*      path;
+    uint8_t*   old_buff;
+    uint8_t*   new_buff;
+    uint64_t   num_added;
+    uint64_t   num_removed;
+    uint64_t   num_modified;
+    uint64_t   num_compared; // files read for content comparison
+    uint64_t   num_freed;    // freed inodes which are not reported yet
+} diff_ctx_t;
+
+static uint8_t diff_slot_flags(const inode_t* inode, int is_new)
+{
+    uint8_t flags = is_new ? DIFF_NEW_USED : DIFF_OLD_USED;
+    if (EXT2_S_ISDIR(__le16_to_cpu(inode->i_mode)))
+        flags |= is_new ? DIFF_NEW_DIR : DIFF_OLD_DIR;
+
+    return flags;
+}
+
+static uint8_t diff_inodes(const inode_t* old_inode, const inode_t* new_inode)
+{
+    if (memcmp(old_inode, new_inode, sizeof(inode_t)) == 0)
+        return 0;
+
+    uint8_t flags = DIFF_CHANGED;
+    if ((__le16_to_cpu(old_inode->i_mode) & EXT2_S_IFMT) !=
+        (__le16_to_cpu(new_inode->i_mode) & EXT2_S_IFMT) ||
+        old_inode->i_generation != new_inode->i_generation)
+        flags |= DIFF_REPLACED;
+
+    if (old_inode->i_mtime != new_inode->i_mtime ||
+        old_inode->i_size != new_inode->i_size ||
+        old_inode->i_dir_acl != new_inode->i_dir_acl ||
+        memcmp(old_inode->i_block, new_inode->i_block,
+               sizeof(old_inode->i_block)) != 0)
+        flags |= DIFF_DATA;
+
+    return flags;
+}
+
+static int diff_inode_tables(diff_ctx_t* diff)
+{
+    assert(diff != NULL);
+
+    ext2_fs_t* old_fs = diff->old_fs;
+    ext2_fs_t* new_fs = diff->new_fs;
+
+    group_desc_t* old_descs = NULL;
+    group_desc_t* new_descs = NULL;
+    size_t num_groups = 0;
+
+    int ret = read_group_descs(old_fs, &old_descs, &num_groups);
+    if (ret != E_SUCCESS)
+        return ret;
+    ret = read_group_descs(new_fs, &new_descs, &num_groups);
+    if (ret != E_SUCCESS)
+    {
+        free(old_descs);
+        return ret;
+    }
+
+    size_t block_size = new_fs->block_size;
+    size_t inodes_per_block = block_size / new_fs->inode_size;
+    size_t chunk_inodes = inodes_per_block * INODE_TABLE_READ_BLOCKS;
+
+    errno = 0;
+    uint8_t* old_bitmap = (uint8_t*) malloc(block_size);
+    uint8_t* new_bitmap = (uint8_t*) malloc(block_size);
+    if (old_bitmap == NULL || new_bitmap == NULL)
+    {
+        perror("[diff_inode_tables] Allocation of bitmaps failed\n");
+        ret = E_BADALLOC;
+    }
+
+    for (size_t group = 0; group < num_groups && ret == E_SUCCESS; group++)
+    {
+        group_desc_t* old_desc = &old_descs[group];
+        group_desc_t* new_desc = &new_descs[group];
+
+        if (old_desc->bg_inode_table != new_desc->bg_inode_table)
+        {
+            fprintf(stderr, "[diff_inode_tables] Inode table of group %lu "
+                            "moved, images have different layout\n", group);
+            ret = E_ERROR;
+            break;
+        }
+
+        // slots past an image's initialized part count as unused there
+        size_t old_init = group_inodes_used(old_fs, old_desc);
+        size_t new_init = group_inodes_used(new_fs, new_desc);
+        size_t num_init = (old_init > new_init) ? old_init : new_init;
+        if (num_init == 0)
+            continue;
+
+        memset(old_bitmap, 0, block_size);
+        memset(new_bitmap, 0, block_size);
+        if ((old_init != 0 &&
+             read_block(__le32_to_cpu(old_desc->bg_inode_bitmap), old_fs,
+                        old_bitmap) < 0) ||
+            (new_init != 0 &&
+             read_block(__le32_to_cpu(new_desc->bg_inode_bitmap), new_fs,
+                        new_bitmap) < 0))
+        {
+            fprintf(stderr, "[diff_inode_tables] Reading bitmaps of group %lu "
+                            "failed\n", group);
+            ret = E_BADIO;
+            break;
+        }
+
+        size_t table_block = __le32_to_cpu(new_desc->bg_inode_table);
+        for (size_t i = old_init; i < num_init; i++)
+            old_bitmap[i / 8] &= ~(1 << (i % 8));
+        for (size_t i = new_init; i < num_init; i++)
+            new_bitmap[i / 8] &= ~(1 << (i % 8));
+
+        for (size_t first = 0; first < num_init && ret == E_SUCCESS;
+             first += chunk_inodes)
+        {
+            size_t last = first + chunk_inodes;
+            if (last > num_init)
+                last = num_init;
+
+            size_t used = 0;
+            for (size_t i = first; i < last && used == 0; i++)
+                used = (old_bitmap[i / 8] | new_bitmap[i / 8]) & (1 << (i % 8));
+            if (used == 0)
+                continue;
+
+            size_t chunk_blocks = (last - first + inodes_per_block - 1) /
+                                  inodes_per_block;
+            size_t chunk_size = chunk_blocks * block_size;
+            off_t  offset = (table_block + first / inodes_per_block) * block_size;
+
+            errno = 0;
+            if (pread(old_fs->dev_fd, diff->old_buff, chunk_size, offset) !=
+                    (ssize_t)chunk_size ||
+                pread(new_fs->dev_fd, diff->new_buff, chunk_size, offset) !=
+                    (ssize_t)chunk_size)
+            {
+                perror("[diff_inode_tables] Reading inode tables failed\n");
+                ret = E_BADIO;
+                break;
+            }
+
+            for (size_t blk = 0; blk < chunk_blocks; blk++)
+            {
+                size_t blk_off = blk * block_size;
+                int same_block = memcmp(diff->old_buff + blk_off,
+                                        diff->new_buff + blk_off,
+                                        block_size) == 0;
+
+                for (size_t slot = 0; slot < inodes_per_block; slot++)
+                {
+                    size_t i = first + blk * inodes_per_block + slot;
+                    size_t ino = group * new_fs->inodes_per_group + i + 1;
+                    if (i >= last || ino > new_fs->num_inodes)
+                        break;
+
+                    int old_used = old_bitmap[i / 8] & (1 << (i % 8));
+                    int new_used = new_bitmap[i / 8] & (1 << (i % 8));
+
+                    inode_t old_inode, new_inode;
+                    memcpy(&old_inode, diff->old_buff + blk_off +
+                           slot * new_fs->inode_size, sizeof(inode_t));
+                    memcpy(&new_inode, diff->new_buff + blk_off +
+                           slot * new_fs->inode_size, sizeof(inode_t));
+
+                    uint8_t flags = 0;
+                    if (old_used)
+                        flags |= diff_slot_flags(&old_inode, 0);
+                    if (new_used)
+                        flags |= diff_slot_flags(&new_inode, 1);
+
+                    if (old_used && new_used && !same_block)
+                        flags |= diff_inodes(&old_inode, &new_inode);
+                    else if (old_used != new_used)
+                        flags |= DIFF_CHANGED | DIFF_DATA | DIFF_REPLACED;
+
+                    diff->flags[ino] = flags;
+                }
+            }
+        }
+    }
+
+    free(old_bitmap);
+    free(new_bitmap);
+    free(old_descs);
+    free(new_descs);
+    return ret;
+}
+
+static int list_dir(ext2_fs_t* fs, uint32_t ino, dir_list_t* list)
+{
+    assert(fs != NULL);
+    assert(list != NULL);
+
+    memset(list, 0, sizeof(*list));
+
+    inode_t inode;
+    int ret = get_ext2_inode(fs, ino, &inode);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    ret = iterate_dir(fs, &inode, collect_dir_entry, list);
+    if (ret != E_SUCCESS)
+    {
+        free(list->entries);
+        free(list->names);
+        memset(list, 0, sizeof(*list));
+    }
+
+    return ret;
+}
+
+static const char* sort_names = NULL;
+
+static int cmp_dir_entries(const void* lhs, const void* rhs)
+{
+    const dir_list_entry_t* left  = (const dir_list_entry_t*) lhs;
+    const dir_list_entry_t* right = (const dir_list_entry_t*) rhs;
+
+    return strcmp(sort_names + left->name_off, sort_names + right->name_off);
+}
+
+static void sort_dir_list(dir_list_t* list)
+{
+    assert(list != NULL);
+
+    sort_names = list->names;
+    qsort(list->entries, list->num, sizeof(dir_list_entry_t), cmp_dir_entries);
+    sort_names = NULL;
+}
+
+static size_t diff_push_path(diff_ctx_t* diff, size_t path_len, const char* name,
+                             size_t name_len)
+{
+    assert(diff != NULL);
+
+    if (path_len + 1 + name_len + 1 > EXT2_PATH_MAX)
+        return 0;
+
+    diff->path[path_len] = '/';
+    memcpy(diff->path + path_len + 1, name, name_len);
+    diff->path[path_len + 1 + name_len] = '\0';
+
+    return path_len + 1 + name_len;
+}
+
+// reports path and everything below it as added ('A') or removed ('D')
+static int diff_report_subtree(diff_ctx_t* diff, char tag, uint32_t ino,
+                               size_t path_len)
+{
+    assert(diff != NULL);
+
+    ext2_fs_t* fs  = (tag == 'A') ? diff->new_fs : diff->old_fs;
+    uint8_t is_dir = (tag == 'A') ? DIFF_NEW_DIR : DIFF_OLD_DIR;
+
+    printf("%c %s\n", tag, diff->path);
+    if (tag == 'A')
+        diff->num_added++;
+    else
+    {
+        diff->num_removed++;
+        if ((diff->flags[ino] & DIFF_REPORTED) == 0 &&
+            (diff->flags[ino] & (DIFF_OLD_USED | DIFF_NEW_USED)) == DIFF_OLD_USED)
+            diff->num_freed--;
+        diff->flags[ino] |= DIFF_REPORTED;
+    }
+
+    if ((diff->flags[ino] & is_dir) == 0)
+        return E_SUCCESS;
+
+    dir_list_t list;
+    int ret = list_dir(fs, ino, &list);
+    for (size_t i = 0; i < list.num && ret == E_SUCCESS; i++)
+    {
+        dir_list_entry_t* entry = &list.entries[i];
+        size_t child_len = diff_push_path(diff, path_len,
+                                          list.names + entry->name_off,
+                                          entry->name_len);
+        if (child_len == 0)
+            continue;
+
+        ret = diff_report_subtree(diff, tag, entry->ino, child_len);
+        diff->path[path_len] = '\0';
+    }
+
+    free(list.entries);
+    free(list.names);
+    return ret;
+}
+
+static int diff_file_data(diff_ctx_t* diff, uint32_t ino, int* differ)
+{
+    assert(diff != NULL);
+    assert(differ != NULL);
+
+    inode_t old_inode, new_inode;
+    int ret = get_ext2_inode(diff->old_fs, ino, &old_inode);
+    if (ret == E_SUCCESS)
+        ret = get_ext2_inode(diff->new_fs, ino, &new_inode);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    *differ = 1;
+    if (old_inode.i_size != new_inode.i_size ||
+        old_inode.i_dir_acl != new_inode.i_dir_acl)
+        return E_SUCCESS;
+
+    file_stream_t old_stream, new_stream;
+    ret = file_stream_open(diff->old_fs, &old_inode, &old_stream);
+    if (ret != E_SUCCESS)
+        return ret;
+    ret = file_stream_open(diff->new_fs, &new_inode, &new_stream);
+    if (ret != E_SUCCESS)
+    {
+        file_stream_close(&old_stream);
+        return ret;
+    }
+
+    diff->num_compared++;
+    *differ = 0;
+    while (ret == E_SUCCESS && *differ == 0)
+    {
+        ssize_t old_read = file_stream_read(&old_stream, diff->old_buff,
+                                            DIFF_READ_SIZE);
+        ssize_t new_read = file_stream_read(&new_stream, diff->new_buff,
+                                            DIFF_READ_SIZE);
+        if (old_read < 0 || new_read < 0)
+            ret = E_BADIO;
+        else if (old_read != new_read)
+            *differ = 1;
+        else if (old_read == 0)
+            break;
+        else
+            *differ = memcmp(diff->old_buff, diff->new_buff, old_read) != 0;
+    }
+
+    file_stream_close(&old_stream);
+    file_stream_close(&new_stream);
+    return ret;
+}
+
+static int diff_dir(diff_ctx_t* diff, uint32_t ino, size_t path_len);
+
+// ino is bound to the same name in both images
+static int diff_same_entry(diff_ctx_t* diff, uint32_t ino, size_t path_len)
+{
+    assert(diff != NULL);
+
+    uint8_t flags = diff->flags[ino];
+    if (flags & DIFF_REPLACED)
+    {
+        int ret = diff_report_subtree(diff, 'D', ino, path_len);
+        if (ret == E_SUCCESS)
+            ret = diff_report_subtree(diff, 'A', ino, path_len);
+        return ret;
+    }
+
+    if ((flags & DIFF_OLD_DIR) && (flags & DIFF_NEW_DIR))
+        return diff_dir(diff, ino, path_len);
+
+    if ((flags & DIFF_DATA) == 0)
+        return E_SUCCESS;
+
+    int differ = 1;
+    int ret = diff_file_data(diff, ino, &differ);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    if (differ)
+    {
+        printf("M %s\n", diff->path);
+        diff->num_modified++;
+    }
+
+    return E_SUCCESS;
+}
+
+static int diff_dir(diff_ctx_t* diff, uint32_t ino, size_t path_len)
+{
+    assert(diff != NULL);
+
+    dir_list_t new_list;
+    int ret = list_dir(diff->new_fs, ino, &new_list);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    // unchanged directory has the same entries in both images, unless the
+    // image was edited by a tool which does not update directory times
+    int dir_changed = (diff->flags[ino] & DIFF_CHANGED) != 0;
+    for (size_t i = 0; i < new_list.num && !dir_changed; i++)
+        dir_changed = (diff->flags[new_list.entries[i].ino] & DIFF_REPLACED) != 0;
+
+    if (!dir_changed)
+    {
+        for (size_t i = 0; i < new_list.num && ret == E_SUCCESS; i++)
+        {
+            dir_list_entry_t* entry = &new_list.entries[i];
+            if ((diff->flags[entry->ino] & (DIFF_CHANGED | DIFF_NEW_DIR)) == 0)
+                continue;
+
+            size_t child_len = diff_push_path(diff, path_len,
+                                              new_list.names + entry->name_off,
+                                              entry->name_len);
+            if (child_len == 0)
+                continue;
+
+            ret = diff_same_entry(diff, entry->ino, child_len);
+            diff->path[path_len] = '\0';
+        }
+
+        free(new_list.entries);
+        free(new_list.names);
+        return ret;
+    }
+
+    dir_list_t old_list;
+    ret = list_dir(diff->old_fs, ino, &old_list);
+    if (ret != E_SUCCESS)
+    {
+        free(new_list.entries);
+        free(new_list.names);
+        return ret;
+    }
+
+    sort_dir_list(&old_list);
+    sort_dir_list(&new_list);
+
+    size_t old_pos = 0;
+    size_t new_pos = 0;
+    while (ret == E_SUCCESS &&
+           (old_pos < old_list.num || new_pos < new_list.num))
+    {
+        dir_list_entry_t* old_entry = (old_pos < old_list.num) ?
+                                      &old_list.entries[old_pos] : NULL;
+        dir_list_entry_t* new_entry = (new_pos < new_list.num) ?
+                                      &new_list.entries[new_pos] : NULL;
+
+        int cmp = 0;
+        if (old_entry == NULL)
+            cmp = 1;
+        else if (new_entry == NULL)
+            cmp = -1;
+        else
+            cmp = strcmp(old_list.names + old_entry->name_off,
+                         new_list.names + new_entry->name_off);
+
+        dir_list_entry_t* named = (cmp <= 0) ? old_entry : new_entry;
+        const char* name = (cmp <= 0) ? old_list.names + old_entry->name_off :
+                                        new_list.names + new_entry->name_off;
+
+        size_t child_len = diff_push_path(diff, path_len, name, named->name_len);
+        if (child_len != 0)
+        {
+            if (cmp < 0)
+                ret = diff_report_subtree(diff, 'D', old_entry->ino, child_len);
+            else if (cmp > 0)
+                ret = diff_report_subtree(diff, 'A', new_entry->ino, child_len);
+            else if (old_entry->ino != new_entry->ino)
+            {
+                ret = diff_report_subtree(diff, 'D', old_entry->ino, child_len);
+                if (ret == E_SUCCESS)
+                    ret = diff_report_subtree(diff, 'A', new_entry->ino,
+                                              child_len);
+            }
+            else
+                ret = diff_same_entry(diff, new_entry->ino, child_len);
+
+            diff->path[path_len] = '\0';
+        }
+
+        if (cmp <= 0)
+            old_pos++;
+        if (cmp >= 0)
+            new_pos++;
+    }
+
+    free(old_list.entries);
+    free(old_list.names);
+    free(new_list.entries);
+    free(new_list.names);
+    return ret;
+}
+
+static int diff_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc != 1)
+    {
+        fprintf(stderr, "[diff_mode] Try ./read_ext2 old_device diff "
+                        "new_device\n");
+        return E_BADARGS;
+    }
+
+    ext2_fs_t new_fs;
+    int ret = ext2_open(argv[0], &new_fs);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    if (memcmp(fs->sb->s_uuid, new_fs.sb->s_uuid, 16) != 0 ||
+        fs->block_size != new_fs.block_size ||
+        fs->inode_size != new_fs.inode_size ||
+        fs->num_inodes != new_fs.num_inodes ||
+        fs->inodes_per_group != new_fs.inodes_per_group ||
+        fs->blocks_per_group != new_fs.blocks_per_group ||
+        fs->num_groups != new_fs.num_groups)
+    {
+        fprintf(stderr, "[diff_mode] Images are not snapshots "
+                        "of the same file system\n");
+        ext2_close(&new_fs);
+        return E_BADARGS;
+    }
+
+    diff_ctx_t diff = {.old_fs = fs, .new_fs = &new_fs};
+
+    size_t buff_size = INODE_TABLE_READ_BLOCKS * fs->block_size;
+    if (buff_size < DIFF_READ_SIZE)
+        buff_size = DIFF_READ_SIZE;
+
+    errno = 0;
+    diff.flags    = (uint8_t*) calloc(fs->num_inodes + 1, 1);
+    diff.path     = (char*) calloc(EXT2_PATH_MAX, 1);
+    diff.old_buff = (uint8_t*) malloc(buff_size);
+    diff.new_buff = (uint8_t*) malloc(buff_size);
+    if (diff.flags == NULL || diff.path == NULL || diff.old_buff == NULL ||
+        diff.new_buff == NULL)
+    {
+        perror("[diff_mode] Allocation failed\n");
+        ret = E_BADALLOC;
+    }
+
+    if (ret == E_SUCCESS)
+        ret = diff_inode_tables(&diff);
+
+    size_t num_changed = 0;
+    for (size_t ino = 1; ino <= fs->num_inodes && ret == E_SUCCESS; ino++)
+    {
+        if (diff.flags[ino] & DIFF_CHANGED)
+            num_changed++;
+        if ((diff.flags[ino] & (DIFF_OLD_USED | DIFF_NEW_USED)) == DIFF_OLD_USED)
+            diff.num_freed++;
+    }
+
+    if (ret == E_SUCCESS && num_changed > 0)
+        ret = diff_dir(&diff, EXT2_ROOT_INO, 0);
+    fflush(stdout);
+
+    if (ret == E_SUCCESS && diff.num_freed > 0)
+        fprintf(stderr, "[diff_mode] %lu freed inodes were not found in "
+                        "changed directories, directory times were not "
+                        "updated in the new image\n", diff.num_freed);
+
+    if (ret == E_SUCCESS)
+        fprintf(stderr, "changed inodes %lu added %lu removed %lu modified %lu "
+                        "compared files %lu\n", num_changed, diff.num_added,
+                        diff.num_removed, diff.num_modified, diff.num_compared);
+
+    free(diff.flags);
+    free(diff.path);
+    free(diff.old_buff);
+    free(diff.new_buff);
+    ext2_stats_merge(&fs->stats, &new_fs.stats);
+    ext2_close(&new_fs);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// double-buffered output
+// The producer fills one buffer while a writer thread drains the other one.
+////////////////////////////////////////////////////////////////////////////////
+#define OUT_BUFF_SIZE (1024 * 1024)
+
+typedef struct out_buff
+{
+    uint8_t* data;
+    size_t   used;
+} out_buff_t;
+
+typedef struct out_stream
+{
+    int        fd;
+    int        error;
+    uint64_t   total;
+    out_buff_t buffs[2];
+    out_buff_t* cur;
+    bqueue_t   free_q;
+    bqueue_t   full_q;
+    pthread_t  writer;
+} out_stream_t;
+
+static void* out_writer_thread(void* arg)
+{
+    out_stream_t* out = (out_stream_t*) arg;
+
+    out_buff_t* buff = NULL;
+    while ((buff = (out_buff_t*) bqueue_pop(&out->full_q)) != NULL)
+    {
+        if (out->error == E_SUCCESS &&
+            write_full(out->fd, buff->data, buff->used) != E_SUCCESS)
+        {
+            perror("[out_writer_thread] Writing output failed\n");
+            out->error = E_BADIO;
+        }
+
+        buff->used = 0;
+        bqueue_push(&out->free_q, buff);
+    }
+
+    return NULL;
+}
+
+static int out_open(out_stream_t* out, int fd)
+{
+    assert(out != NULL);
+
+    memset(out, 0, sizeof(*out));
+    out->fd = fd;
+
+    errno = 0;
+    out->buffs[0].data = (uint8_t*) malloc(OUT_BUFF_SIZE);
+    out->buffs[1].data = (uint8_t*) malloc(OUT_BUFF_SIZE);
+    if (out->buffs[0].data == NULL || out->buffs[1].data == NULL)
+    {
+        perror("[out_open] Allocation of buffers failed\n");
+        free(out->buffs[0].data);
+        free(out->buffs[1].data);
+        return E_BADALLOC;
+    }
+
+    if (bqueue_init(&out->free_q, 2) != E_SUCCESS ||
+        bqueue_init(&out->full_q, 3) != E_SUCCESS)
+    {
+        free(out->buffs[0].data);
+        free(out->buffs[1].data);
+        return E_BADALLOC;
+    }
+
+    out->cur = &out->buffs[0];
+    bqueue_push(&out->free_q, &out->buffs[1]);
+    pthread_create(&out->writer, NULL, out_writer_thread, out);
+
+    return E_SUCCESS;
+}
+
+// returns free space of the current buffer, switches buffers when it is full
+static size_t out_reserve(out_stream_t* out, uint8_t** ptr)
+{
+    assert(out != NULL);
+    assert(ptr != NULL);
+
+    if (out->cur->used == OUT_BUFF_SIZE)
+    {
+        bqueue_push(&out->full_q, out->cur);
+        out->cur = (out_buff_t*) bqueue_pop(&out->free_q);
+    }
+
+    *ptr = out->cur->data + out->cur->used;
+    return OUT_BUFF_SIZE - out->cur->used;
+}
+
+static void out_commit(out_stream_t* out, size_t size)
+{
+    assert(out != NULL);
+    assert(out->cur->used + size <= OUT_BUFF_SIZE);
+
+    out->cur->used += size;
+    out->total     += size;
+}
+
+static void out_write(out_stream_t* out, const void* data, size_t size)
+{
+    assert(out != NULL);
+
+    const uint8_t* pos = (const uint8_t*) data;
+    while (size > 0)
+    {
+        uint8_t* dest = NULL;
+        size_t part = out_reserve(out, &dest);
+        if (part > size)
+            part = size;
+
+        if (pos != NULL)
+        {
+            memcpy(dest, pos, part);
+            pos += part;
+        }
+        else
+            memset(dest, 0, part);
+
+        out_commit(out, part);
+        size -= part;
+    }
+}
+
+static int out_close(out_stream_t* out)
+{
+    assert(out != NULL);
+
+    if (out->cur->used > 0)
+        bqueue_push(&out->full_q, out->cur);
+    bqueue_push(&out->full_q, NULL);
+    pthread_join(out->writer, NULL);
+
+    bqueue_destroy(&out->free_q);
+    bqueue_destroy(&out->full_q);
+    free(out->buffs[0].data);
+    free(out->buffs[1].data);
+
+    return out->error;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// tar mode
+// Writes a POSIX ustar archive, names and values which do not fit into the
+// ustar header go to pax extended headers. Files of every directory are
+// archived in the order of their first physical block.
+////////////////////////////////////////////////////////////////////////////////
+#define TAR_BLOCK_SIZE   512
+#define TAR_RECORD_SIZE  (20 * TAR_BLOCK_SIZE)
+#define TAR_MAX_OCTAL_11 077777777777ULL
+#define TAR_MAX_OCTAL_7  07777777ULL
+
+
+typedef struct tar_header
+{
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header_t;
+
+typedef struct tar_link
+{
+    uint32_t ino;
+    char*    path;
+} tar_link_t;
+
+typedef struct tar_ctx
+{
+    ext2_fs_t*   fs;
+    out_stream_t out;
+    char*        path;
+    tar_link_t*  links;      // open addressing by inode, for hard links
+    size_t       links_size; // power of two
+    size_t       num_links;
+    uint64_t     num_files;
+} tar_ctx_t;
+
+typedef struct tar_entry
+{
+    uint32_t ino;
+    uint32_t first_block;
+    uint32_t name_off;
+    uint16_t name_len;
+    inode_t  inode;
+} tar_entry_t;
+
+static void tar_octal(char* field, size_t field_size, uint64_t value)
+{
+    char digits[32];
+    snprintf(digits, sizeof(digits), "%0*llo", (int)field_size - 1,
+             (unsigned long long)value);
+    memcpy(field, digits, field_size);
+}
+
+static void pax_record(char* buff, size_t* pos, size_t buff_size,
+                       const char* key, const char* value)
+{
+    size_t payload = strlen(key) + strlen(value) + 3; // ' ', '=', '\n'
+    size_t len = payload + 1;
+    char digits[32];
+    while ((size_t)snprintf(digits, sizeof(digits), "%lu", len) + payload != len)
+        len = snprintf(digits, sizeof(digits), "%lu", len) + payload;
+
+    if (*pos + len < buff_size)
+        *pos += snprintf(buff + *pos, buff_size - *pos, "%lu %s=%s\n",
+                         len, key, value);
+}
+
+static void tar_finish_header(tar_header_t* hdr)
+{
+    memcpy(hdr->magic, "ustar", 6);
+    memcpy(hdr->version, "00", 2);
+    memset(hdr->chksum, ' ', sizeof(hdr->chksum));
+
+    unsigned int sum = 0;
+    for (size_t i = 0; i < sizeof(tar_header_t); i++)
+        sum += ((uint8_t*)hdr)[i];
+
+    snprintf(hdr->chksum, sizeof(hdr->chksum), "%06o", sum);
+    hdr->chksum[7] = ' ';
+}
+
+// splits name into prefix and name fields, returns 0 if it does not fit
+static int tar_split_name(tar_header_t* hdr, const char* name)
+{
+    size_t len = strlen(name);
+    if (len <= sizeof(hdr->name))
+    {
+        memcpy(hdr->name, name, len);
+        return 1;
+    }
+
+    for (size_t sep = len - 1; sep > 0; sep--)
+    {
+        if (name[sep] != '/')
+            continue;
+
+        if (len - sep - 1 > sizeof(hdr->name) || len - sep - 1 == 0)
+            return 0;
+        if (sep > sizeof(hdr->prefix))
+            continue;
+
+        memcpy(hdr->prefix, name, sep);
+        memcpy(hdr->name, name + sep + 1, len - sep - 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int tar_put_header(tar_ctx_t* tar, const char* name, inode_t* inode,
+                          char type, uint64_t size, const char* link)
+{
+    assert(tar != NULL);
+    assert(name != NULL);
+    assert(inode != NULL);
+
+    tar_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+
+    uint64_t uid = __le16_to_cpu(inode->i_uid) |
+        ((uint32_t)__le16_to_cpu(inode->osd2.linux2.l_i_uid_high) << 16);
+    uint64_t gid = __le16_to_cpu(inode->i_gid) |
+        ((uint32_t)__le16_to_cpu(inode->osd2.linux2.l_i_gid_high) << 16);
+
+    char pax[3 * EXT2_PATH_MAX];
+    size_t pax_size = 0;
+    char value[32];
+
+    if (!tar_split_name(&hdr, name))
+    {
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.name, name, sizeof(hdr.name));
+        pax_record(pax, &pax_size, sizeof(pax), "path", name);
+    }
+    if (link != NULL)
+    {
+        size_t link_len = strlen(link);
+        if (link_len > sizeof(hdr.linkname))
+        {
+            pax_record(pax, &pax_size, sizeof(pax), "linkpath", link);
+            link_len = sizeof(hdr.linkname);
+        }
+        memcpy(hdr.linkname, link, link_len);
+    }
+    if (size > TAR_MAX_OCTAL_11)
+    {
+        snprintf(value, sizeof(value), "%lu", size);
+        pax_record(pax, &pax_size, sizeof(pax), "size", value);
+    }
+    if (uid > TAR_MAX_OCTAL_7)
+    {
+        snprintf(value, sizeof(value), "%lu", uid);
+        pax_record(pax, &pax_size, sizeof(pax), "uid", value);
+    }
+    if (gid > TAR_MAX_OCTAL_7)
+    {
+        snprintf(value, sizeof(value), "%lu", gid);
+        pax_record(pax, &pax_size, sizeof(pax), "gid", value);
+    }
+
+    if (pax_size > 0)
+    {
+        tar_header_t pax_hdr;
+        memset(&pax_hdr, 0, sizeof(pax_hdr));
+        memcpy(pax_hdr.name, "././@PaxHeader", sizeof("././@PaxHeader"));
+        tar_octal(pax_hdr.mode, sizeof(pax_hdr.mode), 0644);
+        tar_octal(pax_hdr.uid, sizeof(pax_hdr.uid), 0);
+        tar_octal(pax_hdr.gid, sizeof(pax_hdr.gid), 0);
+        tar_octal(pax_hdr.size, sizeof(pax_hdr.size), pax_size);
+        tar_octal(pax_hdr.mtime, sizeof(pax_hdr.mtime),
+                  __le32_to_cpu(inode->i_mtime));
+        pax_hdr.typeflag = 'x';
+        tar_finish_header(&pax_hdr);
+
+        out_write(&tar->out, &pax_hdr, sizeof(pax_hdr));
+        out_write(&tar->out, pax, pax_size);
+        out_write(&tar->out, NULL, (TAR_BLOCK_SIZE - pax_size % TAR_BLOCK_SIZE) %
+                                   TAR_BLOCK_SIZE);
+    }
+
+    tar_octal(hdr.mode, sizeof(hdr.mode), __le16_to_cpu(inode->i_mode) & 07777);
+    tar_octal(hdr.uid, sizeof(hdr.uid), uid & TAR_MAX_OCTAL_7);
+    tar_octal(hdr.gid, sizeof(hdr.gid), gid & TAR_MAX_OCTAL_7);
+    tar_octal(hdr.size, sizeof(hdr.size),
+              (size > TAR_MAX_OCTAL_11) ? 0 : size);
+    tar_octal(hdr.mtime, sizeof(hdr.mtime), __le32_to_cpu(inode->i_mtime));
+    hdr.typeflag = type;
+
+    if (type == '3' || type == '4')
+    {
+        // old 16 bit encoding in i_block[0], new one in i_block[1]
+        uint32_t dev = __le32_to_cpu(inode->i_block[0]);
+        uint32_t major = (dev >> 8) & 0xFF;
+        uint32_t minor = dev & 0xFF;
+        if (dev == 0)
+        {
+            dev   = __le32_to_cpu(inode->i_block[1]);
+            major = (dev & 0xFFF00) >> 8;
+            minor = (dev & 0xFF) | ((dev >> 12) & 0xFFF00);
+        }
+        tar_octal(hdr.devmajor, sizeof(hdr.devmajor), major);
+        tar_octal(hdr.devminor, sizeof(hdr.devminor), minor);
+    }
+
+    tar_finish_header(&hdr);
+    out_write(&tar->out, &hdr, sizeof(hdr));
+
+    return E_SUCCESS;
+}
+
+static tar_link_t* tar_find_link(tar_ctx_t* tar, uint32_t ino)
+{
+    assert(tar != NULL);
+
+    size_t mask = tar->links_size - 1;
+    size_t slot = (ino * 2654435761u) & mask;
+    while (tar->links[slot].ino != 0 && tar->links[slot].ino != ino)
+        slot = (slot + 1) & mask;
+
+    return &tar->links[slot];
+}
+
+static int tar_add_link(tar_ctx_t* tar, uint32_t ino, const char* path)
+{
+    assert(tar != NULL);
+
+    if (2 * (tar->num_links + 1) > tar->links_size)
+    {
+        size_t new_size = (tar->links_size == 0) ? 64 : 2 * tar->links_size;
+        tar_link_t* old_links = tar->links;
+        size_t old_size = tar->links_size;
+
+        errno = 0;
+        tar->links = (tar_link_t*) calloc(new_size, sizeof(tar_link_t));
+        if (tar->links == NULL)
+        {
+            perror("[tar_add_link] Allocation of link table failed\n");
+            tar->links = old_links;
+            return E_BADALLOC;
+        }
+        tar->links_size = new_size;
+
+        for (size_t i = 0; i < old_size; i++)
+            if (old_links[i].ino != 0)
+                *tar_find_link(tar, old_links[i].ino) = old_links[i];
+        free(old_links);
+    }
+
+    tar_link_t* link = tar_find_link(tar, ino);
+    link->path = strdup(path);
+    if (link->path == NULL)
+    {
+        perror("[tar_add_link] Copying path failed\n");
+        return E_BADALLOC;
+    }
+    link->ino = ino;
+    tar->num_links++;
+
+    return E_SUCCESS;
+}
+
+static int tar_put_file_data(tar_ctx_t* tar, inode_t* inode, uint64_t size)
+{
+    assert(tar != NULL);
+    assert(inode != NULL);
+
+    file_stream_t stream;
+    int ret = file_stream_open(tar->fs, inode, &stream);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    // file data is read straight into the output buffer
+    uint64_t done = 0;
+    while (done < size)
+    {
+        uint8_t* dest = NULL;
+        size_t part = out_reserve(&tar->out, &dest);
+        if (part > size - done)
+            part = size - done;
+
+        ssize_t read = file_stream_read(&stream, dest, part);
+        if (read <= 0)
+        {
+            fprintf(stderr, "[tar_put_file_data] Reading file data failed\n");
+            file_stream_close(&stream);
+            return E_BADIO;
+        }
+
+        out_commit(&tar->out, read);
+        done += read;
+    }
+
+    file_stream_close(&stream);
+    out_write(&tar->out, NULL, (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) %
+                               TAR_BLOCK_SIZE);
+    return E_SUCCESS;
+}
+
+static int tar_put_entry(tar_ctx_t* tar, uint32_t ino, inode_t* inode)
+{
+    assert(tar != NULL);
+    assert(inode != NULL);
+
+    uint16_t mode = __le16_to_cpu(inode->i_mode);
+    uint64_t size = get_inode_size(inode);
+    tar->num_files++;
+
+    switch (mode & EXT2_S_IFMT)
+    {
+        case EXT2_S_IFDIR:
+        {
+            size_t len = strlen(tar->path);
+            tar->path[len]     = '/';
+            tar->path[len + 1] = '\0';
+            int ret = tar_put_header(tar, tar->path, inode, '5', 0, NULL);
+            tar->path[len] = '\0';
+            return ret;
+        }
+
+        case EXT2_S_IFREG:
+        {
+            if (__le16_to_cpu(inode->i_links_count) > 1)
+            {
+                tar_link_t* link = (tar->links_size > 0) ?
+                                   tar_find_link(tar, ino) : NULL;
+                if (link != NULL && link->ino == ino)
+                    return tar_put_header(tar, tar->path, inode, '1', 0,
+                                          link->path);
+
+                int ret = tar_add_link(tar, ino, tar->path);
+                if (ret != E_SUCCESS)
+                    return ret;
+            }
+
+            int ret = tar_put_header(tar, tar->path, inode, '0', size, NULL);
+            if (ret == E_SUCCESS)
+                ret = tar_put_file_data(tar, inode, size);
+            return ret;
+        }
+
+        case EXT2_S_IFLNK:
+        {
+            char target[EXT2_PATH_MAX];
+            if (size >= EXT2_PATH_MAX)
+                return E_ERROR;
+
+            if (!inode_maps_blocks(inode))
+                memcpy(target, inode->i_block, size);
+            else
+            {
+                file_stream_t stream;
+                int ret = file_stream_open(tar->fs, inode, &stream);
+                if (ret != E_SUCCESS)
+                    return ret;
+
+                ssize_t read = file_stream_read(&stream, (uint8_t*)target, size);
+                file_stream_close(&stream);
+                if (read != (ssize_t)size)
+                    return E_BADIO;
+            }
+            target[size] = '\0';
+
+            return tar_put_header(tar, tar->path, inode, '2', 0, target);
+        }
+
+        case EXT2_S_IFCHR:
+            return tar_put_header(tar, tar->path, inode, '3', 0, NULL);
+
+        case EXT2_S_IFBLK:
+            return tar_put_header(tar, tar->path, inode, '4', 0, NULL);
+
+        case EXT2_S_IFIFO:
+            return tar_put_header(tar, tar->path, inode, '6', 0, NULL);
+    }
+
+    fprintf(stderr, "[tar_put_entry] Skipping %s with mode %.4X\n",
+                    tar->path, mode);
+    tar->num_files--;
+    return E_SUCCESS;
+}
+
+static int cmp_tar_entries(const void* lhs, const void* rhs)
+{
+    const tar_entry_t* left  = (const tar_entry_t*) lhs;
+    const tar_entry_t* right = (const tar_entry_t*) rhs;
+
+    if (left->first_block != right->first_block)
+        return (left->first_block < right->first_block) ? -1 : 1;
+
+    return (left->ino < right->ino) ? -1 : (left->ino > right->ino);
+}
+
+// disk position of the start of the data, good enough to order reads
+static uint32_t inode_first_block(const inode_t* inode)
+{
+    assert(inode != NULL);
+
+    if ((__le32_to_cpu(inode->i_flags) & EXT4_EXTENTS_FL) == 0)
+        return __le32_to_cpu(inode->i_block[0]);
+
+    const struct ext4_extent_header* hdr =
+        (const struct ext4_extent_header*) inode->i_block;
+    if (__le16_to_cpu(hdr->eh_entries) == 0)
+        return 0;
+
+    // first leaf extent or first index entry right after the header
+    if (__le16_to_cpu(hdr->eh_depth) == 0)
+        return __le32_to_cpu(((const struct ext4_extent*)(hdr + 1))->ee_start_lo);
+
+    return __le32_to_cpu(((const struct ext4_extent_idx*)(hdr + 1))->ei_leaf_lo);
+}
+
+static int tar_dir(tar_ctx_t* tar, uint32_t ino, size_t path_len)
+{
+    assert(tar != NULL);
+
+    dir_list_t list;
+    int ret = list_dir(tar->fs, ino, &list);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    errno = 0;
+    tar_entry_t* entries = (tar_entry_t*) malloc((list.num + 1) *
+                                                 sizeof(tar_entry_t));
+    if (entries == NULL)
+    {
+        perror("[tar_dir] Allocation of entries failed\n");
+        free(list.entries);
+        free(list.names);
+        return E_BADALLOC;
+    }
+
+    for (size_t i = 0; i < list.num && ret == E_SUCCESS; i++)
+    {
+        tar_entry_t* entry = &entries[i];
+        entry->ino      = list.entries[i].ino;
+        entry->name_off = list.entries[i].name_off;
+        entry->name_len = list.entries[i].name_len;
+        ret = get_ext2_inode(tar->fs, entry->ino, &entry->inode);
+
+        // subdirectories go after the files of this directory
+        uint16_t mode = __le16_to_cpu(entry->inode.i_mode);
+        entry->first_block = EXT2_S_ISDIR(mode) ? UINT32_MAX :
+                             inode_first_block(&entry->inode);
+        if (!EXT2_S_ISREG(mode) && !EXT2_S_ISDIR(mode))
+            entry->first_block = 0;
+    }
+
+    if (ret == E_SUCCESS)
+        qsort(entries, list.num, sizeof(tar_entry_t), cmp_tar_entries);
+
+    for (size_t i = 0; i < list.num && ret == E_SUCCESS; i++)
+    {
+        tar_entry_t* entry = &entries[i];
+        if (path_len + 1 + entry->name_len + 2 > EXT2_PATH_MAX)
+        {
+            fprintf(stderr, "[tar_dir] Path is too long, skipping %s\n",
+                            list.names + entry->name_off);
+            continue;
+        }
+
+        tar->path[path_len] = '/';
+        memcpy(tar->path + path_len + 1, list.names + entry->name_off,
+               entry->name_len + 1);
+
+        ret = tar_put_entry(tar, entry->ino, &entry->inode);
+        if (ret == E_SUCCESS && EXT2_S_ISDIR(__le16_to_cpu(entry->inode.i_mode)))
+            ret = tar_dir(tar, entry->ino, path_len + 1 + entry->name_len);
+
+        tar->path[path_len] = '\0';
+    }
+
+    free(entries);
+    free(list.entries);
+    free(list.names);
+    return ret;
+}
+
+static int tar_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc != 1)
+    {
+        fprintf(stderr, "[tar_mode] Try ./read_ext2 device tar "
+                        "inode_number|/path > archive.tar\n");
+        return E_BADARGS;
+    }
+
+    uint32_t ino = 0;
+    int ret = parse_target(fs, argv[0], &ino);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    tar_ctx_t tar = {.fs = fs};
+    inode_t root;
+    ret = get_ext2_inode(fs, ino, &root);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    errno = 0;
+    tar.path = (char*) calloc(EXT2_PATH_MAX, 1);
+    if (tar.path == NULL)
+    {
+        perror("[tar_mode] Allocation of path failed\n");
+        return E_BADALLOC;
+    }
+
+    ret = out_open(&tar.out, STDOUT_FILENO);
+    if (ret != E_SUCCESS)
+    {
+        free(tar.path);
+        return ret;
+    }
+
+    // a directory is archived as ./..., a single file under its own name
+    if (EXT2_S_ISDIR(__le16_to_cpu(root.i_mode)))
+    {
+        tar.path[0] = '.';
+        ret = tar_put_entry(&tar, ino, &root);
+        if (ret == E_SUCCESS)
+            ret = tar_dir(&tar, ino, 1);
+    }
+    else
+    {
+        const char* name = strrchr(argv[0], '/');
+        name = (name != NULL) ? name + 1 : argv[0];
+        strncpy(tar.path, name, EXT2_PATH_MAX - 1);
+        ret = tar_put_entry(&tar, ino, &root);
+    }
+
+    // end of archive is two zero blocks, padded to the whole record
+    out_write(&tar.out, NULL, 2 * TAR_BLOCK_SIZE);
+    out_write(&tar.out, NULL, (TAR_RECORD_SIZE - tar.out.total % TAR_RECORD_SIZE) %
+                              TAR_RECORD_SIZE);
+
+    int out_ret = out_close(&tar.out);
+    if (ret == E_SUCCESS)
+        ret = out_ret;
+
+    fprintf(stderr, "archived %lu entries\n", tar.num_files);
+
+    for (size_t i = 0; i < tar.links_size; i++)
+        free(tar.links[i].path);
+    free(tar.links);
+    free(tar.path);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// metadata snapshot
+// 'snapshot' dumps all used inodes, their block runs and all directory
+// entries into a sidecar file. 'snap' answers stat/ls/lookup queries from an
+// mmap of that file, the image is touched only to read the superblock which
+// validates that the snapshot still matches it (UUID and s_wtime).
+//
+// Sidecar layout, every section is 8 byte aligned:
+//   snap_header_t | snap_inode_t[num_inodes + 1] (indexed by inode number) |
+//   snap_run_t[num_runs] | snap_dirent_t[num_dirents] | names
+// Entries of every directory are sorted by name for binary search.
+////////////////////////////////////////////////////////////////////////////////
+#define SNAP_MAGIC   "E2SNAP"
+#define SNAP_VERSION 1
+
+typedef struct snap_header
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint8_t  uuid[16];
+    uint32_t wtime;
+    uint32_t block_size;
+    uint64_t num_inodes;
+    uint64_t inodes_off;
+    uint64_t runs_off;
+    uint64_t num_runs;
+    uint64_t dirents_off;
+    uint64_t num_dirents;
+    uint64_t names_off;
+    uint64_t names_size;
+} snap_header_t;
+
+typedef struct snap_inode
+{
+    uint16_t mode;
+    uint16_t links_count;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint64_t size;
+    uint64_t first_run;
+    uint32_t num_runs;
+    uint32_t num_dirents;
+    uint64_t first_dirent;
+} snap_inode_t;
+
+typedef struct snap_run
+{
+    uint32_t file_block;
+    uint32_t phys_block;
+    uint32_t len;
+} snap_run_t;
+
+typedef struct snap_dirent
+{
+    uint32_t ino;
+    uint32_t name_off;
+    uint8_t  name_len;
+    uint8_t  pad[3];
+} snap_dirent_t;
+
+typedef struct snap_builder
+{
+    snap_inode_t*  inodes;
+    snap_run_t*    runs;
+    size_t         num_runs;
+    size_t         cap_runs;
+    snap_dirent_t* dirents;
+    size_t         num_dirents;
+    size_t         cap_dirents;
+    char*          names;
+    size_t         names_size;
+    size_t         names_cap;
+    snap_inode_t*  cur;
+} snap_builder_t;
+
+typedef struct snap_view
+{
+    const snap_header_t* hdr;
+    const snap_inode_t*  inodes;
+    const snap_run_t*    runs;
+    const snap_dirent_t* dirents;
+    const char*          names;
+    size_t               map_size;
+} snap_view_t;
+
+static int grow_array(void** array, size_t* cap, size_t need, size_t elem_size)
+{
+    assert(array != NULL);
+    assert(cap != NULL);
+
+    if (need <= *cap)
+        return E_SUCCESS;
+
+    size_t new_cap = (*cap == 0) ? 1024 : *cap;
+    while (new_cap < need)
+        new_cap *= 2;
+
+    errno = 0;
+    void* new_array = realloc(*array, new_cap * elem_size);
+    if (new_array == NULL)
+    {
+        perror("[grow_array] Reallocation failed\n");
+        return E_BADALLOC;
+    }
+
+    *array = new_array;
+    *cap   = new_cap;
+    return E_SUCCESS;
+}
+
+static int snap_run_cb(ext2_fs_t* fs, uint32_t file_block, uint32_t phys_block,
+                       uint32_t len, void* ctx)
+{
+    snap_builder_t* snap = (snap_builder_t*) ctx;
+    assert(snap != NULL);
+
+    int ret = grow_array((void**)&snap->runs, &snap->cap_runs,
+                         snap->num_runs + 1, sizeof(snap_run_t));
+    if (ret != E_SUCCESS)
+        return ret;
+
+    snap_run_t* run = &snap->runs[snap->num_runs++];
+    run->file_block = file_block;
+    run->phys_block = phys_block;
+    run->len        = len;
+    snap->cur->num_runs++;
+
+    return E_SUCCESS;
+}
+
+static int snap_inode_cb(ext2_fs_t* fs, uint32_t ino, inode_t* inode, void* ctx)
+{
+    snap_builder_t* snap = (snap_builder_t*) ctx;
+    assert(snap != NULL);
+
+    snap_inode_t* cur = &snap->inodes[ino];
+    uint16_t mode = __le16_to_cpu(inode->i_mode);
+
+    cur->mode        = mode;
+    cur->links_count = __le16_to_cpu(inode->i_links_count);
+    cur->uid         = __le16_to_cpu(inode->i_uid) |
+        ((uint32_t)__le16_to_cpu(inode->osd2.linux2.l_i_uid_high) << 16);
+    cur->gid         = __le16_to_cpu(inode->i_gid) |
+        ((uint32_t)__le16_to_cpu(inode->osd2.linux2.l_i_gid_high) << 16);
+    cur->atime       = __le32_to_cpu(inode->i_atime);
+    cur->ctime       = __le32_to_cpu(inode->i_ctime);
+    cur->mtime       = __le32_to_cpu(inode->i_mtime);
+    cur->size        = get_inode_size(inode);
+    cur->first_run   = snap->num_runs;
+
+    if (!inode_maps_blocks(inode))
+        return E_SUCCESS;
+
+    snap->cur = cur;
+    int ret = map_file_blocks(fs, inode, snap_run_cb, snap);
+    if (ret != E_SUCCESS || !EXT2_S_ISDIR(mode))
+        return ret;
+
+    dir_list_t list = {};
+    ret = iterate_dir(fs, inode, collect_dir_entry, &list);
+    if (ret == E_SUCCESS)
+    {
+        sort_dir_list(&list);
+        ret = grow_array((void**)&snap->dirents, &snap->cap_dirents,
+                         snap->num_dirents + list.num, sizeof(snap_dirent_t));
+    }
+    if (ret == E_SUCCESS)
+        ret = grow_array((void**)&snap->names, &snap->names_cap,
+                         snap->names_size + list.names_size, 1);
+
+    if (ret == E_SUCCESS)
+    {
+        cur->first_dirent = snap->num_dirents;
+        cur->num_dirents  = list.num;
+
+        for (size_t i = 0; i < list.num; i++)
+        {
+            dir_list_entry_t* entry = &list.entries[i];
+            snap_dirent_t* dirent = &snap->dirents[snap->num_dirents++];
+            dirent->ino       = entry->ino;
+            dirent->name_off  = snap->names_size + entry->name_off;
+            dirent->name_len  = entry->name_len;
+            memset(dirent->pad, 0, sizeof(dirent->pad));
+        }
+
+        memcpy(snap->names + snap->names_size, list.names, list.names_size);
+        snap->names_size += list.names_size;
+    }
+
+    free(list.entries);
+    free(list.names);
+    return ret;
+}
+
+static uint64_t align8(uint64_t value)
+{
+    return (value + 7) & ~(uint64_t)7;
+}
+
+static int snapshot_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc != 1)
+    {
+        fprintf(stderr, "[snapshot_mode] Try ./read_ext2 device snapshot "
+                        "sidecar_file\n");
+        return E_BADARGS;
+    }
+
+    snap_builder_t snap = {};
+    errno = 0;
+    snap.inodes = (snap_inode_t*) calloc(fs->num_inodes + 1, sizeof(snap_inode_t));
+    if (snap.inodes == NULL)
+    {
+        perror("[snapshot_mode] Allocation of inodes failed\n");
+        return E_BADALLOC;
+    }
+
+    int ret = iterate_inodes(fs, snap_inode_cb, &snap);
+
+    snap_header_t hdr = {
+        .magic       = SNAP_MAGIC,
+        .version     = SNAP_VERSION,
+        .header_size = sizeof(snap_header_t),
+        .wtime       = __le32_to_cpu(fs->sb->s_wtime),
+        .block_size  = fs->block_size,
+        .num_inodes  = fs->num_inodes,
+        .num_runs    = snap.num_runs,
+        .num_dirents = snap.num_dirents,
+        .names_size  = snap.names_size,
+    };
+    memcpy(hdr.uuid, fs->sb->s_uuid, sizeof(hdr.uuid));
+    hdr.inodes_off  = align8(sizeof(snap_header_t));
+    hdr.runs_off    = align8(hdr.inodes_off +
+                             (hdr.num_inodes + 1) * sizeof(snap_inode_t));
+    hdr.dirents_off = align8(hdr.runs_off + hdr.num_runs * sizeof(snap_run_t));
+    hdr.names_off   = align8(hdr.dirents_off +
+                             hdr.num_dirents * sizeof(snap_dirent_t));
+
+    char tmp_path[PATH_MAX] = {};
+    int fd = -1;
+    if (ret == E_SUCCESS)
+    {
+        int len = snprintf(tmp_path, PATH_MAX, "%s.tmp", argv[0]);
+        if (len < 0 || len >= PATH_MAX)
+        {
+            fprintf(stderr, "[snapshot_mode] Sidecar path is too long\n");
+            ret = E_BADARGS;
+        }
+    }
+    if (ret == E_SUCCESS)
+    {
+        errno = 0;
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror("[snapshot_mode] Creating sidecar failed\n");
+            ret = E_BADIO;
+        }
+    }
+
+    struct {
+        uint64_t    off;
+        const void* data;
+        size_t      size;
+    } sections[] = {
+        {0,               &hdr,        sizeof(hdr)},
+        {hdr.inodes_off,  snap.inodes, (hdr.num_inodes + 1) * sizeof(snap_inode_t)},
+        {hdr.runs_off,    snap.runs,   hdr.num_runs * sizeof(snap_run_t)},
+        {hdr.dirents_off, snap.dirents, hdr.num_dirents * sizeof(snap_dirent_t)},
+        {hdr.names_off,   snap.names,  hdr.names_size},
+    };
+
+    for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]) &&
+                       ret == E_SUCCESS; i++)
+    {
+        if (sections[i].size == 0)
+            continue;
+
+        errno = 0;
+        if (lseek(fd, sections[i].off, SEEK_SET) < 0 ||
+            write_full(fd, sections[i].data, sections[i].size) != E_SUCCESS)
+        {
+            perror("[snapshot_mode] Writing sidecar failed\n");
+            ret = E_BADIO;
+        }
+    }
+
+    if (fd >= 0)
+    {
+        if (close(fd) < 0 && ret == E_SUCCESS)
+            ret = E_BADIO;
+
+        errno = 0;
+        if (ret == E_SUCCESS && rename(tmp_path, argv[0]) < 0)
+        {
+            perror("[snapshot_mode] Replacing sidecar failed\n");
+            ret = E_BADIO;
+        }
+        if (ret != E_SUCCESS)
+            unlink(tmp_path);
+    }
+
+    if (ret == E_SUCCESS)
+        fprintf(stderr, "inodes %lu runs %lu dirents %lu names %lu bytes\n",
+                        hdr.num_inodes, hdr.num_runs, hdr.num_dirents,
+                        hdr.names_size);
+
+    free(snap.inodes);
+    free(snap.runs);
+    free(snap.dirents);
+    free(snap.names);
+    return ret;
+}
+
+// count elements of elem_size at off lie within the mapping, after the header
+static int snap_section_ok(uint64_t off, uint64_t count, size_t elem_size,
+                           size_t map_size)
+{
+    return off % 8 == 0 && off >= sizeof(snap_header_t) && off <= map_size &&
+           count <= (map_size - off) / elem_size;
+}
+
+static int snap_map(ext2_fs_t* fs, const char* path, snap_view_t* view)
+{
+    assert(fs != NULL);
+    assert(path != NULL);
+    assert(view != NULL);
+
+    errno = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror("[snap_map] Opening sidecar failed\n");
+        return E_BADIO;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(snap_header_t))
+    {
+        fprintf(stderr, "[snap_map] %s is not a snapshot\n", path);
+        close(fd);
+        return E_ERROR;
+    }
+
+    errno = 0;
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("[snap_map] Mapping sidecar failed\n");
+        return E_BADIO;
+    }
+
+    const snap_header_t* hdr = (const snap_header_t*) map;
+    int ret = E_SUCCESS;
+    size_t map_size = st.st_size;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+        hdr->version != SNAP_VERSION ||
+        hdr->header_size != sizeof(snap_header_t))
+    {
+        fprintf(stderr, "[snap_map] %s is not a snapshot of version %d\n",
+                        path, SNAP_VERSION);
+        ret = E_ERROR;
+    }
+    else if (memcmp(hdr->uuid, fs->sb->s_uuid, sizeof(hdr->uuid)) != 0 ||
+             hdr->wtime != __le32_to_cpu(fs->sb->s_wtime) ||
+             hdr->num_inodes != fs->num_inodes)
+    {
+        fprintf(stderr, "[snap_map] %s is stale, image was changed after "
+                        "the snapshot was taken\n", path);
+        ret = E_ERROR;
+    }
+    // num_inodes matches the image here, so num_inodes + 1 can't overflow;
+    // per-inode ranges and dirents are checked on use by snap_inode() and
+    // snap_dirent_ok(), so a query touches only the pages it needs
+    else if (!snap_section_ok(hdr->inodes_off, hdr->num_inodes + 1,
+                              sizeof(snap_inode_t), map_size) ||
+             !snap_section_ok(hdr->runs_off, hdr->num_runs,
+                              sizeof(snap_run_t), map_size) ||
+             !snap_section_ok(hdr->dirents_off, hdr->num_dirents,
+                              sizeof(snap_dirent_t), map_size) ||
+             !snap_section_ok(hdr->names_off, hdr->names_size, 1, map_size))
+    {
+        fprintf(stderr, "[snap_map] %s is corrupted, a section lies outside "
+                        "of the file\n", path);
+        ret = E_ERROR;
+    }
+
+    if (ret != E_SUCCESS)
+    {
+        munmap(map, map_size);
+        return ret;
+    }
+
+    view->hdr      = hdr;
+    view->inodes   = (const snap_inode_t*)((const uint8_t*)map + hdr->inodes_off);
+    view->runs     = (const snap_run_t*)((const uint8_t*)map + hdr->runs_off);
+    view->dirents  = (const snap_dirent_t*)((const uint8_t*)map + hdr->dirents_off);
+    view->names    = (const char*)map + hdr->names_off;
+    view->map_size = map_size;
+
+    return E_SUCCESS;
+}
+
+// inode ino with its run and dirent ranges checked against the header,
+// NULL when the sidecar is corrupted
+static const snap_inode_t* snap_inode(snap_view_t* view, uint64_t ino)
+{
+    assert(view != NULL);
+
+    const snap_header_t* hdr = view->hdr;
+    const snap_inode_t* inode = (ino <= hdr->num_inodes) ?
+                                &view->inodes[ino] : NULL;
+    if (inode == NULL ||
+        inode->first_run > hdr->num_runs ||
+        inode->num_runs > hdr->num_runs - inode->first_run ||
+        inode->first_dirent > hdr->num_dirents ||
+        inode->num_dirents > hdr->num_dirents - inode->first_dirent)
+    {
+        fprintf(stderr, "[snap_inode] Snapshot of inode %lu is corrupted\n",
+                        ino);
+        return NULL;
+    }
+
+    return inode;
+}
+
+static int snap_dirent_ok(snap_view_t* view, const snap_dirent_t* entry)
+{
+    assert(view != NULL);
+    assert(entry != NULL);
+
+    if (entry->ino > view->hdr->num_inodes ||
+        entry->name_off + (uint64_t)entry->name_len > view->hdr->names_size)
+    {
+        fprintf(stderr, "[snap_dirent_ok] Snapshot dirent of inode %u is "
+                        "corrupted\n", entry->ino);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int snap_lookup_name(snap_view_t* view, uint32_t dir_ino,
+                            const char* name, size_t name_len, uint32_t* ino)
+{
+    assert(view != NULL);
+    assert(ino != NULL);
+
+    const snap_inode_t* dir = snap_inode(view, dir_ino);
+    if (dir == NULL || !EXT2_S_ISDIR(dir->mode))
+        return E_ERROR;
+
+    const snap_dirent_t* entries = view->dirents + dir->first_dirent;
+    size_t left  = 0;
+    size_t right = dir->num_dirents;
+    while (left < right)
+    {
+        size_t mid = left + (right - left) / 2;
+        const snap_dirent_t* entry = &entries[mid];
+        if (!snap_dirent_ok(view, entry))
+            return E_ERROR;
+
+        size_t len = (entry->name_len < name_len) ? entry->name_len : name_len;
+        int cmp = memcmp(view->names + entry->name_off, name, len);
+        if (cmp == 0)
+            cmp = (entry->name_len > name_len) - (entry->name_len < name_len);
+
+        if (cmp == 0)
+        {
+            *ino = entry->ino;
+            return E_SUCCESS;
+        }
+
+        if (cmp < 0)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    return E_ERROR;
+}
+
+static int snap_resolve(snap_view_t* view, const char* target, uint32_t* ino)
+{
+    assert(view != NULL);
+    assert(target != NULL);
+    assert(ino != NULL);
+
+    if (target[0] != '/')
+    {
+        errno = 0;
+        char* endptr = NULL;
+        unsigned long long int inode_number = strtoull(target, &endptr, 10);
+        if (errno != 0 || *endptr != '\0' || inode_number == 0 ||
+            inode_number > view->hdr->num_inodes)
+        {
+            fprintf(stderr, "[snap_resolve] Bad target %s\n", target);
+            return E_BADARGS;
+        }
+
+        *ino = inode_number;
+        return E_SUCCESS;
+    }
+
+    uint32_t cur_ino = EXT2_ROOT_INO;
+    const char* pos = target;
+    while (*pos != '\0')
+    {
+        while (*pos == '/')
+            pos++;
+
+        size_t name_len = strcspn(pos, "/");
+        if (name_len == 0)
+            break;
+
+        if (snap_lookup_name(view, cur_ino, pos, name_len, &cur_ino) != E_SUCCESS)
+        {
+            fprintf(stderr, "[snap_resolve] %.*s not found\n",
+                            (int)(pos - target + name_len), target);
+            return E_ERROR;
+        }
+
+        pos += name_len;
+    }
+
+    *ino = cur_ino;
+    return E_SUCCESS;
+}
+
+static void snap_print_stat(snap_view_t* view, uint32_t ino,
+                            const snap_inode_t* inode)
+{
+    assert(view != NULL);
+    assert(inode != NULL);
+
+    printf("inode %u mode %.4X links %u uid %u gid %u size %lu\n"
+           "atime %u ctime %u mtime %u\n",
+           ino, inode->mode, inode->links_count, inode->uid, inode->gid,
+           inode->size, inode->atime, inode->ctime, inode->mtime);
+
+    for (uint32_t i = 0; i < inode->num_runs; i++)
+    {
+        const snap_run_t* run = &view->runs[inode->first_run + i];
+        printf("run %u +%u -> %u\n", run->file_block, run->len, run->phys_block);
+    }
+}
+
+static int snap_print_dir(snap_view_t* view, const snap_inode_t* dir)
+{
+    assert(view != NULL);
+    assert(dir != NULL);
+
+    for (uint32_t i = 0; i < dir->num_dirents; i++)
+    {
+        const snap_dirent_t* entry = &view->dirents[dir->first_dirent + i];
+        if (!snap_dirent_ok(view, entry))
+            return E_ERROR;
+
+        const snap_inode_t* child = &view->inodes[entry->ino];
+        printf("%10u %.4X %10lu %.*s\n", entry->ino, child->mode, child->size,
+               entry->name_len, view->names + entry->name_off);
+    }
+
+    return E_SUCCESS;
+}
+
+static int snap_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc != 3 || (strcmp(argv[1], "stat") != 0 &&
+                      strcmp(argv[1], "ls") != 0 &&
+                      strcmp(argv[1], "lookup") != 0))
+    {
+        fprintf(stderr, "[snap_mode] Try ./read_ext2 device snap sidecar_file "
+                        "stat|ls|lookup inode_number|/path\n");
+        return E_BADARGS;
+    }
+
+    snap_view_t view;
+    int ret = snap_map(fs, argv[0], &view);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    uint32_t ino = 0;
+    const snap_inode_t* inode = NULL;
+    ret = snap_resolve(&view, argv[2], &ino);
+    if (ret == E_SUCCESS && (inode = snap_inode(&view, ino)) == NULL)
+        ret = E_ERROR;
+    if (ret == E_SUCCESS && inode->mode == 0)
+    {
+        fprintf(stderr, "[snap_mode] Inode %u is not used\n", ino);
+        ret = E_ERROR;
+    }
+
+    if (ret == E_SUCCESS)
+    {
+        if (strcmp(argv[1], "lookup") == 0)
+            printf("%u\n", ino);
+        else if (strcmp(argv[1], "stat") == 0)
+            snap_print_stat(&view, ino, inode);
+        else if (EXT2_S_ISDIR(inode->mode))
+            ret = snap_print_dir(&view, inode);
+        else
+        {
+            fprintf(stderr, "[snap_mode] %s is not a directory\n", argv[2]);
+            ret = E_ERROR;
+        }
+    }
+
+    munmap((void*)view.hdr, view.map_size);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// bench mode
+// Times the per-inode entry points (get_ext2_inode, read_dir, read_reg_file)
+// over every used inode of the image, images come from ext2_gen so runs with
+// the same seed are comparable
+////////////////////////////////////////////////////////////////////////////////
+#define BENCH_DEFAULT_ITERS 3
+
+enum BENCH_PHASES{
+    BENCH_INODE = 0,
+    BENCH_DIR   = 1,
+    BENCH_FILE  = 2,
+    BENCH_NUM_PHASES,
+};
+
+static const char* bench_phase_names[BENCH_NUM_PHASES] = {
+    "inode", "dir", "file"
+};
+
+typedef struct bench_item
+{
+    uint32_t ino;
+    uint16_t mode;
+    uint64_t size;
+} bench_item_t;
+
+typedef struct bench_phase
+{
+    double* lat;       // seconds per operation
+    size_t  num_lat;
+    size_t  cap_lat;
+    double  total;
+    uint64_t bytes;
+} bench_phase_t;
+
+typedef struct bench_ctx
+{
+    bench_item_t* items;
+    size_t        num_items;
+    size_t        cap_items;
+    uint32_t      max_file_size;
+    bench_phase_t phases[BENCH_NUM_PHASES];
+} bench_ctx_t;
+
+static int bench_inode_cb(ext2_fs_t* fs, uint32_t ino, inode_t* inode,
+                          void* ctx)
+{
+    assert(fs != NULL);
+    assert(inode != NULL);
+    assert(ctx != NULL);
+
+    bench_ctx_t* bench = (bench_ctx_t*)ctx;
+    uint16_t mode = __le16_to_cpu(inode->i_mode);
+    if (!EXT2_S_ISDIR(mode) && !EXT2_S_ISREG(mode))
+        return E_SUCCESS;
+
+    // read_reg_file() keeps whole files in memory
+    if (get_inode_size(inode) > UINT32_MAX)
+        return E_SUCCESS;
+
+    int ret = grow_array((void**)&bench->items, &bench->cap_items,
+                         bench->num_items + 1, sizeof(bench_item_t));
+    if (ret != E_SUCCESS)
+        return ret;
+
+    bench_item_t* item = &bench->items[bench->num_items++];
+    item->ino  = ino;
+    item->mode = mode;
+    item->size = get_inode_size(inode);
+
+    if (EXT2_S_ISREG(mode) && item->size > bench->max_file_size)
+        bench->max_file_size = item->size;
+
+    return E_SUCCESS;
+}
+
+static double bench_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench_record(bench_phase_t* phase, double lat, uint64_t bytes)
+{
+    assert(phase != NULL);
+
+    int ret = grow_array((void**)&phase->lat, &phase->cap_lat,
+                         phase->num_lat + 1, sizeof(double));
+    if (ret != E_SUCCESS)
+        return ret;
+
+    phase->lat[phase->num_lat++] = lat;
+    phase->total += lat;
+    phase->bytes += bytes;
+    return E_SUCCESS;
+}
+
+static int bench_iteration(ext2_fs_t* fs, bench_ctx_t* bench, uint8_t* file)
+{
+    assert(fs != NULL);
+    assert(bench != NULL);
+    assert(file != NULL);
+
+    for (size_t i = 0; i < bench->num_items; i++)
+    {
+        bench_item_t* item = &bench->items[i];
+        inode_t inode;
+
+        double start = bench_now();
+        int ret = get_ext2_inode(fs, item->ino, &inode);
+        double lat = bench_now() - start;
+        if (ret != E_SUCCESS)
+        {
+            fprintf(stderr, "[bench_iteration] %d: Getting inode %u failed\n",
+                            ret, item->ino);
+            return ret;
+        }
+
+        ret = bench_record(&bench->phases[BENCH_INODE], lat, fs->inode_size);
+        if (ret != E_SUCCESS)
+            return ret;
+
+        int phase = BENCH_DIR;
+        start = bench_now();
+        if (EXT2_S_ISDIR(item->mode))
+            ret = read_dir(fs, &inode);
+        else
+        {
+            phase = BENCH_FILE;
+            ssize_t read_ret = read_reg_file(fs, &inode, file);
+            ret = (read_ret < 0) ? (int)read_ret : E_SUCCESS;
+        }
+        lat = bench_now() - start;
+
+        if (ret != E_SUCCESS)
+        {
+            fprintf(stderr, "[bench_iteration] %d: Reading inode %u failed\n",
+                            ret, item->ino);
+            return ret;
+        }
+
+        ret = bench_record(&bench->phases[phase], lat, item->size);
+        if (ret != E_SUCCESS)
+            return ret;
+    }
+
+    return E_SUCCESS;
+}
+
+static int cmp_doubles(const void* lhs, const void* rhs)
+{
+    double a = *(const double*)lhs;
+    double b = *(const double*)rhs;
+    return (a > b) - (a < b);
+}
+
+static void bench_report(bench_ctx_t* bench)
+{
+    assert(bench != NULL);
+
+    printf("%-6s %10s %12s %10s %10s %10s %10s %10s\n", "phase", "ops",
+           "ops/s", "MB/s", "p50_us", "p90_us", "p99_us", "max_us");
+
+    for (int i = 0; i < BENCH_NUM_PHASES; i++)
+    {
+        bench_phase_t* phase = &bench->phases[i];
+        if (phase->num_lat == 0)
+            continue;
+
+        qsort(phase->lat, phase->num_lat, sizeof(double), cmp_doubles);
+
+        size_t last = phase->num_lat - 1;
+        double ops_per_sec = 0;
+        double mb_per_sec  = 0;
+        if (phase->total > 0)
+        {
+            ops_per_sec = phase->num_lat / phase->total;
+            mb_per_sec  = phase->bytes / phase->total / (1024.0 * 1024.0);
+        }
+
+        printf("%-6s %10zu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               bench_phase_names[i], phase->num_lat, ops_per_sec, mb_per_sec,
+               phase->lat[last * 50 / 100] * 1e6,
+               phase->lat[last * 90 / 100] * 1e6,
+               phase->lat[last * 99 / 100] * 1e6,
+               phase->lat[last] * 1e6);
+    }
+}
+
+static int bench_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "cold") != 0))
+    {
+        fprintf(stderr, "[bench_mode] Try ./read_ext2 device bench "
+                        "[iterations] [cold]\n");
+        return E_BADARGS;
+    }
+
+    long iterations = BENCH_DEFAULT_ITERS;
+    if (argc >= 1)
+    {
+        char* end = NULL;
+        errno = 0;
+        iterations = strtol(argv[0], &end, 10);
+        if (errno != 0 || *end != '\0' || iterations <= 0)
+        {
+            fprintf(stderr, "[bench_mode] Bad iterations number %s\n",
+                            argv[0]);
+            return E_BADARGS;
+        }
+    }
+    int cold = (argc == 2);
+
+    bench_ctx_t bench;
+    memset(&bench, 0, sizeof(bench));
+
+    int ret = iterate_inodes(fs, bench_inode_cb, &bench);
+    if (ret != E_SUCCESS)
+    {
+        free(bench.items);
+        return ret;
+    }
+
+    errno = 0;
+    uint8_t* file = (uint8_t*) malloc(bench.max_file_size + 1);
+    if (file == NULL)
+    {
+        perror("[bench_mode] Allocation of file buffer failed\n");
+        free(bench.items);
+        return E_BADALLOC;
+    }
+
+    // read_dir prints entries to stdout, keep them out of the report
+    fflush(stdout);
+    errno = 0;
+    int saved_stdout = dup(STDOUT_FILENO);
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (saved_stdout < 0 || null_fd < 0 ||
+        dup2(null_fd, STDOUT_FILENO) < 0)
+    {
+        perror("[bench_mode] Redirecting stdout failed\n");
+        ret = E_BADIO;
+    }
+
+    for (long i = 0; i < iterations && ret == E_SUCCESS; i++)
+    {
+        if (cold)
+            posix_fadvise(fs->dev_fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        ret = bench_iteration(fs, &bench, file);
+    }
+
+    fflush(stdout);
+    if (saved_stdout >= 0)
+    {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    if (null_fd >= 0)
+        close(null_fd);
+
+    if (ret == E_SUCCESS)
+    {
+        fprintf(stderr, "%zu inodes, %ld iterations, %s cache\n",
+                        bench.num_items, iterations, cold ? "cold" : "warm");
+        bench_report(&bench);
+    }
+
+    for (int i = 0; i < BENCH_NUM_PHASES; i++)
+        free(bench.phases[i].lat);
+    free(bench.items);
+    free(file);
+    return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// find mode
+// find -name over the whole image. One pass over the inode tables marks
+// directories, then every directory is scanned once with names matched in
+// place by the lookup kernel. Paths are rebuilt from parent links only for
+// the matches.
+////////////////////////////////////////////////////////////////////////////////
+enum PATTERN_KINDS{
+    PATTERN_EXACT  = 0,
+    PATTERN_PREFIX = 1, // "abc*"
+    PATTERN_GLOB   = 2, // anything else, its literal prefix is prefiltered
+};
+
+typedef struct name_pattern
+{
+    int         kind;
+    const char* glob;
+    name_key_t  key;  // whole name for EXACT, literal prefix otherwise
+} name_pattern_t;
+
+typedef struct find_node
+{
+    uint32_t parent;   // 0 - directory is not linked yet
+    uint32_t name_off;
+    uint8_t  name_len;
+} find_node_t;
+
+typedef struct find_match
+{
+    uint32_t dir;
+    uint32_t ino;
+    uint32_t name_off;
+    uint8_t  name_len;
+} find_match_t;
+
+typedef struct find_ctx
+{
+    name_pattern_t pattern;
+    uint32_t*      dirs;
+    size_t         num_dirs;
+    size_t         cap_dirs;
+    uint8_t*       is_dir;   // indexed by inode number
+    find_node_t*   nodes;    // indexed by inode number
+    find_match_t*  matches;
+    size_t         num_matches;
+    size_t         cap_matches;
+    char*          names;
+    size_t         names_size;
+    size_t         names_cap;
+    size_t         num_inodes;
+    uint32_t       cur_dir;
+} find_ctx_t;
+
+static void make_name_pattern(name_pattern_t* pattern, const char* glob)
+{
+    assert(pattern != NULL);
+    assert(glob != NULL);
+
+    size_t literal = strcspn(glob, "*?[\\");
+    if (glob[literal] == '\0')
+        pattern->kind = PATTERN_EXACT;
+    else if (glob[literal] == '*' && glob[literal + 1] == '\0')
+        pattern->kind = PATTERN_PREFIX;
+    else
+        pattern->kind = PATTERN_GLOB;
+
+    pattern->glob = glob;
+    make_name_key(&pattern->key, glob, literal);
+}
+
+static int pattern_match(const name_pattern_t* pattern, const char* name,
+                         size_t name_len)
+{
+    assert(pattern != NULL);
+    assert(name != NULL);
+
+    if (pattern->kind == PATTERN_EXACT)
+        return name_len == pattern->key.len &&
+               name_key_match(&pattern->key, name);
+
+    if (name_len < pattern->key.len ||
+        (pattern->key.len > 0 && !name_key_match(&pattern->key, name)))
+        return 0;
+
+    if (pattern->kind == PATTERN_PREFIX)
+        return 1;
+
+    char buff[EXT2_NAME_LEN + 1];
+    memcpy(buff, name, name_len);
+    buff[name_len] = '\0';
+    return fnmatch(pattern->glob, buff, 0) == 0;
+}
+
+static int find_add_name(find_ctx_t* find, const char* name, size_t name_len,
+                         uint32_t* name_off)
+{
+    assert(find != NULL);
+    assert(name_off != NULL);
+
+    int ret = grow_array((void**)&find->names, &find->names_cap,
+                         find->names_size + name_len, 1);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    memcpy(find->names + find->names_size, name, name_len);
+    *name_off = find->names_size;
+    find->names_size += name_len;
+    return E_SUCCESS;
+}
+
+static int find_inode_cb(ext2_fs_t* fs, uint32_t ino, inode_t* inode,
+                         void* ctx)
+{
+    assert(inode != NULL);
+    assert(ctx != NULL);
+
+    find_ctx_t* find = (find_ctx_t*) ctx;
+    if (!EXT2_S_ISDIR(__le16_to_cpu(inode->i_mode)))
+        return E_SUCCESS;
+
+    int ret = grow_array((void**)&find->dirs, &find->cap_dirs,
+                         find->num_dirs + 1, sizeof(uint32_t));
+    if (ret != E_SUCCESS)
+        return ret;
+
+    find->dirs[find->num_dirs++] = ino;
+    find->is_dir[ino] = 1;
+    return E_SUCCESS;
+}
+
+static int find_entry_cb(uint32_t ino, uint8_t file_type, const char* name,
+                         size_t name_len, void* ctx)
+{
+    find_ctx_t* find = (find_ctx_t*) ctx;
+    assert(find != NULL);
+
+    if ((name_len == 1 && name[0] == '.') ||
+        (name_len == 2 && name[0] == '.' && name[1] == '.') ||
+        name_len > EXT2_NAME_LEN)
+        return E_SUCCESS;
+
+    if (ino > find->num_inodes)
+    {
+        fprintf(stderr, "[find_entry_cb] Bad inode %u in directory %u\n",
+                        ino, find->cur_dir);
+        return E_ERROR;
+    }
+
+    int is_dir   = find->is_dir[ino] && find->nodes[ino].parent == 0;
+    int is_match = pattern_match(&find->pattern, name, name_len);
+    if (!is_dir && !is_match)
+        return E_SUCCESS;
+
+    uint32_t name_off = 0;
+    int ret = find_add_name(find, name, name_len, &name_off);
+    if (ret != E_SUCCESS)
+        return ret;
+
+    if (is_dir)
+    {
+        find->nodes[ino].parent   = find->cur_dir;
+        find->nodes[ino].name_off = name_off;
+        find->nodes[ino].name_len = name_len;
+    }
+
+    if (is_match)
+    {
+        ret = grow_array((void**)&find->matches, &find->cap_matches,
+                         find->num_matches + 1, sizeof(find_match_t));
+        if (ret != E_SUCCESS)
+            return ret;
+
+        find_match_t* match = &find->matches[find->num_matches++];
+        match->dir      = find->cur_dir;
+        match->ino      = ino;
+        match->name_off = name_off;
+        match->name_len = name_len;
+    }
+
+    return E_SUCCESS;
+}
+
+// builds the path of match from its end, returns NULL if the match is not
+// under root_ino
+static const char* find_match_path(find_ctx_t* find, find_match_t* match,
+                                   uint32_t root_ino, char* buff,
+                                   size_t buff_size)
+{
+    assert(find != NULL);
+    assert(match != NULL);
+    assert(buff != NULL);
+
+    char* pos = buff + buff_size - 1;
+    *pos = '\0';
+
+    uint32_t dir      = match->dir;
+    uint32_t name_off = match->name_off;
+    size_t   name_len = match->name_len;
+    int      in_root  = (match->dir == root_ino);
+
+    for (size_t depth = 0; depth <= find->num_dirs; depth++)
+    {
+        if ((size_t)(pos - buff) < name_len + 1)
+            return NULL;
+
+        pos -= name_len;
+        memcpy(pos, find->names + name_off, name_len);
+        *(--pos) = '/';
+
+        if (dir == EXT2_ROOT_INO)
+            return in_root ? pos : NULL;
+
+        find_node_t* node = &find->nodes[dir];
+        if (node->parent == 0)
+            return NULL;
+
+        name_off = node->name_off;
+        name_len = node->name_len;
+        dir      = node->parent;
+        in_root  = in_root || (dir == root_ino);
+    }
+
+    return NULL;
+}
+
+static void find_free(find_ctx_t* find)
+{
+    free(find->dirs);
+    free(find->is_dir);
+    free(find->nodes);
+    free(find->matches);
+    free(find->names);
+}
+
+static int find_mode(ext2_fs_t* fs, int argc, char* argv[])
+{
+    assert(fs != NULL);
+
+    if (argc < 1 || argc > 2)
+    {
+        fprintf(stderr, "[find_mode] Try ./read_ext2 device find pattern "
+                        "[inode_number|/path]\n");
+        return E_BADARGS;
+    }
+
+    uint32_t root_ino = EXT2_ROOT_INO;
+    if (argc == 2)
+    {
+        int ret = parse_target(fs, argv[1], &root_ino);
+        if (ret != E_SUCCESS)
+            return ret;
+    }
+
+    find_ctx_t find;
+    memset(&find, 0, sizeof(find));
+    find.num_inodes = fs->num_inodes;
+    make_name_pattern(&find.pattern, argv[0]);
+
+    errno = 0;
+    find.is_dir = (uint8_t*) calloc(fs->num_inodes + 1, sizeof(uint8_t));
+    find.nodes  = (find_node_t*) calloc(fs->num_inodes + 1,
+                                        sizeof(find_node_t));
+    if (find.is_dir == NULL || find.nodes == NULL)
+    {
+        perror("[find_mode] Allocation of inode maps failed\n");
+        find_free(&find);
+        return E_BADALLOC;
+    }
+
+    int ret = iterate_inodes(fs, find_inode_cb, &find);
+    for (size_t i = 0; i < find.num_dirs && ret == E_SUCCESS; i++)
+    {
+        inode_t dir;
+        find.cur_dir = find.dirs[i];
+        ret = get_ext2_inode(fs, find.cur_dir, &dir);
+        if (ret == E_SUCCESS)
+            ret = iterate_dir(fs, &dir, find_entry_cb, &find);
+    }
+
+    if (ret != E_SUCCESS)
+    {
+        fprintf(stderr, "[find_mode] %d: Scanning directories failed\n", ret);
+        find_free(&find);
+        return ret;
+    }
+
+    char path[EXT2_PATH_MAX];
+    size_t num_printed = 0;
+    for (size_t i = 0; i < find.num_matches; i++)
+    {
+        const char* match_path = find_match_path(&find, &find.matches[i],
+                                                 root_ino, path, sizeof(path));
+        if (match_path == NULL)
+            continue;
+
+        printf("%u %s\n", find.matches[i].ino, match_path);
+        num_printed++;
+    }
+
+    fprintf(stderr, "scanned %lu directories, %lu matches\n", find.num_dirs,
+                    num_printed);
+    find_free(&find);
+    return E_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// main
+////////////////////////////////////////////////////////////////////////////////
+typedef int (*mode_func_t)(ext2_fs_t* fs, int argc, char* argv[]);
+
+typedef struct mode
+{
+    const char* name;
+    mode_func_t func;
+} reader_mode_t;
+
+static const reader_mode_t modes[] = {
+    {"hash",     hash_mode},
+    {"dedup",    dedup_mode},
+    {"diff",     diff_mode},
+    {"tar",      tar_mode},
+    {"snapshot", snapshot_mode},
+    {"snap",     snap_mode},
+    {"bench",    bench_mode},
+    {"find",     find_mode},
+};
+
+static int inode_mode(ext2_fs_t* fs, const char* inode_str)
+{
+    assert(fs != NULL);
+    assert(inode_str != NULL);
+
+    errno = 0;
+    long long int inode_number = strtoll(inode_str, NULL, 10);
+    if (errno != 0)
+    {
+        perror("[inode_mode] Reading inode_number failed\n");
+        return E_BADARGS;
+    }
+
+    inode_t req_inode;
+    int err = get_ext2_inode(fs, inode_number, &req_inode);
     if (err != E_SUCCESS)
     {
-        fprintf(stderr, "[main] %d: Gettind inode by inode_num failed\n", err);
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "[inode_mode] %d: Gettind inode by inode_num failed\n",
+                        err);
+        return err;
     }
 
     Dprintf("i_mode = 0x%.4X\n", __le16_to_cpu(req_inode.i_mode));
     Dprintf("i_size = %d\n", __le32_to_cpu(req_inode.i_size));
 
-    err = read_inode(&fs, &req_inode);
+    err = read_inode(fs, &req_inode);
+    if (err != E_SUCCESS)
+        fprintf(stderr, "[inode_mode] %d: reading inode failed\n", err);
+
+    return err;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "--stats") == 0)
+    {
+        stats_requested = 1;
+        argv[1] = argv[0];
+        argc--;
+        argv++;
+    }
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "[main] Bad number of input arguments."
+                        "Try ./read_ext2 [--stats] device inode_number or "
+                        "./read_ext2 [--stats] device mode args...\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ext2_fs_t fs;
+    int err = ext2_open(argv[1], &fs);
     if (err != E_SUCCESS)
     {
-        fprintf(stderr, "[main] %d: reading inode failed\n", err);
+        fprintf(stderr, "[main] %d: Opening file system failed\n", err);
         exit(EXIT_FAILURE);
     }
 
-    close(dev_fd);
+    const reader_mode_t* mode = NULL;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+        if (strcmp(argv[2], modes[i].name) == 0)
+            mode = &modes[i];
+
+    if (mode != NULL)
+        err = mode->func(&fs, argc - 3, argv + 3);
+    else if (argc == 3)
+        err = inode_mode(&fs, argv[2]);
+    else
+    {
+        fprintf(stderr, "[main] Unknown mode %s\n", argv[2]);
+        err = E_BADARGS;
+    }
+
+    // after the mode is done so stdout output stays untouched
+    if (fs.stats.enabled)
+        ext2_stats_print(stderr, &fs.stats);
+
+    ext2_close(&fs);
+    if (err != E_SUCCESS)
+        exit(EXIT_FAILURE);
+
     return 0;
 }
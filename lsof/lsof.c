@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -8,108 +9,1138 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/unix_diag.h>
+#include <time.h>
+#include "../proc/proc_snapshot.h"
 
-#define PRINT_ERROR(str) do {perror(str); return EXIT_FAILURE;} while(0);
+// worker output is written out once it grows past this
+#define OUT_FLUSH_SIZE  (64 * 1024)
+// pids taken by a worker at once, fd tables vary a lot so keep it small
+#define PIDS_PER_TAKE   8
+#define MAX_THREADS     64
+// netlink dump replies, the kernel fills up to a page per message batch
+#define DIAG_BUFF_SIZE  (32 * 1024)
+#define SOCK_DESC_LEN   128
+// initial size of the watched fd set, power of 2
+#define FD_SET_SIZE     1024
 
-int get_fd_folder_path(char* dest, size_t dest_size, const char* pid_str);
-int print_opened_fds(const char* fd_path);
+typedef struct out_buff
+{
+    char*  data;
+    size_t len;
+    size_t cap;
+} out_buff_t;
+
+// fds to report, dev and ino of the file asked for with --file or --inode
+typedef struct fd_filter
+{
+    int   enabled;
+    dev_t dev;
+    ino_t ino;
+    int   first;   // stop the whole scan after the first holder
+    int   found;   // atomic
+} fd_filter_t;
+
+typedef struct sock_info
+{
+    unsigned long inode;   // 0 marks a free slot
+    char          desc[SOCK_DESC_LEN];
+} sock_info_t;
+
+// sockets of the whole host by inode, filled once and then only read
+typedef struct sock_table
+{
+    sock_info_t* entries;
+    size_t       cap;      // power of 2
+    size_t       num;
+} sock_table_t;
+
+enum FD_TYPES
+{
+    FD_REG, FD_DIR, FD_CHR, FD_BLK, FD_FIFO, FD_SOCK, FD_LNK, FD_ANON,
+    NUM_FD_TYPES
+};
+
+// one open fd of the watched process, an fd reused for another file is a
+// different entry
+typedef struct fd_entry
+{
+    int           fd;     // -1 marks a free slot
+    int           type;
+    unsigned long ino;
+    unsigned long tick;   // last tick the fd was seen
+    char*         name;
+} fd_entry_t;
+
+typedef struct fd_set_table
+{
+    fd_entry_t* entries;
+    size_t      cap;      // power of 2
+    size_t      num;
+} fd_set_table_t;
+
+// what print_opened_fds reports for every fd
+typedef struct scan_opts
+{
+    int          with_pid;     // system-wide scan, also skips foreign pids
+    int          with_name;    // readlinkat of the fd
+    int          with_fdinfo;  // fd number, pos and flags from fdinfo
+    fd_filter_t* filter;
+    const sock_table_t* sockets;  // resolves socket names, may be NULL
+} scan_opts_t;
+
+// one print_opened_fds pass, handed to print_fd for every fd
+typedef struct fd_scan
+{
+    int                pid;
+    int                info_fd;  // fdinfo dir, -1 when not printed
+    const scan_opts_t* opts;
+    out_buff_t*        out;
+} fd_scan_t;
+
+typedef struct lsof_pool
+{
+    proc_snapshot_t* snap;
+    scan_opts_t*     opts;
+    size_t           next;      // next pid index to take, atomic
+    pthread_mutex_t  out_lock;  // keeps batches of different workers apart
+} lsof_pool_t;
+
+typedef struct lsof_worker
+{
+    pthread_t    thread;
+    lsof_pool_t* pool;
+    out_buff_t   out;
+    char*        dents;
+    int          err;
+} lsof_worker_t;
+
+int out_printf(out_buff_t* out, const char* format, ...);
+int out_flush(out_buff_t* out, pthread_mutex_t* lock);
+int parse_filter(const char* file, const char* inode, fd_filter_t* filter);
+int sock_table_load(sock_table_t* table);
+const char* sock_table_find(const sock_table_t* table, unsigned long inode);
+void sock_table_free(sock_table_t* table);
+int print_opened_fds(int proc_fd, int pid, const scan_opts_t* opts,
+                     char* dents, out_buff_t* out);
+void print_header(const scan_opts_t* opts);
+int print_all_fds(proc_snapshot_t* snap, size_t num_threads,
+                  scan_opts_t* opts);
+int watch_fds(int proc_fd, int pid, double interval, long count);
 
 int main(int argc, char* argv[])
 {
-    if (argc != 2)
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* pid_str = NULL;
+    double interval = 0;
+    long count = -1;
+    const char* file = NULL;
+    const char* inode = NULL;
+    fd_filter_t filter = {};
+    scan_opts_t opts = {.with_name = 1, .filter = &filter};
+    int raw_sockets = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0)
+            && i + 1 < argc)
+            num_threads = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc)
+            file = argv[++i];
+        else if (strcmp(argv[i], "--inode") == 0 && i + 1 < argc)
+            inode = argv[++i];
+        else if (strcmp(argv[i], "--first") == 0)
+            filter.first = 1;
+        else if (strcmp(argv[i], "--no-name") == 0)
+            opts.with_name = 0;
+        else if (strcmp(argv[i], "--fdinfo") == 0)
+            opts.with_fdinfo = 1;
+        else if (strcmp(argv[i], "--raw-sockets") == 0)
+            raw_sockets = 1;
+        else if (strcmp(argv[i], "--watch") == 0 && i + 2 < argc)
+        {
+            pid_str = argv[++i];
+            interval = strtod(argv[++i], NULL);
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                count = strtol(argv[++i], NULL, 10);
+            if (interval <= 0)
+            {
+                fprintf(stderr, "Bad watch interval\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (pid_str == NULL && argv[i][0] != '-')
+            pid_str = argv[i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [-j|--threads num] "
+                            "[--file path | --inode dev:ino [--first]] "
+                            "[--no-name] [--fdinfo] [--raw-sockets] "
+                            "[pid | --watch pid interval [count]]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((file != NULL || inode != NULL) &&
+        parse_filter(file, inode, &filter) != 0)
+        return EXIT_FAILURE;
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    // one dump of all sockets, names stay raw when it isn't permitted
+    sock_table_t sockets = {};
+    if (opts.with_name && !raw_sockets && interval == 0)
+    {
+        if (sock_table_load(&sockets) == 0)
+            opts.sockets = &sockets;
+        else
+            fprintf(stderr, "Socket names are left unresolved\n");
+    }
+
+    proc_snapshot_t snap;
+    if (proc_snapshot_open(&snap) != 0)
     {
-        fprintf(stderr,
-                "Bad number of args = %d. Try ./a.out num_threads\n", argc);
+        sock_table_free(&sockets);
         return EXIT_FAILURE;
     }
 
-    errno = 0;
-    long int pid = strtol(argv[1], NULL, 10);
-    if (errno < 0)
-        PRINT_ERROR("Bad pid\n");
+    // no pid lists every process
+    if (pid_str == NULL)
+    {
+        opts.with_pid = 1;
+        int err = print_all_fds(&snap, num_threads, &opts);
+        sock_table_free(&sockets);
+        proc_snapshot_close(&snap);
+        return err;
+    }
 
+    char* end = NULL;
     errno = 0;
-    char fd_folder[PATH_MAX] = {};
-    errno = get_fd_folder_path(fd_folder, PATH_MAX, argv[1]);
-    if (errno != 0)
-        PRINT_ERROR("Can't transform pid to path to folder with pid fd's\n");
+    long int pid = strtol(pid_str, &end, 10);
+    if (errno != 0 || *end != '\0' || pid <= 0 || pid > INT_MAX)
+    {
+        fprintf(stderr, "Bad pid %s\n", pid_str);
+        sock_table_free(&sockets);
+        proc_snapshot_close(&snap);
+        return EXIT_FAILURE;
+    }
+
+    if (interval > 0)
+    {
+        int err = watch_fds(snap.proc_fd, pid, interval, count);
+        proc_snapshot_close(&snap);
+        return err;
+    }
+
+    out_buff_t out = {};
+    char* dents = proc_get_buff(&snap);
+    if (dents == NULL)
+    {
+        sock_table_free(&sockets);
+        proc_snapshot_close(&snap);
+        return EXIT_FAILURE;
+    }
+
+    print_header(&opts);
+    errno = print_opened_fds(snap.proc_fd, pid, &opts, dents, &out);
+    if (errno == 0)
+        errno = out_flush(&out, NULL);
 
-    errno = print_opened_fds(fd_folder);
+    proc_put_buff(&snap, dents);
+    free(out.data);
+    sock_table_free(&sockets);
+    proc_snapshot_close(&snap);
     if (errno != 0)
         PRINT_ERROR("Can't print opened fds of process");
 
     return 0;
 }
 
-int get_fd_folder_path(char* dest, size_t dest_size, const char* pid_str)
+int out_printf(out_buff_t* out, const char* format, ...)
 {
-    if (dest == NULL || pid_str == NULL)
-        PRINT_ERROR("[get_fd_folder_path] Bad input pointers\n");
+    while (1)
+    {
+        size_t room = out->cap - out->len;
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(out->data + out->len, room, format, args);
+        va_end(args);
+        if (len < 0)
+            PRINT_ERROR("[out_printf] Formatting failed\n");
+
+        if ((size_t)len < room)
+        {
+            out->len += len;
+            return 0;
+        }
+
+        size_t new_cap = (out->cap == 0) ? OUT_FLUSH_SIZE : 2 * out->cap;
+        while (new_cap - out->len <= (size_t)len)
+            new_cap *= 2;
+
+        errno = 0;
+        char* new_data = (char*) realloc(out->data, new_cap);
+        if (new_data == NULL)
+            PRINT_ERROR("[out_printf] Reallocation failed\n");
+
+        out->data = new_data;
+        out->cap  = new_cap;
+    }
+}
+
+// writes the whole buffer to stdout in one batch, lock may be NULL
+int out_flush(out_buff_t* out, pthread_mutex_t* lock)
+{
+    if (lock != NULL)
+        pthread_mutex_lock(lock);
+
+    int err = 0;
+    for (size_t pos = 0; pos < out->len;)
+    {
+        errno = 0;
+        ssize_t written = write(STDOUT_FILENO, out->data + pos,
+                                out->len - pos);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("[out_flush] Write failed\n");
+            err = EXIT_FAILURE;
+            break;
+        }
+        pos += written;
+    }
+
+    if (lock != NULL)
+        pthread_mutex_unlock(lock);
+
+    out->len = 0;
+    return err;
+}
+
+// target is stat'ed once, the scan then compares dev and ino only
+int parse_filter(const char* file, const char* inode, fd_filter_t* filter)
+{
+    if (filter == NULL || (file == NULL) == (inode == NULL))
+    {
+        fprintf(stderr, "[parse_filter] Need exactly one of file and inode\n");
+        return EXIT_FAILURE;
+    }
+
+    filter->enabled = 1;
+    if (file != NULL)
+    {
+        struct stat target;
+        errno = 0;
+        if (stat(file, &target) != 0)
+            PRINT_ERROR("[parse_filter] stat of target failed\n");
+
+        filter->dev = target.st_dev;
+        filter->ino = target.st_ino;
+        return 0;
+    }
 
-    size_t src_len = strnlen(pid_str, dest_size);
-    if (dest_size < src_len + 10) // /proc/[pid]/fd + \0
-        PRINT_ERROR("[get_fd_folder_path] too small destination str\n");
+    // "dev:ino" as printed by stat -c %d:%i
+    char* end = NULL;
+    errno = 0;
+    unsigned long long dev = strtoull(inode, &end, 0);
+    if (errno != 0 || end == inode || *end != ':')
+    {
+        fprintf(stderr, "[parse_filter] Bad dev:ino %s\n", inode);
+        return EXIT_FAILURE;
+    }
 
-    strncpy(dest, "/proc/", 7);
-    dest[6] = '\0';
+    const char* ino_str = end + 1;
+    unsigned long long ino = strtoull(ino_str, &end, 0);
+    if (errno != 0 || end == ino_str || *end != '\0')
+    {
+        fprintf(stderr, "[parse_filter] Bad dev:ino %s\n", inode);
+        return EXIT_FAILURE;
+    }
 
-    strncat(dest, pid_str, src_len);
-    dest[src_len  + 6] = '\0';
+    filter->dev = dev;
+    filter->ino = ino;
+    return 0;
+}
 
-    strncat(dest, "/fd", 4);
-    dest[dest_size - 1] = '\0';
+// "pos:\t123\nflags:\t0100002\n...", pos is decimal and flags octal
+static void parse_fdinfo(const char* buff, long long* pos, int* flags)
+{
+    const char* line = strstr(buff, "pos:");
+    if (line != NULL)
+        *pos = strtoll(line + 4, NULL, 10);
 
+    line = strstr(buff, "flags:");
+    if (line != NULL)
+        *flags = strtol(line + 6, NULL, 8);
+}
+
+// fdinfo of one fd read relative to the already open fdinfo directory
+static int read_fdinfo(int info_fd, const char* fd_name, long long* pos,
+                       int* flags)
+{
+    char buff[512];
+    int fd = openat(info_fd, fd_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t len = read(fd, buff, sizeof(buff) - 1);
+    close(fd);
+    if (len < 0)
+        return -1;
+
+    buff[len] = '\0';
+    parse_fdinfo(buff, pos, flags);
     return 0;
 }
 
-int print_opened_fds(const char* fd_path)
+// one fd of print_opened_fds, returns PROC_SCAN_STOP when the rest of the
+// table is not readable or the filter found its first holder
+static int print_fd(int dir_fd, const char* fd_name, void* arg)
 {
-    if (fd_path == NULL)
-        PRINT_ERROR("[print_opened_fds] Bad input fd_path\n");
+    fd_scan_t* scan = (fd_scan_t*) arg;
+    const scan_opts_t* opts = scan->opts;
+    fd_filter_t* filter = opts->filter;
+    int with_pid = opts->with_pid;
+
+    if (filter->first && __atomic_load_n(&filter->found, __ATOMIC_RELAXED))
+        return PROC_SCAN_STOP;
+
+    struct stat node_stat = {};
+    errno = 0;
+    if (fstatat(dir_fd, fd_name, &node_stat, 0) != 0)
+    {
+        // fd dir of another user's process can be listed but not read
+        if (with_pid && errno == EACCES)
+            return PROC_SCAN_STOP;
+        // fd was closed after it was listed, or its target is gone
+        if (errno == ENOENT || filter->enabled)
+            return 0;
+    }
+
+    if (filter->enabled &&
+        (node_stat.st_dev != filter->dev || node_stat.st_ino != filter->ino))
+        return 0;
+
+    char buff[PATH_MAX];
+    if (opts->with_name)
+    {
+        errno = 0;
+        ssize_t readed = readlinkat(dir_fd, fd_name, buff, PATH_MAX - 1);
+        if (readed < 0)
+        {
+            if (errno == ENOENT)
+                return 0;
+            if (with_pid && errno == EACCES)
+                return PROC_SCAN_STOP;
+            PRINT_ERROR("[print_fd] readlink failed\n");
+        }
+        buff[readed] = '\0';
+    }
+
+    if (filter->enabled)
+        __atomic_store_n(&filter->found, 1, __ATOMIC_RELAXED);
+
+    out_buff_t* out = scan->out;
+    int err = 0;
+    if (with_pid)
+        err = out_printf(out, "%6d ", scan->pid);
+    if (err == 0)
+        err = out_printf(out, "%10ld %5d %10ld", node_stat.st_ino,
+                         node_stat.st_uid, node_stat.st_size);
+
+    if (err == 0 && opts->with_fdinfo)
+    {
+        long long pos = -1;
+        int flags = 0;
+        if (scan->info_fd >= 0)
+            read_fdinfo(scan->info_fd, fd_name, &pos, &flags);
+        err = out_printf(out, " %6s %10lld %8o", fd_name, pos, flags);
+    }
+
+    // a socket's fd stats to the socket inode itself
+    const char* name = buff;
+    if (opts->with_name && opts->sockets != NULL &&
+        S_ISSOCK(node_stat.st_mode))
+    {
+        const char* desc = sock_table_find(opts->sockets, node_stat.st_ino);
+        if (desc != NULL)
+            name = desc;
+    }
+
+    if (err == 0)
+        err = out_printf(out, opts->with_name ? " %s\n" : "\n", name);
+    return err;
+}
+
+// appends fds of pid to out, a process which exited or is not ours to look
+// at yields nothing; costs one fstatat per fd plus readlinkat and fdinfo
+// only when their columns are printed
+int print_opened_fds(int proc_fd, int pid, const scan_opts_t* opts,
+                     char* dents, out_buff_t* out)
+{
+    if (opts == NULL || dents == NULL || out == NULL)
+    {
+        fprintf(stderr, "[print_opened_fds] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
 
     errno = 0;
-    int dir_fd = open(fd_path, O_RDONLY);
+    int dir_fd = proc_open_fd_dir(proc_fd, pid);
     if (dir_fd < 0)
+    {
+        if (opts->with_pid && proc_is_gone_errno())
+            return 0;
         PRINT_ERROR("[print_opened_fds] Open dir returned error\n");
+    }
+
+    fd_scan_t scan = {.pid = pid, .info_fd = -1, .opts = opts, .out = out};
+    if (opts->with_fdinfo)
+    {
+        char info_path[32];
+        snprintf(info_path, sizeof(info_path), "%d/fdinfo", pid);
+        scan.info_fd = openat(proc_fd, info_path,
+                              O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    int err = proc_scan_fd_dir(dir_fd, dents, print_fd, &scan);
+    // the process may exit while its table is read
+    if (err == -1)
+        err = 0;
+
+    if (scan.info_fd >= 0)
+        close(scan.info_fd);
+    close(dir_fd);
+    return err;
+}
+
+// header matching the columns print_opened_fds emits for opts
+void print_header(const scan_opts_t* opts)
+{
+    printf("%s  inode_ID   UID       SIZE%s%s\n",
+           opts->with_pid ? "   PID " : "",
+           opts->with_fdinfo ? "     FD        POS    FLAGS" : "",
+           opts->with_name ? "    NAME" : "");
+    fflush(stdout);
+}
+
+static void* worker_main(void* arg)
+{
+    lsof_worker_t* worker = (lsof_worker_t*) arg;
+    lsof_pool_t* pool = worker->pool;
+
+    fd_filter_t* filter = pool->opts->filter;
+    while (worker->err == 0 &&
+           !(filter->first && __atomic_load_n(&filter->found, __ATOMIC_RELAXED)))
+    {
+        size_t first = __atomic_fetch_add(&pool->next, PIDS_PER_TAKE,
+                                          __ATOMIC_RELAXED);
+        size_t num_pids = pool->snap->num_pids;
+        if (first >= num_pids)
+            break;
+
+        size_t last = first + PIDS_PER_TAKE;
+        if (last > num_pids)
+            last = num_pids;
+
+        // a process is appended whole, so its lines never interleave
+        for (size_t i = first; i < last && worker->err == 0; i++)
+        {
+            worker->err = print_opened_fds(pool->snap->proc_fd,
+                                           pool->snap->pids[i],
+                                           pool->opts, worker->dents,
+                                           &worker->out);
+            if (worker->err == 0 && worker->out.len >= OUT_FLUSH_SIZE)
+                worker->err = out_flush(&worker->out, &pool->out_lock);
+        }
+    }
+
+    if (worker->err == 0)
+        worker->err = out_flush(&worker->out, &pool->out_lock);
+    return NULL;
+}
+
+// lists fds of every process with up to num_threads workers
+int print_all_fds(proc_snapshot_t* snap, size_t num_threads,
+                  scan_opts_t* opts)
+{
+    if (proc_snapshot_list_pids(snap) != 0)
+        return EXIT_FAILURE;
+
+    lsof_pool_t pool = {.snap = snap, .opts = opts};
+    if (num_threads > snap->num_pids)
+        num_threads = snap->num_pids;
+    if (num_threads == 0)
+        num_threads = 1;
 
     errno = 0;
-    DIR* proc_dir = fdopendir(dir_fd);
-    if (errno < 0)
-        PRINT_ERROR("[print_opened_fds] Open dir stream by dir fd failed\n");
+    lsof_worker_t* workers = (lsof_worker_t*) calloc(num_threads,
+                                                     sizeof(lsof_worker_t));
+    if (workers == NULL)
+        PRINT_ERROR("[print_all_fds] Allocation of workers failed\n");
+
+    print_header(opts);
+
+    pthread_mutex_init(&pool.out_lock, NULL);
+    size_t num_started = 0;
+    int err = 0;
+    for (; num_started < num_threads; num_started++)
+    {
+        workers[num_started].pool = &pool;
+        workers[num_started].dents = proc_get_buff(snap);
+        if (workers[num_started].dents == NULL ||
+            pthread_create(&workers[num_started].thread, NULL, worker_main,
+                           &workers[num_started]) != 0)
+        {
+            fprintf(stderr, "[print_all_fds] Starting worker failed\n");
+            proc_put_buff(snap, workers[num_started].dents);
+            err = EXIT_FAILURE;
+            break;
+        }
+    }
+
+    // the running workers still cover every pid
+    if (num_started > 0)
+        err = 0;
+
+    for (size_t i = 0; i < num_started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        err |= workers[i].err;
+        free(workers[i].out.data);
+        proc_put_buff(snap, workers[i].dents);
+    }
+
+    pthread_mutex_destroy(&pool.out_lock);
+    free(workers);
+    return err;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+// socket resolution through NETLINK_SOCK_DIAG
+
+static const char* tcp_states[] =
+{
+    "", "ESTABLISHED", "SYN_SENT", "SYN_RECV", "FIN_WAIT1", "FIN_WAIT2",
+    "TIME_WAIT", "CLOSE", "CLOSE_WAIT", "LAST_ACK", "LISTEN", "CLOSING",
+    "NEW_SYN_RECV"
+};
+
+static size_t hash_inode(unsigned long inode, size_t cap)
+{
+    return ((inode * 11400714819323198485ull) >> 32) & (cap - 1);
+}
+
+static sock_info_t* sock_table_slot(sock_info_t* entries, size_t cap,
+                                    unsigned long inode)
+{
+    size_t pos = hash_inode(inode, cap);
+    while (entries[pos].inode != 0 && entries[pos].inode != inode)
+        pos = (pos + 1) & (cap - 1);
+
+    return &entries[pos];
+}
+
+static sock_info_t* sock_table_add(sock_table_t* table, unsigned long inode)
+{
+    if (2 * (table->num + 1) > table->cap)
+    {
+        size_t new_cap = table->cap ? 2 * table->cap : 1024;
+        errno = 0;
+        sock_info_t* entries = (sock_info_t*) calloc(new_cap,
+                                                     sizeof(sock_info_t));
+        if (entries == NULL)
+        {
+            perror("[sock_table_add] Allocation failed\n");
+            return NULL;
+        }
+
+        for (size_t i = 0; i < table->cap; i++)
+            if (table->entries[i].inode != 0)
+                *sock_table_slot(entries, new_cap, table->entries[i].inode) =
+                    table->entries[i];
+
+        free(table->entries);
+        table->entries = entries;
+        table->cap     = new_cap;
+    }
+
+    sock_info_t* entry = sock_table_slot(table->entries, table->cap, inode);
+    if (entry->inode == 0)
+    {
+        entry->inode = inode;
+        table->num++;
+    }
+    return entry;
+}
+
+const char* sock_table_find(const sock_table_t* table, unsigned long inode)
+{
+    if (table == NULL || table->cap == 0 || inode == 0)
+        return NULL;
+
+    sock_info_t* entry = sock_table_slot(table->entries, table->cap, inode);
+    return (entry->inode == inode) ? entry->desc : NULL;
+}
+
+void sock_table_free(sock_table_t* table)
+{
+    if (table == NULL)
+        return;
+
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+static void format_inet_addr(char* dest, size_t dest_size, int family,
+                             const __be32* addr, __be16 port)
+{
+    char host[INET6_ADDRSTRLEN];
+    inet_ntop(family, addr, host, sizeof(host));
+    snprintf(dest, dest_size, (family == AF_INET6) ? "[%s]:%u" : "%s:%u",
+             host, ntohs(port));
+}
+
+static int add_inet_sock(sock_table_t* table, int protocol,
+                         const struct inet_diag_msg* msg)
+{
+    // TIME_WAIT and other orphans have no inode, nothing can refer to them
+    // and 0 marks a free slot of the table
+    if (msg->idiag_inode == 0)
+        return 0;
+
+    sock_info_t* entry = sock_table_add(table, msg->idiag_inode);
+    if (entry == NULL)
+        return EXIT_FAILURE;
+
+    char local[INET6_ADDRSTRLEN + 8];
+    char remote[INET6_ADDRSTRLEN + 8];
+    format_inet_addr(local, sizeof(local), msg->idiag_family,
+                     msg->id.idiag_src, msg->id.idiag_sport);
+    format_inet_addr(remote, sizeof(remote), msg->idiag_family,
+                     msg->id.idiag_dst, msg->id.idiag_dport);
+
+    const char* proto = (protocol == IPPROTO_TCP) ?
+                        ((msg->idiag_family == AF_INET6) ? "TCP6" : "TCP") :
+                        ((msg->idiag_family == AF_INET6) ? "UDP6" : "UDP");
+    int connected = (msg->id.idiag_dport != 0);
+    const char* state = (protocol == IPPROTO_TCP &&
+                         msg->idiag_state < sizeof(tcp_states) /
+                                            sizeof(tcp_states[0])) ?
+                        tcp_states[msg->idiag_state] : "";
+
+    snprintf(entry->desc, SOCK_DESC_LEN, "%s %s%s%s%s%s%s", proto, local,
+             connected ? "->" : "", connected ? remote : "",
+             *state ? " (" : "", state, *state ? ")" : "");
+    return 0;
+}
+
+static int add_unix_sock(sock_table_t* table, const struct unix_diag_msg* msg,
+                         size_t len)
+{
+    // see add_inet_sock()
+    if (msg->udiag_ino == 0)
+        return 0;
+
+    sock_info_t* entry = sock_table_add(table, msg->udiag_ino);
+    if (entry == NULL)
+        return EXIT_FAILURE;
+
+    const char* path = "";
+    int path_len = 0;
+    unsigned peer = 0;
+
+    // attributes follow the fixed header, each padded to 4 bytes
+    const char* pos = (const char*)(msg + 1);
+    const char* end = (const char*)msg + len;
+    while (pos + sizeof(struct nlattr) <= end)
+    {
+        const struct nlattr* attr = (const struct nlattr*) pos;
+        if (attr->nla_len < sizeof(struct nlattr) || pos + attr->nla_len > end)
+            break;
+
+        const char* data = pos + NLA_HDRLEN;
+        int data_len = attr->nla_len - NLA_HDRLEN;
+        if (attr->nla_type == UNIX_DIAG_NAME && data_len > 0)
+        {
+            // abstract names start with NUL, shown as '@' like ss does
+            path = data;
+            path_len = data_len;
+        }
+        else if (attr->nla_type == UNIX_DIAG_PEER && data_len >= 4)
+            memcpy(&peer, data, sizeof(peer));
+
+        pos += NLA_ALIGN(attr->nla_len);
+    }
+
+    const char* type = (msg->udiag_type == SOCK_STREAM) ? "STREAM" :
+                       (msg->udiag_type == SOCK_DGRAM) ? "DGRAM" : "SEQPACKET";
+    int written = snprintf(entry->desc, SOCK_DESC_LEN, "UNIX %s%s%s%.*s", type,
+                           path_len ? " " : "",
+                           (path_len && path[0] == '\0') ? "@" : "",
+                           (path_len && path[0] == '\0') ? path_len - 1 :
+                                                           path_len,
+                           (path_len && path[0] == '\0') ? path + 1 : path);
+    if (peer != 0 && written > 0 && written < SOCK_DESC_LEN)
+        snprintf(entry->desc + written, SOCK_DESC_LEN - written, " ->%u", peer);
+    return 0;
+}
+
+// sends one dump request and files every reply message into table
+static int diag_dump(int sock, sock_table_t* table, char* buff,
+                     const void* req, size_t req_len, int family, int protocol)
+{
+    struct
+    {
+        struct nlmsghdr header;
+        char            body[sizeof(struct inet_diag_req_v2)];
+    } msg = {};
+    msg.header.nlmsg_len   = NLMSG_LENGTH(req_len);
+    msg.header.nlmsg_type  = SOCK_DIAG_BY_FAMILY;
+    msg.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    memcpy(msg.body, req, req_len);
+
+    struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
     errno = 0;
-    struct dirent* entry_ptr = readdir(proc_dir);
-    if (errno < 0)
-        PRINT_ERROR("[print_opened_fds] Init readdir returned error");
+    if (sendto(sock, &msg, msg.header.nlmsg_len, 0,
+               (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+        PRINT_ERROR("[diag_dump] sendto failed\n");
 
-    printf("  inode_ID   UID       SIZE    NAME\n");
-    while(entry_ptr != NULL)
+    while (1)
     {
-        if (entry_ptr->d_type == DT_LNK)
+        errno = 0;
+        ssize_t len = recv(sock, buff, DIAG_BUFF_SIZE, 0);
+        if (len < 0)
         {
-            char buff[PATH_MAX] = {};
-            errno = 0;
-            ssize_t readed = readlinkat(dir_fd, entry_ptr->d_name,
-                                        buff, PATH_MAX);
-            if (readed < 0)
+            if (errno == EINTR)
+                continue;
+            PRINT_ERROR("[diag_dump] recv failed\n");
+        }
+
+        for (struct nlmsghdr* header = (struct nlmsghdr*) buff;
+             NLMSG_OK(header, len); header = NLMSG_NEXT(header, len))
+        {
+            if (header->nlmsg_type == NLMSG_DONE)
+                return 0;
+
+            if (header->nlmsg_type == NLMSG_ERROR)
             {
-                closedir(proc_dir);
-                close(dir_fd);
-                PRINT_ERROR("[print_opened_fds] readlink failed\n");
+                const struct nlmsgerr* error = NLMSG_DATA(header);
+                // protocol not compiled in, nothing to resolve
+                if (error->error == -ENOENT)
+                    return 0;
+
+                errno = -error->error;
+                PRINT_ERROR("[diag_dump] Kernel refused the dump\n");
             }
 
-            struct stat node_stat;
-            fstatat(dir_fd, entry_ptr->d_name, &node_stat, 0);
-            printf("%10ld %5d %10ld %s\n",
-                   node_stat.st_ino, node_stat.st_uid, node_stat.st_size, buff);
+            int err = (family == AF_UNIX) ?
+                      add_unix_sock(table, NLMSG_DATA(header),
+                                    header->nlmsg_len - NLMSG_HDRLEN) :
+                      add_inet_sock(table, protocol, NLMSG_DATA(header));
+            if (err != 0)
+                return EXIT_FAILURE;
         }
+    }
+}
 
-        errno = 0;
-        entry_ptr = readdir(proc_dir);
+// dumps TCP and UDP over IPv4 and IPv6 and unix sockets of the host
+int sock_table_load(sock_table_t* table)
+{
+    if (table == NULL)
+    {
+        fprintf(stderr, "[sock_table_load] Bad input pointer\n");
+        return EXIT_FAILURE;
     }
 
-    closedir(proc_dir);
-    close(dir_fd);
+    errno = 0;
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                      NETLINK_SOCK_DIAG);
+    if (sock < 0)
+        PRINT_ERROR("[sock_table_load] Open sock_diag socket failed\n");
+
+    errno = 0;
+    char* buff = (char*) malloc(DIAG_BUFF_SIZE);
+    if (buff == NULL)
+    {
+        close(sock);
+        PRINT_ERROR("[sock_table_load] Allocation of buffer failed\n");
+    }
+
+    static const int families[]  = {AF_INET, AF_INET6};
+    static const int protocols[] = {IPPROTO_TCP, IPPROTO_UDP};
 
+    int err = 0;
+    for (int i = 0; err == 0 && i < 2; i++)
+        for (int j = 0; err == 0 && j < 2; j++)
+        {
+            struct inet_diag_req_v2 req = {
+                .sdiag_family   = families[i],
+                .sdiag_protocol = protocols[j],
+                .idiag_states   = ~0u,
+            };
+            err = diag_dump(sock, table, buff, &req, sizeof(req),
+                            families[i], protocols[j]);
+        }
+
+    if (err == 0)
+    {
+        struct unix_diag_req req = {
+            .sdiag_family = AF_UNIX,
+            .udiag_states = ~0u,
+            .udiag_show   = UDIAG_SHOW_NAME | UDIAG_SHOW_PEER,
+        };
+        err = diag_dump(sock, table, buff, &req, sizeof(req), AF_UNIX, 0);
+    }
+
+    free(buff);
+    close(sock);
+    if (err != 0)
+        sock_table_free(table);
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// fd leak tracking
+
+static const char* fd_type_names[NUM_FD_TYPES] =
+{
+    "REG", "DIR", "CHR", "BLK", "FIFO", "SOCK", "LNK", "ANON"
+};
+
+static int fd_type(mode_t mode)
+{
+    switch (mode & S_IFMT)
+    {
+        case S_IFREG:  return FD_REG;
+        case S_IFDIR:  return FD_DIR;
+        case S_IFCHR:  return FD_CHR;
+        case S_IFBLK:  return FD_BLK;
+        case S_IFIFO:  return FD_FIFO;
+        case S_IFSOCK: return FD_SOCK;
+        case S_IFLNK:  return FD_LNK;
+        // anon_inode fds (eventfd, epoll, ...) carry no file type
+        default:       return FD_ANON;
+    }
+}
+
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t hash_fd(int fd, unsigned long ino, size_t cap)
+{
+    unsigned long long key = ((unsigned long long) ino << 20) ^ (unsigned) fd;
+    return ((key * 11400714819323198485ull) >> 32) & (cap - 1);
+}
+
+static fd_entry_t* fd_set_slot(fd_entry_t* entries, size_t cap, int fd,
+                               unsigned long ino)
+{
+    size_t pos = hash_fd(fd, ino, cap);
+    while (entries[pos].fd != -1 &&
+           (entries[pos].fd != fd || entries[pos].ino != ino))
+        pos = (pos + 1) & (cap - 1);
+
+    return &entries[pos];
+}
+
+static int fd_set_grow(fd_set_table_t* set)
+{
+    size_t new_cap = set->cap ? 2 * set->cap : FD_SET_SIZE;
+    errno = 0;
+    fd_entry_t* entries = (fd_entry_t*) malloc(new_cap * sizeof(fd_entry_t));
+    if (entries == NULL)
+        PRINT_ERROR("[fd_set_grow] Allocation failed\n");
+
+    for (size_t i = 0; i < new_cap; i++)
+        entries[i].fd = -1;
+
+    for (size_t i = 0; i < set->cap; i++)
+        if (set->entries[i].fd != -1)
+            *fd_set_slot(entries, new_cap, set->entries[i].fd,
+                         set->entries[i].ino) = set->entries[i];
+
+    free(set->entries);
+    set->entries = entries;
+    set->cap     = new_cap;
     return 0;
 }
+
+// backward shift deletion keeps probe chains intact without tombstones
+static void fd_set_remove(fd_set_table_t* set, fd_entry_t* entry)
+{
+    size_t mask = set->cap - 1;
+    size_t hole = entry - set->entries;
+    size_t pos  = hole;
+    free(entry->name);
+    while (1)
+    {
+        pos = (pos + 1) & mask;
+        fd_entry_t* next = &set->entries[pos];
+        if (next->fd == -1)
+            break;
+
+        size_t home = hash_fd(next->fd, next->ino, set->cap);
+        if (((pos - home) & mask) >= ((pos - hole) & mask))
+        {
+            set->entries[hole] = *next;
+            hole = pos;
+        }
+    }
+
+    set->entries[hole].fd = -1;
+    set->num--;
+}
+
+static void fd_set_free(fd_set_table_t* set)
+{
+    for (size_t i = 0; i < set->cap; i++)
+        if (set->entries[i].fd != -1)
+            free(set->entries[i].name);
+
+    free(set->entries);
+    memset(set, 0, sizeof(*set));
+}
+
+// one watch tick, handed to watch_fd for every fd
+typedef struct watch_scan
+{
+    fd_set_table_t* set;
+    unsigned long   tick;
+    size_t*         counts;
+    int             quiet;
+} watch_scan_t;
+
+// marks an fd seen this tick, a new one is resolved and printed
+static int watch_fd(int dir_fd, const char* fd_name, void* arg)
+{
+    watch_scan_t* scan = (watch_scan_t*) arg;
+    fd_set_table_t* set = scan->set;
+
+    struct stat node_stat;
+    if (fstatat(dir_fd, fd_name, &node_stat, 0) != 0)
+        return 0;
+
+    if (2 * (set->num + 1) > set->cap && fd_set_grow(set) != 0)
+        return EXIT_FAILURE;
+
+    int fd = atoi(fd_name);
+    fd_entry_t* slot = fd_set_slot(set->entries, set->cap, fd,
+                                   node_stat.st_ino);
+    if (slot->fd == -1)
+    {
+        char buff[PATH_MAX];
+        ssize_t readed = readlinkat(dir_fd, fd_name, buff, PATH_MAX - 1);
+        buff[readed < 0 ? 0 : readed] = '\0';
+
+        slot->fd   = fd;
+        slot->ino  = node_stat.st_ino;
+        slot->type = fd_type(node_stat.st_mode);
+        slot->name = strdup(buff);
+        set->num++;
+        if (!scan->quiet)
+            printf("+%6d %10lu %-4s %s\n", fd, slot->ino,
+                   fd_type_names[slot->type], slot->name ? slot->name : "");
+    }
+
+    slot->tick = scan->tick;
+    scan->counts[slot->type]++;
+    return 0;
+}
+
+// prints fds opened and closed by pid every interval seconds with per type
+// counts, count < 0 is endless
+int watch_fds(int proc_fd, int pid, double interval, long count)
+{
+    errno = 0;
+    int dir_fd = proc_open_fd_dir(proc_fd, pid);
+    if (dir_fd < 0)
+        PRINT_ERROR("[watch_fds] Open dir returned error\n");
+
+    errno = 0;
+    char* dents = (char*) malloc(PROC_BUFF_SIZE);
+    if (dents == NULL)
+    {
+        close(dir_fd);
+        PRINT_ERROR("[watch_fds] Allocation of dents buffer failed\n");
+    }
+
+    fd_set_table_t set = {};
+    int err = fd_set_grow(&set);
+    double deadline = now_seconds();
+    for (unsigned long tick = 1; err == 0; tick++)
+    {
+        size_t counts[NUM_FD_TYPES] = {};
+        watch_scan_t scan = {.set = &set, .tick = tick, .counts = counts,
+                             .quiet = (tick == 1)};
+        err = proc_scan_fd_dir(dir_fd, dents, watch_fd, &scan);
+        if (err == -1)
+        {
+            // the directory of an exited process reads as gone
+            printf("--- process %d exited\n", pid);
+            err = 0;
+            break;
+        }
+
+        // whatever was not seen this tick was closed, a shift can wrap an
+        // unvisited entry to the front so passes repeat until nothing moves
+        for (int removed = 1; err == 0 && removed;)
+        {
+            removed = 0;
+            for (size_t i = 0; i < set.cap;)
+            {
+                fd_entry_t* entry = &set.entries[i];
+                if (entry->fd == -1 || entry->tick == tick)
+                {
+                    i++;
+                    continue;
+                }
+
+                printf("-%6d %10lu %-4s %s\n", entry->fd, entry->ino,
+                       fd_type_names[entry->type],
+                       entry->name ? entry->name : "");
+                fd_set_remove(&set, entry);
+                removed = 1;
+            }
+        }
+
+        printf("--- %.3f fds %zu", now_seconds(), set.num);
+        for (int type = 0; type < NUM_FD_TYPES; type++)
+            if (counts[type] != 0)
+                printf(" %s %zu", fd_type_names[type], counts[type]);
+        printf("\n");
+        fflush(stdout);
+
+        if (err != 0 || (count >= 0 && tick >= (unsigned long)count))
+            break;
+
+        // sleep to an absolute deadline so ticks don't drift
+        deadline += interval;
+        struct timespec ts;
+        ts.tv_sec  = (time_t) deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR)
+            ;
+    }
+
+    fd_set_free(&set);
+    free(dents);
+    close(dir_fd);
+    return err;
+}
@@ -0,0 +1,692 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../proc/proc_snapshot.h"
+
+#define COMM_LEN        64
+// pids taken by a worker at once, smaps cost varies a lot so keep it small
+#define PIDS_PER_TAKE   16
+#define PIDS_PER_THREAD 64
+#define MAX_THREADS     64
+// initial size of a file table, power of 2
+#define FILE_TABLE_SIZE 1024
+// name of mappings without a file
+#define ANON_NAME       "[anon]"
+
+// kB as printed in smaps
+typedef struct mem_usage
+{
+    unsigned long size;
+    unsigned long rss;
+    unsigned long pss;
+    unsigned long swap;
+} mem_usage_t;
+
+typedef struct proc_mem
+{
+    int         pid;
+    mem_usage_t usage;
+    char        comm[COMM_LEN];
+} proc_mem_t;
+
+typedef struct proc_mem_list
+{
+    proc_mem_t* procs;
+    size_t      num;
+    size_t      cap;
+} proc_mem_list_t;
+
+// usage of one mapped file summed over processes
+typedef struct file_entry
+{
+    const char* path;      // NULL marks a free slot
+    size_t      path_len;
+    size_t      num_procs;
+    int         last_pid;  // counts every process once
+    mem_usage_t usage;
+} file_entry_t;
+
+typedef struct file_table
+{
+    file_entry_t* entries;
+    size_t        cap;     // power of 2
+    size_t        num;
+    proc_arena_t  paths;
+} file_table_t;
+
+// one mapping of a smaps file, path points into the read buffer
+typedef void (*mapping_cb_t)(const char* path, size_t path_len,
+                             const mem_usage_t* usage, void* ctx);
+
+struct mem_pool;
+
+// every worker reads into its own buffer and tables, merged at the end
+typedef struct mem_worker
+{
+    pthread_t        thread;
+    struct mem_pool* pool;
+    char*            buff;
+    size_t           buff_cap;
+    proc_mem_list_t  list;
+    file_table_t     files;
+    int              err;
+} mem_worker_t;
+
+typedef struct mem_pool
+{
+    proc_snapshot_t* snap;
+    int              by_file;
+    const char*      match;
+    size_t           next;     // next pid index to take, atomic
+} mem_pool_t;
+
+// smaps_rollup appeared in 4.14, older kernels sum smaps instead
+static int have_rollup = 0;
+
+void parse_smaps(const char* data, size_t len, mapping_cb_t cb, void* ctx);
+int maps_match(const char* data, size_t len, const char* match);
+int collect_proc(proc_snapshot_t* snap, int pid, int by_file,
+                 const char* match, char** buff, size_t* buff_cap,
+                 proc_mem_list_t* list, file_table_t* files);
+int collect_all(proc_snapshot_t* snap, size_t num_threads, int by_file,
+                const char* match, proc_mem_list_t* list,
+                file_table_t* files);
+int file_table_add(file_table_t* table, const char* path, size_t path_len,
+                   int pid, size_t num_procs, const mem_usage_t* usage);
+void file_table_free(file_table_t* table);
+void print_procs(const proc_mem_list_t* list);
+int print_files(const file_table_t* files, long top);
+
+int main(int argc, char* argv[])
+{
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int by_file = 0;
+    long top = -1;
+    const char* match = NULL;
+
+    proc_snapshot_t snap;
+    if (proc_snapshot_open(&snap) != 0)
+        return EXIT_FAILURE;
+
+    for (int i = 1; i < argc; i++)
+    {
+        char* end = NULL;
+        if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0)
+            && i + 1 < argc)
+            num_threads = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--by-file") == 0)
+            by_file = 1;
+        else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc)
+            top = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--match") == 0 && i + 1 < argc)
+        {
+            by_file = 1;
+            match = argv[++i];
+        }
+        else if (argv[i][0] != '-' &&
+                 (errno = 0, strtol(argv[i], &end, 10)) > 0 &&
+                 errno == 0 && *end == '\0')
+        {
+            if (proc_snapshot_add_pid(&snap, atoi(argv[i])) != 0)
+            {
+                proc_snapshot_close(&snap);
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-j|--threads num] "
+                            "[--by-file [--top n] | --match substr] "
+                            "[pid ...]\n",
+                    argv[0]);
+            proc_snapshot_close(&snap);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    have_rollup = faccessat(snap.proc_fd, "self/smaps_rollup", R_OK, 0) == 0;
+
+    // no pids given reads every process
+    if (snap.num_pids == 0 && proc_snapshot_list_pids(&snap) != 0)
+    {
+        proc_snapshot_close(&snap);
+        return EXIT_FAILURE;
+    }
+
+    proc_mem_list_t list = {};
+    file_table_t files = {};
+    int err = collect_all(&snap, num_threads, by_file, match, &list, &files);
+    if (err == 0)
+    {
+        if (by_file)
+            err = print_files(&files, top);
+        else
+            print_procs(&list);
+    }
+
+    free(list.procs);
+    file_table_free(&files);
+    proc_snapshot_close(&snap);
+    return err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// parsing, everything is read in place from the buffer
+////////////////////////////////////////////////////////////////////////////////
+static int is_hex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+}
+
+// path of a "start-end perms offset dev inode [path]" line, empty for anon
+static const char* header_path(const char* line, const char* eol,
+                               size_t* path_len)
+{
+    const char* pos = line;
+    for (int field = 0; field < 5 && pos < eol; field++)
+    {
+        while (pos < eol && *pos != ' ')
+            pos++;
+        while (pos < eol && *pos == ' ')
+            pos++;
+    }
+
+    *path_len = eol - pos;
+    return pos;
+}
+
+// "Rss:     123 kB" with key "Rss:", the value is left alone on mismatch
+static void field_kb(const char* line, const char* eol, const char* key,
+                     size_t key_len, unsigned long* value)
+{
+    if ((size_t)(eol - line) <= key_len || memcmp(line, key, key_len) != 0)
+        return;
+
+    const char* pos = line + key_len;
+    while (pos < eol && *pos == ' ')
+        pos++;
+
+    unsigned long kb = 0;
+    for (; pos < eol && *pos >= '0' && *pos <= '9'; pos++)
+        kb = 10 * kb + (*pos - '0');
+    *value = kb;
+}
+
+#define FIELD_KB(line, eol, key, value) \
+    field_kb(line, eol, key, sizeof(key) - 1, value)
+
+// calls cb for every mapping of smaps or smaps_rollup text; header lines
+// start with a lowercase hex address, field lines with an uppercase key
+void parse_smaps(const char* data, size_t len, mapping_cb_t cb, void* ctx)
+{
+    const char* end = data + len;
+    const char* path = NULL;
+    size_t path_len = 0;
+    mem_usage_t usage = {};
+    int in_mapping = 0;
+
+    for (const char* line = data; line < end;)
+    {
+        const char* eol = (const char*) memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        if (is_hex(*line))
+        {
+            if (in_mapping)
+                cb(path, path_len, &usage, ctx);
+
+            path = header_path(line, eol, &path_len);
+            memset(&usage, 0, sizeof(usage));
+            in_mapping = 1;
+        }
+        else
+        {
+            switch (*line)
+            {
+                case 'S':
+                    FIELD_KB(line, eol, "Size:", &usage.size);
+                    FIELD_KB(line, eol, "Swap:", &usage.swap);
+                    break;
+                case 'R':
+                    FIELD_KB(line, eol, "Rss:", &usage.rss);
+                    break;
+                case 'P':
+                    FIELD_KB(line, eol, "Pss:", &usage.pss);
+                    break;
+            }
+        }
+
+        line = eol + 1;
+    }
+
+    if (in_mapping)
+        cb(path, path_len, &usage, ctx);
+}
+
+// whether any mapping path of maps text contains match
+int maps_match(const char* data, size_t len, const char* match)
+{
+    const char* end = data + len;
+    size_t match_len = strlen(match);
+
+    for (const char* line = data; line < end;)
+    {
+        const char* eol = (const char*) memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+
+        size_t path_len = 0;
+        const char* path = header_path(line, eol, &path_len);
+        if (memmem(path, path_len, match, match_len) != NULL)
+            return 1;
+
+        line = eol + 1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// collection
+////////////////////////////////////////////////////////////////////////////////
+static void add_usage(mem_usage_t* sum, const mem_usage_t* usage)
+{
+    sum->size += usage->size;
+    sum->rss  += usage->rss;
+    sum->pss  += usage->pss;
+    sum->swap += usage->swap;
+}
+
+static void sum_mapping(const char* path, size_t path_len,
+                        const mem_usage_t* usage, void* ctx)
+{
+    add_usage((mem_usage_t*) ctx, usage);
+}
+
+typedef struct file_scan
+{
+    file_table_t* files;
+    int           pid;
+    const char*   match;
+    int           err;
+} file_scan_t;
+
+static void file_mapping(const char* path, size_t path_len,
+                         const mem_usage_t* usage, void* ctx)
+{
+    file_scan_t* scan = (file_scan_t*) ctx;
+    if (scan->err != 0)
+        return;
+
+    if (path_len == 0)
+    {
+        path = ANON_NAME;
+        path_len = sizeof(ANON_NAME) - 1;
+    }
+
+    if (scan->match != NULL &&
+        memmem(path, path_len, scan->match, strlen(scan->match)) == NULL)
+        return;
+
+    scan->err = file_table_add(scan->files, path, path_len, scan->pid, 1,
+                               usage);
+}
+
+static int list_add(proc_mem_list_t* list, const proc_mem_t* proc)
+{
+    if (list->num == list->cap)
+    {
+        size_t new_cap = (list->cap == 0) ? 256 : 2 * list->cap;
+        errno = 0;
+        proc_mem_t* procs = (proc_mem_t*) realloc(list->procs,
+                                                  new_cap * sizeof(proc_mem_t));
+        if (procs == NULL)
+            PRINT_ERROR("[list_add] Reallocation failed\n");
+        list->procs = procs;
+        list->cap   = new_cap;
+    }
+
+    list->procs[list->num++] = *proc;
+    return 0;
+}
+
+// reads one process, a process which exited or is not ours to look at or a
+// kernel thread without mappings yields nothing
+int collect_proc(proc_snapshot_t* snap, int pid, int by_file,
+                 const char* match, char** buff, size_t* buff_cap,
+                 proc_mem_list_t* list, file_table_t* files)
+{
+    // maps costs no page table walk, skip smaps of processes not matching
+    if (match != NULL)
+    {
+        ssize_t len = proc_read_all(snap->proc_fd, pid, "maps", buff,
+                                    buff_cap);
+        if (len < 0)
+        {
+            if (proc_is_gone_errno())
+                return 0;
+            PRINT_ERROR("[collect_proc] Reading maps failed\n");
+        }
+        if (!maps_match(*buff, len, match))
+            return 0;
+    }
+
+    const char* name = (by_file || !have_rollup) ? "smaps" : "smaps_rollup";
+    ssize_t len = proc_read_all(snap->proc_fd, pid, name, buff, buff_cap);
+    if (len < 0)
+    {
+        if (proc_is_gone_errno())
+            return 0;
+        PRINT_ERROR("[collect_proc] Reading smaps failed\n");
+    }
+    if (len == 0)
+        return 0;
+
+    if (by_file)
+    {
+        file_scan_t scan = {.files = files, .pid = pid, .match = match};
+        parse_smaps(*buff, len, file_mapping, &scan);
+        return scan.err;
+    }
+
+    proc_mem_t proc = {.pid = pid};
+    parse_smaps(*buff, len, sum_mapping, &proc.usage);
+
+    char comm[COMM_LEN];
+    ssize_t comm_len = proc_read_file(snap->proc_fd, pid, "comm", comm,
+                                      sizeof(comm));
+    if (comm_len > 0 && comm[comm_len - 1] == '\n')
+        comm[--comm_len] = '\0';
+    if (comm_len > 0)
+        memcpy(proc.comm, comm, comm_len + 1);
+
+    return list_add(list, &proc);
+}
+
+static void* worker_main(void* arg)
+{
+    mem_worker_t* worker = (mem_worker_t*) arg;
+    mem_pool_t* pool = worker->pool;
+    size_t num_pids = pool->snap->num_pids;
+
+    while (worker->err == 0)
+    {
+        size_t first = __atomic_fetch_add(&pool->next, PIDS_PER_TAKE,
+                                          __ATOMIC_RELAXED);
+        if (first >= num_pids)
+            break;
+
+        size_t last = first + PIDS_PER_TAKE;
+        if (last > num_pids)
+            last = num_pids;
+
+        for (size_t i = first; i < last && worker->err == 0; i++)
+            worker->err = collect_proc(pool->snap, pool->snap->pids[i],
+                                       pool->by_file, pool->match,
+                                       &worker->buff, &worker->buff_cap,
+                                       &worker->list, &worker->files);
+    }
+
+    return NULL;
+}
+
+static int cmp_procs(const void* lhs, const void* rhs)
+{
+    int lhs_pid = ((const proc_mem_t*)lhs)->pid;
+    int rhs_pid = ((const proc_mem_t*)rhs)->pid;
+    return (lhs_pid > rhs_pid) - (lhs_pid < rhs_pid);
+}
+
+// moves the workers' results into list and files, list is sorted by pid
+static int merge_worker(mem_worker_t* worker, proc_mem_list_t* list,
+                        file_table_t* files)
+{
+    for (size_t i = 0; i < worker->list.num; i++)
+        if (list_add(list, &worker->list.procs[i]) != 0)
+            return EXIT_FAILURE;
+
+    // a pid is read by one worker only, so process counts just add up
+    for (size_t i = 0; i < worker->files.cap; i++)
+    {
+        file_entry_t* entry = &worker->files.entries[i];
+        if (entry->path != NULL &&
+            file_table_add(files, entry->path, entry->path_len, 0,
+                           entry->num_procs, &entry->usage) != 0)
+            return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+
+// reads all listed pids with up to num_threads workers
+int collect_all(proc_snapshot_t* snap, size_t num_threads, int by_file,
+                const char* match, proc_mem_list_t* list,
+                file_table_t* files)
+{
+    if (snap == NULL || list == NULL || files == NULL)
+    {
+        fprintf(stderr, "[collect_all] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    // pool overhead is not worth it for a handful of processes
+    size_t max_threads = snap->num_pids / PIDS_PER_THREAD;
+    if (num_threads > max_threads)
+        num_threads = max_threads;
+    if (num_threads == 0)
+        num_threads = 1;
+
+    mem_pool_t pool = {.snap = snap, .by_file = by_file, .match = match};
+
+    errno = 0;
+    mem_worker_t* workers = (mem_worker_t*) calloc(num_threads,
+                                                   sizeof(mem_worker_t));
+    if (workers == NULL)
+        PRINT_ERROR("[collect_all] Allocation of workers failed\n");
+
+    // a single worker runs on the calling thread
+    size_t num_started = 0;
+    int err = 0;
+    if (num_threads == 1)
+    {
+        workers[0].pool = &pool;
+        worker_main(&workers[0]);
+        num_started = 1;
+    }
+    else
+    {
+        for (; num_started < num_threads; num_started++)
+        {
+            workers[num_started].pool = &pool;
+            if (pthread_create(&workers[num_started].thread, NULL,
+                               worker_main, &workers[num_started]) != 0)
+            {
+                fprintf(stderr, "[collect_all] Starting worker failed\n");
+                err = EXIT_FAILURE;
+                break;
+            }
+        }
+
+        // the running workers still cover every pid
+        if (num_started > 0)
+            err = 0;
+
+        for (size_t i = 0; i < num_started; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < num_started; i++)
+    {
+        err |= workers[i].err;
+        if (err == 0)
+            err = merge_worker(&workers[i], list, files);
+
+        free(workers[i].buff);
+        free(workers[i].list.procs);
+        file_table_free(&workers[i].files);
+    }
+
+    free(workers);
+    if (err != 0)
+        return EXIT_FAILURE;
+
+    qsort(list->procs, list->num, sizeof(proc_mem_t), cmp_procs);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// file table, open addressing with linear probing
+////////////////////////////////////////////////////////////////////////////////
+// FNV-1a
+static size_t hash_path(const char* path, size_t path_len)
+{
+    size_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < path_len; i++)
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ull;
+    return hash;
+}
+
+static file_entry_t* file_table_slot(file_entry_t* entries, size_t cap,
+                                     const char* path, size_t path_len)
+{
+    size_t pos = hash_path(path, path_len) & (cap - 1);
+    while (entries[pos].path != NULL &&
+           (entries[pos].path_len != path_len ||
+            memcmp(entries[pos].path, path, path_len) != 0))
+        pos = (pos + 1) & (cap - 1);
+
+    return &entries[pos];
+}
+
+static int file_table_grow(file_table_t* table)
+{
+    size_t new_cap = table->cap ? 2 * table->cap : FILE_TABLE_SIZE;
+    errno = 0;
+    file_entry_t* entries = (file_entry_t*) calloc(new_cap,
+                                                   sizeof(file_entry_t));
+    if (entries == NULL)
+        PRINT_ERROR("[file_table_grow] Allocation failed\n");
+
+    for (size_t i = 0; i < table->cap; i++)
+    {
+        file_entry_t* entry = &table->entries[i];
+        if (entry->path != NULL)
+            *file_table_slot(entries, new_cap, entry->path,
+                             entry->path_len) = *entry;
+    }
+
+    free(table->entries);
+    table->entries = entries;
+    table->cap     = new_cap;
+    return 0;
+}
+
+// adds usage of path; pid counts a process once, 0 adds num_procs as is
+int file_table_add(file_table_t* table, const char* path, size_t path_len,
+                   int pid, size_t num_procs, const mem_usage_t* usage)
+{
+    if (2 * (table->num + 1) > table->cap && file_table_grow(table) != 0)
+        return EXIT_FAILURE;
+
+    file_entry_t* entry = file_table_slot(table->entries, table->cap, path,
+                                          path_len);
+    if (entry->path == NULL)
+    {
+        // the read buffer is reused, keep a copy of the path
+        entry->path = proc_arena_strndup(&table->paths, path, path_len);
+        if (entry->path == NULL)
+            return EXIT_FAILURE;
+        entry->path_len = path_len;
+        table->num++;
+    }
+
+    if (pid == 0)
+        entry->num_procs += num_procs;
+    else if (entry->last_pid != pid)
+    {
+        entry->last_pid = pid;
+        entry->num_procs++;
+    }
+
+    add_usage(&entry->usage, usage);
+    return 0;
+}
+
+void file_table_free(file_table_t* table)
+{
+    free(table->entries);
+    proc_arena_free(&table->paths);
+    memset(table, 0, sizeof(*table));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// output
+////////////////////////////////////////////////////////////////////////////////
+void print_procs(const proc_mem_list_t* list)
+{
+    printf("   PID    RSS(kB)    PSS(kB)   SWAP(kB)  NAME\n");
+
+    mem_usage_t total = {};
+    for (size_t i = 0; i < list->num; i++)
+    {
+        const proc_mem_t* proc = &list->procs[i];
+        printf("%6d %10lu %10lu %10lu  %s\n", proc->pid, proc->usage.rss,
+               proc->usage.pss, proc->usage.swap, proc->comm);
+        add_usage(&total, &proc->usage);
+    }
+
+    // rss counts shared pages in every process, pss sums to the real usage
+    printf("%6s %10lu %10lu %10lu  %zu processes\n", "total", total.rss,
+           total.pss, total.swap, list->num);
+}
+
+static int cmp_files(const void* lhs, const void* rhs)
+{
+    unsigned long lhs_pss = (*(const file_entry_t**)lhs)->usage.pss;
+    unsigned long rhs_pss = (*(const file_entry_t**)rhs)->usage.pss;
+    return (lhs_pss < rhs_pss) - (lhs_pss > rhs_pss);
+}
+
+// files by pss, largest first, top < 0 prints all of them
+int print_files(const file_table_t* files, long top)
+{
+    errno = 0;
+    const file_entry_t** sorted = (const file_entry_t**) malloc(
+        (files->num + 1) * sizeof(file_entry_t*));
+    if (sorted == NULL)
+        PRINT_ERROR("[print_files] Allocation failed\n");
+
+    size_t num = 0;
+    for (size_t i = 0; i < files->cap; i++)
+        if (files->entries[i].path != NULL)
+            sorted[num++] = &files->entries[i];
+
+    qsort(sorted, num, sizeof(file_entry_t*), cmp_files);
+    if (top >= 0 && (size_t) top < num)
+        num = top;
+
+    printf(" PROCS   SIZE(kB)    RSS(kB)    PSS(kB)   SWAP(kB)  FILE\n");
+    for (size_t i = 0; i < num; i++)
+    {
+        const file_entry_t* entry = sorted[i];
+        printf("%6zu %10lu %10lu %10lu %10lu  %.*s\n", entry->num_procs,
+               entry->usage.size, entry->usage.rss, entry->usage.pss,
+               entry->usage.swap, (int) entry->path_len, entry->path);
+    }
+
+    free(sorted);
+    return 0;
+}
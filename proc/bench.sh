@@ -0,0 +1,53 @@
+#!/bin/sh
+# Reproducible ps/lsof benchmark: builds the tools, starts fleets of dummy
+# processes holding files, pipes and socketpairs and reports wall time
+# percentiles, syscalls and allocations of full /proc scans on each of them.
+# Usage: ./bench.sh [work_dir] [runs]
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$DIR")
+WORK=${1:-/tmp/proc_bench}
+RUNS=${2:-20}
+
+mkdir -p "$WORK"
+gcc -Wall -O2 -pthread -o "$WORK/ps" "$ROOT/ps/ps.c"
+gcc -Wall -O2 -pthread -o "$WORK/lsof" "$ROOT/lsof/lsof.c"
+gcc -Wall -O2 -o "$WORK/fleet" "$DIR/fleet.c"
+gcc -Wall -O2 -o "$WORK/bench_run" "$DIR/bench_run.c"
+gcc -Wall -O2 -shared -fPIC -o "$WORK/alloc_count.so" "$DIR/alloc_count.c" -ldl
+
+run() {
+    name=$1
+    shift
+    "$WORK/bench_run" -r "$RUNS" -n "$name" -a "$WORK/alloc_count.so" -- "$@"
+}
+
+# name processes fds_per_process
+while read -r name procs fds; do
+    "$WORK/fleet" -n "$procs" -f "$fds" -d "$WORK" > "$WORK/fleet.pids" &
+    fleet=$!
+    # the pids are printed once every child holds its fds
+    until grep -q '^ready$' "$WORK/fleet.pids"; do
+        kill -0 "$fleet" 2> /dev/null || { echo "fleet $name failed"; exit 1; }
+        sleep 0.1
+    done
+    pid=$(head -n 1 "$WORK/fleet.pids")
+
+    echo "== $name: $procs processes x $fds fds"
+    run "ps"                "$WORK/ps"
+    run "ps -j 1"           "$WORK/ps" -j 1
+    run "ps --files"        "$WORK/ps" --files
+    run "lsof pid"          "$WORK/lsof" "$pid"
+    run "lsof"              "$WORK/lsof"
+    run "lsof -j 1"         "$WORK/lsof" -j 1
+    run "lsof --no-name"    "$WORK/lsof" --no-name
+
+    kill "$fleet"
+    wait "$fleet" || true
+done <<FLEETS
+many_small  1000 16
+mixed       200  256
+fd_heavy    8    16000
+FLEETS
@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+#include <linux/ptrace.h>
+
+#define PRINT_ERROR(str) do {perror(str); return EXIT_FAILURE;} while(0);
+
+#define MAX_RUNS 10000
+
+typedef struct run_stats
+{
+    double             times[MAX_RUNS];  // ms, sorted after the runs
+    long               num_runs;
+    long long          syscalls;         // -1 when it could not be counted
+    long long          allocs;           // -1 when it could not be counted
+} run_stats_t;
+
+int time_runs(char* argv[], long num_runs, run_stats_t* stats);
+long long count_syscalls(char* argv[]);
+long long count_allocs(char* argv[], const char* preload);
+void print_stats(const char* name, const run_stats_t* stats);
+
+// runs a command num_runs times with output to /dev/null and reports wall
+// time percentiles, then once under ptrace for the syscall count and once
+// with the alloc_count.so preload for the allocation count
+int main(int argc, char* argv[])
+{
+    long num_runs = 10;
+    const char* name = NULL;
+    const char* preload = NULL;
+    int with_syscalls = 1;
+    int i = 1;
+    for (; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            num_runs = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            name = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+            preload = argv[++i];
+        else if (strcmp(argv[i], "--no-syscalls") == 0)
+            with_syscalls = 0;
+        else if (strcmp(argv[i], "--") == 0)
+        {
+            i++;
+            break;
+        }
+        else
+            break;
+    }
+
+    if (i >= argc || num_runs < 1 || num_runs > MAX_RUNS)
+    {
+        fprintf(stderr, "Usage: %s [-r runs] [-n name] [-a alloc_count.so] "
+                        "[--no-syscalls] [--] cmd [args ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static run_stats_t stats;
+    if (time_runs(argv + i, num_runs, &stats) != 0)
+        return EXIT_FAILURE;
+
+    stats.syscalls = with_syscalls ? count_syscalls(argv + i) : -1;
+    stats.allocs = preload ? count_allocs(argv + i, preload) : -1;
+
+    print_stats(name ? name : argv[i], &stats);
+    return 0;
+}
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// child side of every run, stdin and stdout go to /dev/null so the command
+// neither eats the caller's input nor pays for a terminal
+static void exec_quiet(char* argv[])
+{
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+
+    execvp(argv[0], argv);
+    perror("[exec_quiet] exec failed\n");
+    _exit(127);
+}
+
+// waits for pid, a command which fails spoils the numbers
+static int wait_ok(pid_t pid, const char* who)
+{
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid)
+        PRINT_ERROR("[wait_ok] waitpid failed\n");
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "[%s] Command failed with status %d\n", who, status);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
+static int cmp_times(const void* lhs, const void* rhs)
+{
+    double lhs_time = *(const double*)lhs;
+    double rhs_time = *(const double*)rhs;
+    return (lhs_time > rhs_time) - (lhs_time < rhs_time);
+}
+
+int time_runs(char* argv[], long num_runs, run_stats_t* stats)
+{
+    for (long run = 0; run < num_runs; run++)
+    {
+        double start = now_ms();
+        pid_t pid = fork();
+        if (pid < 0)
+            PRINT_ERROR("[time_runs] fork failed\n");
+        if (pid == 0)
+            exec_quiet(argv);
+
+        if (wait_ok(pid, "time_runs") != 0)
+            return EXIT_FAILURE;
+        stats->times[run] = now_ms() - start;
+    }
+
+    stats->num_runs = num_runs;
+    qsort(stats->times, num_runs, sizeof(double), cmp_times);
+    return 0;
+}
+
+// syscall entries of the command and all of its threads
+long long count_syscalls(char* argv[])
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("[count_syscalls] fork failed\n");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+            _exit(126);
+        raise(SIGSTOP);
+        exec_quiet(argv);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) != pid || !WIFSTOPPED(status))
+    {
+        fprintf(stderr, "[count_syscalls] Tracing is not permitted\n");
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+                   PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK |
+                   PTRACE_O_EXITKILL;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, (void*) options);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // every syscall stops twice, only the entries are counted
+    long long syscalls = 0;
+    int failed = 0;
+    pid_t tracee;
+    while ((tracee = waitpid(-1, &status, __WALL)) > 0)
+    {
+        if (!WIFSTOPPED(status))
+        {
+            if (tracee == pid && (!WIFEXITED(status) ||
+                                  WEXITSTATUS(status) != 0))
+                failed = 1;
+            continue;
+        }
+
+        int sig = WSTOPSIG(status);
+        int inject = 0;
+        if (sig == (SIGTRAP | 0x80))
+        {
+            struct ptrace_syscall_info info;
+            if (ptrace(PTRACE_GET_SYSCALL_INFO, tracee, sizeof(info),
+                       &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+                syscalls++;
+        }
+        // clone events and the initial stop of new threads are not signals
+        else if (sig != SIGTRAP && sig != SIGSTOP)
+            inject = sig;
+
+        ptrace(PTRACE_SYSCALL, tracee, NULL, (void*)(long) inject);
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "[count_syscalls] Command failed under ptrace\n");
+        return -1;
+    }
+    return syscalls;
+}
+
+// malloc, calloc and realloc calls counted by the preload, which writes the
+// total to the file named by BENCH_ALLOC_OUT on exit
+long long count_allocs(char* argv[], const char* preload)
+{
+    char out_path[] = "/tmp/bench_allocs_XXXXXX";
+    int out_fd = mkstemp(out_path);
+    if (out_fd < 0)
+    {
+        perror("[count_allocs] Creating output file failed\n");
+        return -1;
+    }
+    close(out_fd);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("[count_allocs] fork failed\n");
+        unlink(out_path);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        setenv("LD_PRELOAD", preload, 1);
+        setenv("BENCH_ALLOC_OUT", out_path, 1);
+        exec_quiet(argv);
+    }
+
+    long long allocs = -1;
+    if (wait_ok(pid, "count_allocs") == 0)
+    {
+        FILE* in = fopen(out_path, "r");
+        if (in == NULL || fscanf(in, "%lld", &allocs) != 1)
+            allocs = -1;
+        if (in != NULL)
+            fclose(in);
+    }
+
+    unlink(out_path);
+    return allocs;
+}
+
+// nearest rank percentile of the sorted times
+static double percentile(const run_stats_t* stats, int pct)
+{
+    long rank = (pct * stats->num_runs + 99) / 100;
+    if (rank < 1)
+        rank = 1;
+    return stats->times[rank - 1];
+}
+
+void print_stats(const char* name, const run_stats_t* stats)
+{
+    printf("%-24s runs %4ld  ms p50 %9.3f p90 %9.3f p99 %9.3f max %9.3f",
+           name, stats->num_runs, percentile(stats, 50),
+           percentile(stats, 90), percentile(stats, 99),
+           stats->times[stats->num_runs - 1]);
+
+    if (stats->syscalls >= 0)
+        printf("  syscalls %8lld", stats->syscalls);
+    else
+        printf("  syscalls %8s", "n/a");
+
+    if (stats->allocs >= 0)
+        printf("  allocs %8lld\n", stats->allocs);
+    else
+        printf("  allocs %8s\n", "n/a");
+    fflush(stdout);
+}
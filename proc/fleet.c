@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+
+#define PRINT_ERROR(str) do {perror(str); return EXIT_FAILURE;} while(0);
+
+// files opened round robin by every child
+#define NUM_FILES 16
+
+int make_files(const char* dir, char paths[NUM_FILES][PATH_MAX]);
+void remove_files(char paths[NUM_FILES][PATH_MAX]);
+int hold_fds(long num_fds, char paths[NUM_FILES][PATH_MAX], int ready_fd);
+
+// dummy processes for the ps and lsof benchmarks: every child holds num_fds
+// descriptors split between files, pipes and socketpairs and sleeps; the pids
+// are printed once all children are ready, followed by "ready", and the
+// fleet is torn down on SIGTERM or SIGINT
+int main(int argc, char* argv[])
+{
+    long num_procs = 100;
+    long num_fds = 100;
+    const char* dir = "/tmp";
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            num_procs = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            num_fds = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+            dir = argv[++i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n procs] [-f fds_per_proc] "
+                            "[-d dir]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (num_procs < 1 || num_fds < 0)
+    {
+        fprintf(stderr, "[main] Bad fleet size\n");
+        return EXIT_FAILURE;
+    }
+
+    // children hold num_fds on top of stdio and the ready pipe
+    struct rlimit limit = {};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    if (limit.rlim_cur < (rlim_t) num_fds + 16)
+    {
+        limit.rlim_cur = num_fds + 16;
+        if (limit.rlim_max < limit.rlim_cur)
+            limit.rlim_max = limit.rlim_cur;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            PRINT_ERROR("[main] Raising RLIMIT_NOFILE failed\n");
+    }
+
+    static char paths[NUM_FILES][PATH_MAX];
+    if (make_files(dir, paths) != 0)
+        return EXIT_FAILURE;
+
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) != 0)
+    {
+        remove_files(paths);
+        PRINT_ERROR("[main] Creating ready pipe failed\n");
+    }
+
+    // the signals are taken with sigwait, children get them back unblocked
+    sigset_t stop_set;
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGTERM);
+    sigaddset(&stop_set, SIGINT);
+    sigprocmask(SIG_BLOCK, &stop_set, NULL);
+
+    errno = 0;
+    pid_t* pids = (pid_t*) calloc(num_procs, sizeof(pid_t));
+    if (pids == NULL)
+    {
+        remove_files(paths);
+        PRINT_ERROR("[main] Allocation of pids failed\n");
+    }
+
+    int err = 0;
+    long num_started = 0;
+    for (; num_started < num_procs; num_started++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("[main] fork failed\n");
+            err = EXIT_FAILURE;
+            break;
+        }
+        if (pid == 0)
+        {
+            sigprocmask(SIG_UNBLOCK, &stop_set, NULL);
+            close(ready[0]);
+            _exit(hold_fds(num_fds, paths, ready[1]));
+        }
+        pids[num_started] = pid;
+    }
+    close(ready[1]);
+
+    // one byte per child which holds all of its fds
+    long num_ready = 0;
+    char byte;
+    while (err == 0 && num_ready < num_started &&
+           read(ready[0], &byte, 1) == 1)
+        num_ready++;
+    close(ready[0]);
+
+    if (err == 0 && num_ready != num_started)
+    {
+        fprintf(stderr, "[main] Only %ld of %ld children are ready\n",
+                num_ready, num_started);
+        err = EXIT_FAILURE;
+    }
+
+    if (err == 0)
+    {
+        for (long i = 0; i < num_started; i++)
+            printf("%d\n", pids[i]);
+        printf("ready\n");
+        fflush(stdout);
+
+        int sig = 0;
+        sigwait(&stop_set, &sig);
+    }
+
+    for (long i = 0; i < num_started; i++)
+        kill(pids[i], SIGKILL);
+    for (long i = 0; i < num_started; i++)
+        waitpid(pids[i], NULL, 0);
+
+    free(pids);
+    remove_files(paths);
+    return err;
+}
+
+int make_files(const char* dir, char paths[NUM_FILES][PATH_MAX])
+{
+    for (int i = 0; i < NUM_FILES; i++)
+    {
+        snprintf(paths[i], PATH_MAX, "%s/fleet_%d_%d", dir, getpid(), i);
+        errno = 0;
+        int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0600);
+        if (fd < 0)
+        {
+            perror("[make_files] Creating file failed\n");
+            paths[i][0] = '\0';
+            remove_files(paths);
+            return EXIT_FAILURE;
+        }
+        close(fd);
+    }
+
+    return 0;
+}
+
+void remove_files(char paths[NUM_FILES][PATH_MAX])
+{
+    for (int i = 0; i < NUM_FILES && paths[i][0] != '\0'; i++)
+        unlink(paths[i]);
+}
+
+// child body: opens a third of num_fds each as files, pipe ends and
+// socketpair ends, reports ready and sleeps until killed
+int hold_fds(long num_fds, char paths[NUM_FILES][PATH_MAX], int ready_fd)
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+    long num_open = 0;
+    for (int kind = 0; num_open < num_fds; kind = (kind + 1) % 3)
+    {
+        int fds[2] = {-1, -1};
+        int err = 0;
+        if (kind == 0 || num_open + 1 == num_fds)
+        {
+            fds[0] = open(paths[num_open % NUM_FILES], O_RDONLY);
+            err = (fds[0] < 0);
+        }
+        else if (kind == 1)
+            err = pipe(fds);
+        else
+            err = socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+
+        if (err != 0)
+            PRINT_ERROR("[hold_fds] Opening fd failed\n");
+        num_open += (fds[1] < 0) ? 1 : 2;
+    }
+
+    char byte = 1;
+    if (write(ready_fd, &byte, 1) != 1)
+        PRINT_ERROR("[hold_fds] Reporting ready failed\n");
+    close(ready_fd);
+
+    while (1)
+        pause();
+}
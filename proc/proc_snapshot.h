@@ -0,0 +1,709 @@
+#ifndef PROC_SNAPSHOT_H
+#define PROC_SNAPSHOT_H
+
+// needs _GNU_SOURCE defined by the including file before any system header
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+////////////////////////////////////////////////////////////////////////////////
+// One walk over /proc shared by ps and lsof.
+// A snapshot lists the pids once, lends out reusable read buffers and loads
+// per-process facets (stat, status, statm, cmdline, open fds) only when
+// a tool asks for them, so a report mixing processes and open files touches
+// every /proc entry once.
+////////////////////////////////////////////////////////////////////////////////
+
+#define PRINT_ERROR(str) do {perror(str); return EXIT_FAILURE;} while(0);
+
+// getdents64 buffer for /proc itself, one call covers thousands of pids
+#define PROC_DENTS_BUFF_SIZE (256 * 1024)
+// pooled buffer, holds one /proc file or one batch of fd dirents
+#define PROC_BUFF_SIZE       (64 * 1024)
+#define PROC_ARENA_CHUNK     (256 * 1024)
+
+struct linux_dirent64
+{
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+enum PROC_FACETS
+{
+    PROC_STAT,
+    PROC_STATUS,
+    PROC_STATM,
+    PROC_CMDLINE,
+    PROC_NUM_TEXT_FACETS,
+    PROC_FDS = PROC_NUM_TEXT_FACETS, // bit of the fd list in loaded/gone
+    PROC_FD_NAMES                    // loaded: the fd list has link names
+};
+
+static const char* proc_facet_names[PROC_NUM_TEXT_FACETS] =
+{
+    "stat", "status", "statm", "cmdline"
+};
+
+typedef struct proc_text
+{
+    const char* data;  // NUL terminated
+    size_t      len;
+} proc_text_t;
+
+typedef struct proc_fd_info
+{
+    int         fd;
+    mode_t      mode;
+    uid_t       uid;
+    dev_t       dev;
+    ino_t       ino;
+    off_t       size;
+    const char* name;  // link target, NULL unless loaded with names
+} proc_fd_info_t;
+
+typedef struct proc_entry
+{
+    int             pid;
+    unsigned        loaded;  // bit per facet
+    unsigned        gone;    // facets which vanished or were denied
+    proc_text_t     text[PROC_NUM_TEXT_FACETS];
+    proc_fd_info_t* fds;
+    size_t          num_fds;
+} proc_entry_t;
+
+typedef struct proc_arena_chunk
+{
+    struct proc_arena_chunk* next;
+    size_t                   used;
+    size_t                   cap;
+    char                     data[];
+} proc_arena_chunk_t;
+
+// bump allocator, everything is freed at once with the snapshot
+typedef struct proc_arena
+{
+    proc_arena_chunk_t* head;
+} proc_arena_t;
+
+typedef struct proc_snapshot
+{
+    int             proc_fd;
+    char*           dents;
+    int*            pids;
+    size_t          num_pids;
+    size_t          cap_pids;
+    proc_entry_t*   entries;     // parallel to pids, see proc_snapshot_entries
+    pthread_mutex_t lock;        // guards the buffer pool and arena merges
+    char**          free_buffs;
+    size_t          num_free;
+    size_t          cap_free;
+    proc_arena_t    arena;       // facets of all entries
+} proc_snapshot_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// arena
+////////////////////////////////////////////////////////////////////////////////
+static inline void* proc_arena_alloc(proc_arena_t* arena, size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    proc_arena_chunk_t* chunk = arena->head;
+    if (chunk == NULL || chunk->cap - chunk->used < size)
+    {
+        size_t cap = (size > PROC_ARENA_CHUNK) ? size : PROC_ARENA_CHUNK;
+        errno = 0;
+        chunk = (proc_arena_chunk_t*) malloc(sizeof(proc_arena_chunk_t) + cap);
+        if (chunk == NULL)
+        {
+            perror("[proc_arena_alloc] Allocation failed\n");
+            return NULL;
+        }
+
+        chunk->next = arena->head;
+        chunk->used = 0;
+        chunk->cap  = cap;
+        arena->head = chunk;
+    }
+
+    void* ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+static inline char* proc_arena_strndup(proc_arena_t* arena, const char* str,
+                                       size_t len)
+{
+    char* copy = (char*) proc_arena_alloc(arena, len + 1);
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// moves every chunk of src into dst, pointers into them stay valid
+static inline void proc_arena_merge(proc_arena_t* dst, proc_arena_t* src)
+{
+    while (src->head != NULL)
+    {
+        proc_arena_chunk_t* chunk = src->head;
+        src->head   = chunk->next;
+        chunk->next = dst->head;
+        dst->head   = chunk;
+    }
+}
+
+static inline void proc_arena_free(proc_arena_t* arena)
+{
+    while (arena->head != NULL)
+    {
+        proc_arena_chunk_t* chunk = arena->head;
+        arena->head = chunk->next;
+        free(chunk);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// pids
+////////////////////////////////////////////////////////////////////////////////
+static inline int proc_is_piddir(const char* dir_name)
+{
+    if (dir_name == NULL)
+    {
+        fprintf(stderr, "[proc_is_piddir] Null input string\n");
+        return 0;
+    }
+
+    if (*dir_name == '\0')
+        return 0;
+
+    for (const char* pos = dir_name; *pos != '\0'; pos++)
+        if (*pos < '0' || *pos > '9')
+            return 0;
+
+    return 1;
+}
+
+static inline void proc_snapshot_close(proc_snapshot_t* snap)
+{
+    if (snap == NULL)
+        return;
+
+    if (snap->proc_fd >= 0)
+        close(snap->proc_fd);
+    for (size_t i = 0; i < snap->num_free; i++)
+        free(snap->free_buffs[i]);
+    free(snap->free_buffs);
+    free(snap->dents);
+    free(snap->pids);
+    free(snap->entries);
+    proc_arena_free(&snap->arena);
+    pthread_mutex_destroy(&snap->lock);
+    memset(snap, 0, sizeof(*snap));
+    snap->proc_fd = -1;
+}
+
+static inline int proc_snapshot_open(proc_snapshot_t* snap)
+{
+    if (snap == NULL)
+    {
+        fprintf(stderr, "[proc_snapshot_open] Bad input pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(snap, 0, sizeof(*snap));
+    pthread_mutex_init(&snap->lock, NULL);
+
+    errno = 0;
+    snap->proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (snap->proc_fd < 0)
+        PRINT_ERROR("[proc_snapshot_open] Open /proc failed\n");
+
+    errno = 0;
+    snap->dents = (char*) malloc(PROC_DENTS_BUFF_SIZE);
+    if (snap->dents == NULL)
+    {
+        perror("[proc_snapshot_open] Allocation of dents buffer failed\n");
+        proc_snapshot_close(snap);
+        return EXIT_FAILURE;
+    }
+
+    return 0;
+}
+
+static inline int proc_snapshot_add_pid(proc_snapshot_t* snap, int pid)
+{
+    if (snap->num_pids == snap->cap_pids)
+    {
+        size_t new_cap = (snap->cap_pids == 0) ? 1024 : 2 * snap->cap_pids;
+        errno = 0;
+        int* new_pids = (int*) realloc(snap->pids, new_cap * sizeof(int));
+        if (new_pids == NULL)
+            PRINT_ERROR("[proc_snapshot_add_pid] Reallocation failed\n");
+
+        snap->pids     = new_pids;
+        snap->cap_pids = new_cap;
+    }
+
+    snap->pids[snap->num_pids++] = pid;
+    return 0;
+}
+
+// one getdents64 pass over /proc, pids come in the order the kernel lists
+static inline int proc_snapshot_list_pids(proc_snapshot_t* snap)
+{
+    if (snap == NULL)
+    {
+        fprintf(stderr, "[proc_snapshot_list_pids] Bad input pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    snap->num_pids = 0;
+    lseek(snap->proc_fd, 0, SEEK_SET);
+
+    while (1)
+    {
+        errno = 0;
+        long read = syscall(SYS_getdents64, snap->proc_fd, snap->dents,
+                            PROC_DENTS_BUFF_SIZE);
+        if (read < 0)
+            PRINT_ERROR("[proc_snapshot_list_pids] getdents64 failed\n");
+        if (read == 0)
+            break;
+
+        for (long pos = 0; pos < read;)
+        {
+            struct linux_dirent64* entry =
+                (struct linux_dirent64*)(snap->dents + pos);
+            pos += entry->d_reclen;
+
+            if (entry->d_type != DT_DIR || !proc_is_piddir(entry->d_name))
+                continue;
+
+            if (proc_snapshot_add_pid(snap, atoi(entry->d_name)) != 0)
+                return EXIT_FAILURE;
+        }
+    }
+
+    return 0;
+}
+
+// entries for the listed pids, nothing loaded yet
+static inline int proc_snapshot_entries(proc_snapshot_t* snap)
+{
+    free(snap->entries);
+    errno = 0;
+    snap->entries = (proc_entry_t*) calloc(snap->num_pids + 1,
+                                           sizeof(proc_entry_t));
+    if (snap->entries == NULL)
+        PRINT_ERROR("[proc_snapshot_entries] Allocation failed\n");
+
+    for (size_t i = 0; i < snap->num_pids; i++)
+        snap->entries[i].pid = snap->pids[i];
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// buffer pool
+////////////////////////////////////////////////////////////////////////////////
+// PROC_BUFF_SIZE bytes, handed back with proc_put_buff for the next user
+static inline char* proc_get_buff(proc_snapshot_t* snap)
+{
+    char* buff = NULL;
+    pthread_mutex_lock(&snap->lock);
+    if (snap->num_free > 0)
+        buff = snap->free_buffs[--snap->num_free];
+    pthread_mutex_unlock(&snap->lock);
+
+    if (buff == NULL)
+    {
+        errno = 0;
+        buff = (char*) malloc(PROC_BUFF_SIZE);
+        if (buff == NULL)
+            perror("[proc_get_buff] Allocation failed\n");
+    }
+    return buff;
+}
+
+static inline void proc_put_buff(proc_snapshot_t* snap, char* buff)
+{
+    if (buff == NULL)
+        return;
+
+    pthread_mutex_lock(&snap->lock);
+    if (snap->num_free == snap->cap_free)
+    {
+        size_t new_cap = (snap->cap_free == 0) ? 16 : 2 * snap->cap_free;
+        char** new_buffs = (char**) realloc(snap->free_buffs,
+                                            new_cap * sizeof(char*));
+        if (new_buffs == NULL)
+        {
+            pthread_mutex_unlock(&snap->lock);
+            free(buff);
+            return;
+        }
+        snap->free_buffs = new_buffs;
+        snap->cap_free   = new_cap;
+    }
+    snap->free_buffs[snap->num_free++] = buff;
+    pthread_mutex_unlock(&snap->lock);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// files of one process
+////////////////////////////////////////////////////////////////////////////////
+// one read of "<pid>/<name>", returns length of data, -1 with errno set
+static inline ssize_t proc_read_file(int proc_fd, int pid, const char* name,
+                                     char* buff, size_t buff_size)
+{
+    if (name == NULL || buff == NULL || buff_size == 0)
+    {
+        fprintf(stderr, "[proc_read_file] Bad input pointers\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    char path[64];
+    int path_len = snprintf(path, sizeof(path), "%d/%s", pid, name);
+    if (path_len < 0 || (size_t)path_len >= sizeof(path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    errno = 0;
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ssize_t len = read(fd, buff, buff_size - 1);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    if (len < 0)
+        return -1;
+
+    buff[len] = '\0';
+    return len;
+}
+
+// whole "<pid>/<name>" into *buff, which is grown and kept by the caller so
+// repeated reads of big seq files (smaps) settle at one read per file;
+// returns length of data, -1 with errno set
+static inline ssize_t proc_read_all(int proc_fd, int pid, const char* name,
+                                    char** buff, size_t* cap)
+{
+    if (name == NULL || buff == NULL || cap == NULL)
+    {
+        fprintf(stderr, "[proc_read_all] Bad input pointers\n");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (*buff == NULL || *cap < 2)
+    {
+        free(*buff);
+        *cap = PROC_BUFF_SIZE;
+        errno = 0;
+        *buff = (char*) malloc(*cap);
+        if (*buff == NULL)
+        {
+            *cap = 0;
+            return -1;
+        }
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "%d/%s", pid, name);
+
+    errno = 0;
+    int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    size_t len = 0;
+    ssize_t readed = 0;
+    while ((readed = read(fd, *buff + len, *cap - len - 1)) > 0)
+    {
+        len += readed;
+        if (*cap - len > 1)
+            continue;
+
+        errno = 0;
+        char* bigger = (char*) realloc(*buff, 2 * *cap);
+        if (bigger == NULL)
+        {
+            readed = -1;
+            break;
+        }
+        *buff = bigger;
+        *cap *= 2;
+    }
+
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    if (readed < 0)
+        return -1;
+
+    (*buff)[len] = '\0';
+    return len;
+}
+
+// callback of proc_scan_fd_dir, returns 0 to go on, PROC_SCAN_STOP to stop
+// or an error
+#define PROC_SCAN_STOP 2
+typedef int (*proc_fd_cb_t)(int dir_fd, const char* fd_name, void* ctx);
+
+// rewinds an open "<pid>/fd" directory and calls cb for every fd,
+// returns -1 when the process is gone
+static inline int proc_scan_fd_dir(int dir_fd, char* dents, proc_fd_cb_t cb,
+                                   void* ctx)
+{
+    lseek(dir_fd, 0, SEEK_SET);
+    while (1)
+    {
+        errno = 0;
+        long read = syscall(SYS_getdents64, dir_fd, dents, PROC_BUFF_SIZE);
+        if (read < 0)
+        {
+            // the process may exit while its table is read
+            if (errno == ENOENT || errno == ESRCH)
+                return -1;
+            PRINT_ERROR("[proc_scan_fd_dir] getdents64 failed\n");
+        }
+        if (read == 0)
+            return 0;
+
+        for (long pos = 0; pos < read;)
+        {
+            struct linux_dirent64* entry =
+                (struct linux_dirent64*)(dents + pos);
+            pos += entry->d_reclen;
+            if (entry->d_type != DT_LNK)
+                continue;
+
+            int err = cb(dir_fd, entry->d_name, ctx);
+            if (err == PROC_SCAN_STOP)
+                return 0;
+            if (err != 0)
+                return err;
+        }
+    }
+}
+
+// opens "<pid>/fd" relative to /proc, -1 with errno set
+static inline int proc_open_fd_dir(int proc_fd, int pid)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%d/fd", pid);
+    return openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// lazily loaded facets
+////////////////////////////////////////////////////////////////////////////////
+static inline int proc_is_gone_errno()
+{
+    return errno == ENOENT || errno == ESRCH || errno == EACCES;
+}
+
+// text of facet, read on first use into arena; NULL with errno when the
+// process is gone, buff is a PROC_BUFF_SIZE scratch buffer
+static inline const proc_text_t* proc_entry_text(proc_snapshot_t* snap,
+                                                 proc_entry_t* entry,
+                                                 int facet, proc_arena_t* arena,
+                                                 char* buff)
+{
+    if (entry->gone & (1u << facet))
+    {
+        errno = ESRCH;
+        return NULL;
+    }
+    if (entry->loaded & (1u << facet))
+        return &entry->text[facet];
+
+    char path[64];
+    snprintf(path, sizeof(path), "%d/%s", entry->pid, proc_facet_names[facet]);
+
+    errno = 0;
+    int fd = openat(snap->proc_fd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (proc_is_gone_errno())
+            entry->gone |= 1u << facet;
+        return NULL;
+    }
+
+    // cmdline can outgrow one buffer, the pieces are joined on the heap
+    char* data = buff;
+    size_t cap = PROC_BUFF_SIZE;
+    size_t len = 0;
+    int failed = 0;
+    while (1)
+    {
+        ssize_t readed = read(fd, data + len, cap - len - 1);
+        if (readed <= 0)
+        {
+            failed = (readed < 0);
+            break;
+        }
+
+        len += readed;
+        if (cap - len > 1)
+            continue;
+
+        errno = 0;
+        char* bigger = (char*) malloc(2 * cap);
+        if (bigger == NULL)
+        {
+            failed = 1;
+            break;
+        }
+        memcpy(bigger, data, len);
+        if (data != buff)
+            free(data);
+        data = bigger;
+        cap *= 2;
+    }
+
+    int saved_errno = errno;
+    close(fd);
+
+    char* copy = failed ? NULL : proc_arena_strndup(arena, data, len);
+    if (data != buff)
+        free(data);
+
+    errno = saved_errno;
+    if (copy == NULL)
+    {
+        if (failed && proc_is_gone_errno())
+            entry->gone |= 1u << facet;
+        return NULL;
+    }
+
+    entry->text[facet].data = copy;
+    entry->text[facet].len  = len;
+    entry->loaded |= 1u << facet;
+    return &entry->text[facet];
+}
+
+typedef struct proc_fds_ctx
+{
+    proc_fd_info_t* fds;
+    size_t          num;
+    size_t          cap;
+    int             with_names;
+    proc_arena_t*   arena;
+} proc_fds_ctx_t;
+
+static inline int proc_fds_cb(int dir_fd, const char* fd_name, void* arg)
+{
+    proc_fds_ctx_t* ctx = (proc_fds_ctx_t*) arg;
+
+    struct stat node_stat;
+    if (fstatat(dir_fd, fd_name, &node_stat, 0) != 0)
+        return (errno == EACCES) ? PROC_SCAN_STOP : 0;
+
+    if (ctx->num == ctx->cap)
+    {
+        size_t new_cap = (ctx->cap == 0) ? 64 : 2 * ctx->cap;
+        proc_fd_info_t* new_fds = (proc_fd_info_t*) realloc(ctx->fds,
+                                             new_cap * sizeof(proc_fd_info_t));
+        if (new_fds == NULL)
+            PRINT_ERROR("[proc_fds_cb] Reallocation failed\n");
+        ctx->fds = new_fds;
+        ctx->cap = new_cap;
+    }
+
+    proc_fd_info_t* info = &ctx->fds[ctx->num];
+    info->fd   = atoi(fd_name);
+    info->mode = node_stat.st_mode;
+    info->uid  = node_stat.st_uid;
+    info->dev  = node_stat.st_dev;
+    info->ino  = node_stat.st_ino;
+    info->size = node_stat.st_size;
+    info->name = NULL;
+
+    if (ctx->with_names)
+    {
+        char buff[PATH_MAX];
+        ssize_t readed = readlinkat(dir_fd, fd_name, buff, PATH_MAX - 1);
+        if (readed < 0)
+            return 0;
+        info->name = proc_arena_strndup(ctx->arena, buff, readed);
+        if (info->name == NULL)
+            return EXIT_FAILURE;
+    }
+
+    ctx->num++;
+    return 0;
+}
+
+// open fds with their stat and optionally link names, loaded on first use;
+// a list loaded without names is read again when names are asked for
+static inline int proc_entry_fds(proc_snapshot_t* snap, proc_entry_t* entry,
+                                 int with_names, proc_arena_t* arena,
+                                 char* dents)
+{
+    if ((entry->loaded & (1u << PROC_FDS)) &&
+        (!with_names || (entry->loaded & (1u << PROC_FD_NAMES))))
+        return 0;
+
+    entry->loaded |= 1u << PROC_FDS;
+    if (with_names)
+        entry->loaded |= 1u << PROC_FD_NAMES;
+    entry->gone   &= ~(1u << PROC_FDS);
+    entry->fds     = NULL;
+    entry->num_fds = 0;
+    errno = 0;
+    int dir_fd = proc_open_fd_dir(snap->proc_fd, entry->pid);
+    if (dir_fd < 0)
+    {
+        if (proc_is_gone_errno())
+        {
+            entry->gone |= 1u << PROC_FDS;
+            return 0;
+        }
+        PRINT_ERROR("[proc_entry_fds] Open fd dir failed\n");
+    }
+
+    proc_fds_ctx_t ctx = {.with_names = with_names, .arena = arena};
+    int err = proc_scan_fd_dir(dir_fd, dents, proc_fds_cb, &ctx);
+    close(dir_fd);
+    if (err == -1)
+    {
+        entry->gone |= 1u << PROC_FDS;
+        err = 0;
+    }
+
+    if (err == 0 && ctx.num > 0)
+    {
+        entry->fds = (proc_fd_info_t*) proc_arena_alloc(arena,
+                                        ctx.num * sizeof(proc_fd_info_t));
+        if (entry->fds == NULL)
+            err = EXIT_FAILURE;
+        else
+        {
+            memcpy(entry->fds, ctx.fds, ctx.num * sizeof(proc_fd_info_t));
+            entry->num_fds = ctx.num;
+        }
+    }
+
+    free(ctx.fds);
+    return err;
+}
+
+#endif // PROC_SNAPSHOT_H
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <limits.h>
 #include <sys/types.h>
@@ -5,134 +6,1356 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <stddef.h>
+#include "../proc/proc_snapshot.h"
 
-#define PRINT_ERROR(str) do {perror(str); return EXIT_FAILURE;} while(0);
+#define COMM_LEN        64
+#define ARGS_LEN        256
+#define MAX_COLUMNS     32
+// pids taken by a worker at once and the minimum count worth a pool
+#define PIDS_PER_TAKE   64
+#define PIDS_PER_THREAD 256
+#define MAX_THREADS     64
+// initial size of the watch table, power of 2
+#define WATCH_TABLE_SIZE 1024
 
-int is_piddir(const char* dir_name);
-int get_stat_path(char* file_path, size_t buf_size, const char* dir_name);
-int print_stat(const char* stat_file_path);
+// snapshot facets a process is read from, only those of selected columns are
+enum PROC_SOURCES
+{
+    SRC_STAT    = 1 << PROC_STAT,
+    SRC_STATUS  = 1 << PROC_STATUS,
+    SRC_STATM   = 1 << PROC_STATM,
+    SRC_CMDLINE = 1 << PROC_CMDLINE,
+    SRC_FDS     = 1 << PROC_FDS   // open files, for the combined --files report
+};
+
+typedef struct proc_info
+{
+    int  pid;
+    char state;
+    int  ppid;
+    char comm[COMM_LEN];
+    // stat
+    unsigned long long utime;      // clock ticks
+    unsigned long long stime;
+    long long          threads;
+    unsigned long long starttime;  // clock ticks since boot
+    long long          vsize;      // bytes
+    long long          rss;        // pages
+    // status
+    long long          uid;
+    long long          vm_swap;    // kB
+    long long          vol_ctxt;
+    long long          nonvol_ctxt;
+    // statm, pages
+    long long          shared;
+    long long          text;
+    long long          data;
+    // cmdline
+    char args[ARGS_LEN];
+    // fds, in the snapshot arena
+    const proc_fd_info_t* fds;
+    size_t                num_fds;
+} proc_info_t;
+
+enum COLUMN_KINDS
+{
+    COL_INT,    // int
+    COL_LLONG,  // long long
+    COL_TICKS,  // unsigned long long clock ticks, printed in seconds
+    COL_PAGES,  // long long pages, printed in kB
+    COL_BYTES,  // long long bytes, printed in kB
+    COL_CHAR,
+    COL_STR
+};
+
+typedef struct column
+{
+    const char* name;
+    const char* header;
+    int         width;    // negative is left aligned
+    int         sources;
+    int         kind;
+    size_t      offset;   // of the field in proc_info_t
+} column_t;
+
+typedef struct proc_list
+{
+    proc_info_t* infos;
+    size_t       num;
+    size_t       cap;
+} proc_list_t;
+
+struct proc_pool;
+
+// every worker reads into its own buffer and list, merged at the end
+typedef struct proc_worker
+{
+    pthread_t         thread;
+    struct proc_pool* pool;
+    char*             buff;
+    proc_arena_t      arena;
+    proc_list_t       list;
+    int               err;
+} proc_worker_t;
+
+typedef struct proc_pool
+{
+    proc_snapshot_t* snap;
+    int            sources;
+    size_t         next;     // next entry index to take, atomic
+    proc_worker_t* workers;
+    size_t         num_workers;
+} proc_pool_t;
+
+// previous sample of a watched process, fd stays open between ticks
+typedef struct watch_entry
+{
+    int                pid;   // 0 marks a free slot
+    int                fd;    // -1 when out of descriptors, reopened each tick
+    unsigned long      tick;  // last tick the process was seen
+    unsigned long long cpu;   // utime + stime
+    long long          rss;
+    char               comm[COMM_LEN];
+} watch_entry_t;
+
+typedef struct watch_table
+{
+    watch_entry_t* entries;
+    size_t         cap;       // power of 2
+    size_t         num;
+} watch_table_t;
+
+// children of list->infos[i] are children[first[i]] .. children[first[i+1]-1]
+typedef struct proc_tree
+{
+    size_t* first;
+    size_t* children;
+} proc_tree_t;
+
+#define COLUMN(name, header, width, sources, kind, field) \
+    {name, header, width, sources, kind, offsetof(proc_info_t, field)}
+
+static const column_t all_columns[] =
+{
+    COLUMN("pid",       "PID",      6,  SRC_STAT,    COL_INT,   pid),
+    COLUMN("state",     "S",        1,  SRC_STAT,    COL_CHAR,  state),
+    COLUMN("ppid",      "PPID",     6,  SRC_STAT,    COL_INT,   ppid),
+    COLUMN("utime",     "UTIME",    9,  SRC_STAT,    COL_TICKS, utime),
+    COLUMN("stime",     "STIME",    9,  SRC_STAT,    COL_TICKS, stime),
+    COLUMN("threads",   "THR",      4,  SRC_STAT,    COL_LLONG, threads),
+    COLUMN("starttime", "START",    10, SRC_STAT,    COL_TICKS, starttime),
+    COLUMN("vsize",     "VSZ",      9,  SRC_STAT,    COL_BYTES, vsize),
+    COLUMN("rss",       "RSS",      8,  SRC_STAT,    COL_PAGES, rss),
+    COLUMN("uid",       "UID",      6,  SRC_STATUS,  COL_LLONG, uid),
+    COLUMN("swap",      "SWAP",     8,  SRC_STATUS,  COL_LLONG, vm_swap),
+    COLUMN("vctxt",     "VCTXT",    8,  SRC_STATUS,  COL_LLONG, vol_ctxt),
+    COLUMN("nvctxt",    "NVCTXT",   8,  SRC_STATUS,  COL_LLONG, nonvol_ctxt),
+    COLUMN("shared",    "SHR",      8,  SRC_STATM,   COL_PAGES, shared),
+    COLUMN("text",      "TEXT",     8,  SRC_STATM,   COL_PAGES, text),
+    COLUMN("data",      "DATA",     8,  SRC_STATM,   COL_PAGES, data),
+    COLUMN("comm",      "COMMAND",  -16, SRC_STAT,   COL_STR,   comm),
+    COLUMN("args",      "ARGS",     -16, SRC_CMDLINE, COL_STR,  args),
+};
+
+// empty selection keeps the classic output
+static const column_t* columns[MAX_COLUMNS];
+static size_t num_columns;
+static long clk_tck;
+static long page_kb;
+
+int list_subtree(proc_snapshot_t* snap, int root);
+int parse_stat(const char* buff, size_t len, proc_info_t* info);
+int parse_status(const char* buff, size_t len, proc_info_t* info);
+int parse_statm(const char* buff, size_t len, proc_info_t* info);
+int collect_proc(proc_snapshot_t* snap, proc_entry_t* entry, int sources,
+                 char* buff, proc_arena_t* arena, proc_list_t* list);
+int collect_all(proc_snapshot_t* snap, size_t num_threads, int sources,
+                proc_list_t* list);
+int select_columns(const char* spec);
+void print_header();
+void print_info(const proc_info_t* info, int depth);
+int watch(proc_snapshot_t* snap, double interval, long count, int root);
+long find_info(const proc_list_t* list, int pid);
+int tree_build(const proc_list_t* list, proc_tree_t* tree);
+void tree_free(proc_tree_t* tree);
+void print_tree(const proc_list_t* list, const proc_tree_t* tree, size_t pos,
+                int depth);
 
 int main(int argc, char* argv[])
 {
-    errno = 0;
-    DIR* proc_dir = opendir("/proc");
-    if (errno < 0)
-        PRINT_ERROR("[main] Open /proc failed\n");
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    double interval = 0;
+    long count = -1;
+    int tree_mode = 0;
+    int with_files = 0;
+    int subtree_pid = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0)
+            && i + 1 < argc)
+            num_threads = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--watch") == 0 && i + 1 < argc)
+        {
+            interval = strtod(argv[++i], NULL);
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                count = strtol(argv[++i], NULL, 10);
+            if (interval <= 0)
+            {
+                fprintf(stderr, "[main] Bad watch interval\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+        {
+            if (select_columns(argv[++i]) != 0)
+                return EXIT_FAILURE;
+        }
+        else if (strcmp(argv[i], "--tree") == 0)
+            tree_mode = 1;
+        else if (strcmp(argv[i], "--files") == 0)
+            with_files = 1;
+        else if (strcmp(argv[i], "--subtree") == 0 && i + 1 < argc)
+        {
+            tree_mode = 1;
+            subtree_pid = strtol(argv[++i], NULL, 10);
+            if (subtree_pid <= 0)
+            {
+                fprintf(stderr, "[main] Bad subtree pid\n");
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-j|--threads num] "
+                            "[--watch interval [count]] "
+                            "[--tree | --subtree pid] [-o col,...] "
+                            "[--files]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
 
-    errno = 0;
-    struct dirent* entry_ptr = readdir(proc_dir);
-    if (errno < 0)
-        PRINT_ERROR("[main] Init readdir returned error");
+    // watch prints its own fixed sample line of stat fields only
+    if (interval > 0 && (num_columns > 0 || with_files ||
+                         (tree_mode && subtree_pid == 0)))
+    {
+        fprintf(stderr, "[main] --watch can't be combined with -o, --files "
+                        "or --tree\n");
+        return EXIT_FAILURE;
+    }
+
+    clk_tck = sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+
+    // the tree needs ppid from stat whatever is printed
+    int sources = (num_columns == 0 || tree_mode) ? SRC_STAT : 0;
+    for (size_t i = 0; i < num_columns; i++)
+        sources |= columns[i]->sources;
+    if (with_files)
+        sources |= SRC_FDS;
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+
+    proc_snapshot_t snap;
+    if (proc_snapshot_open(&snap) != 0)
+        return EXIT_FAILURE;
 
+    int err = (subtree_pid > 0) ? list_subtree(&snap, subtree_pid) :
+                                  proc_snapshot_list_pids(&snap);
+    if (err != 0)
+    {
+        proc_snapshot_close(&snap);
+        return EXIT_FAILURE;
+    }
+
+    if (interval > 0)
+    {
+        err = watch(&snap, interval, count, subtree_pid);
+        proc_snapshot_close(&snap);
+        return err;
+    }
+
+    proc_list_t list = {};
+    if (collect_all(&snap, num_threads, sources, &list) != 0)
+    {
+        free(list.infos);
+        proc_snapshot_close(&snap);
+        return EXIT_FAILURE;
+    }
+
+    if (!tree_mode)
+    {
+        print_header();
+        for (size_t i = 0; i < list.num; i++)
+            print_info(&list.infos[i], 0);
+    }
+    else
+    {
+        proc_tree_t tree = {};
+        err = tree_build(&list, &tree);
+        if (err == 0 && subtree_pid > 0 && find_info(&list, subtree_pid) < 0)
+        {
+            fprintf(stderr, "[main] No process %d\n", subtree_pid);
+            err = EXIT_FAILURE;
+        }
+
+        if (err == 0)
+            print_header();
+        for (size_t i = 0; err == 0 && i < list.num; i++)
+        {
+            // roots are the requested pid or processes without a listed parent
+            const proc_info_t* info = &list.infos[i];
+            int is_root = (subtree_pid > 0) ?
+                          (info->pid == subtree_pid) :
+                          (info->ppid == info->pid ||
+                           find_info(&list, info->ppid) < 0);
+            if (is_root)
+                print_tree(&list, &tree, i, 0);
+        }
+        tree_free(&tree);
+    }
 
-    printf("pid    status ppid  name\n");
-    while(entry_ptr != NULL)
+    free(list.infos);
+    proc_snapshot_close(&snap);
+    return err;
+}
+
+// appends pids of a "children" file, they are space separated and the
+// file may be longer than one read
+static int add_children(proc_snapshot_t* snap, int fd, char* buff)
+{
+    long long value = 0;
+    int in_number = 0;
+    while (1)
     {
-        if (entry_ptr->d_type == DT_DIR)
+        errno = 0;
+        ssize_t len = read(fd, buff, PROC_BUFF_SIZE);
+        if (len < 0)
+            PRINT_ERROR("[add_children] Reading children file failed\n");
+        if (len == 0)
+            break;
+
+        for (ssize_t i = 0; i < len; i++)
         {
-            if (is_piddir(entry_ptr->d_name))
+            char c = buff[i];
+            if (c >= '0' && c <= '9')
             {
-                char stat_file_path[PATH_MAX] = {};
-                int err = get_stat_path(stat_file_path, PATH_MAX,
-                                        entry_ptr->d_name);
-                if (err != 0)
-                    PRINT_ERROR("[main] produce path to stat file returned error\n");
-
-                err = print_stat(stat_file_path);
-                if (err != 0)
-                    PRINT_ERROR("[main] print stat info returned error\n");
+                value = value * 10 + (c - '0');
+                in_number = 1;
+            }
+            else if (in_number)
+            {
+                if (proc_snapshot_add_pid(snap, value) != 0)
+                    return EXIT_FAILURE;
+                value = 0;
+                in_number = 0;
             }
         }
+    }
+
+    if (in_number && proc_snapshot_add_pid(snap, value) != 0)
+        return EXIT_FAILURE;
+
+    return 0;
+}
+
+// appends children of every thread of pid, returns 1 when the kernel has
+// no children files and 0 for a process which already exited
+static int list_children(proc_snapshot_t* snap, int pid, char* buff)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%d/task", pid);
+
+    errno = 0;
+    int task_fd = openat(snap->proc_fd, path,
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+    {
+        if (errno == ENOENT || errno == ESRCH)
+            return 0;
+        PRINT_ERROR("[list_children] Open task directory failed\n");
+    }
+
+    int err = 0;
+    while (err == 0)
+    {
         errno = 0;
-        entry_ptr = readdir(proc_dir);
+        long read = syscall(SYS_getdents64, task_fd, snap->dents,
+                            PROC_DENTS_BUFF_SIZE);
+        if (read <= 0)
+        {
+            if (read < 0 && errno != ENOENT && errno != ESRCH)
+            {
+                perror("[list_children] getdents64 failed\n");
+                err = EXIT_FAILURE;
+            }
+            break;
+        }
+
+        for (long pos = 0; err == 0 && pos < read;)
+        {
+            struct linux_dirent64* entry =
+                (struct linux_dirent64*)(snap->dents + pos);
+            pos += entry->d_reclen;
+            if (!proc_is_piddir(entry->d_name))
+                continue;
+
+            snprintf(path, sizeof(path), "%s/children", entry->d_name);
+            errno = 0;
+            int fd = openat(task_fd, path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+            {
+                // no children file at all means CONFIG_PROC_CHILDREN is off
+                struct stat st;
+                if (errno == ENOENT &&
+                    fstatat(task_fd, entry->d_name, &st, 0) == 0)
+                    err = 1;
+                continue;
+            }
+
+            err = add_children(snap, fd, buff);
+            close(fd);
+        }
+    }
+
+    close(task_fd);
+    return err;
+}
+
+// lists root and its descendants, returns 1 without children files
+static int list_descendants(proc_snapshot_t* snap, int root)
+{
+    snap->num_pids = 0;
+    if (proc_snapshot_add_pid(snap, root) != 0)
+        return EXIT_FAILURE;
+
+    char* buff = proc_get_buff(snap);
+    if (buff == NULL)
+        return EXIT_FAILURE;
+
+    // the pid array doubles as the breadth first queue
+    int err = 0;
+    for (size_t i = 0; err == 0 && i < snap->num_pids; i++)
+        err = list_children(snap, snap->pids[i], buff);
+
+    proc_put_buff(snap, buff);
+    return err;
+}
+
+// lists root and its descendants only, falls back to all pids without
+// children files, the tree built from the stats then selects the subtree
+int list_subtree(proc_snapshot_t* snap, int root)
+{
+    if (snap == NULL)
+    {
+        fprintf(stderr, "[list_subtree] Bad input pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    int err = list_descendants(snap, root);
+    if (err == 1)
+        return proc_snapshot_list_pids(snap);
+    return err;
+}
+
+static const char* parse_int(const char* pos, const char* end, long long* value)
+{
+    int sign = 1;
+    if (pos < end && *pos == '-')
+    {
+        sign = -1;
+        pos++;
+    }
+
+    if (pos == end || *pos < '0' || *pos > '9')
+        return NULL;
+
+    long long result = 0;
+    while (pos < end && *pos >= '0' && *pos <= '9')
+        result = result * 10 + (*pos++ - '0');
+
+    *value = sign * result;
+    return pos;
+}
+
+// "pid (comm) state ppid ...", comm may hold spaces and ')' itself,
+// so it ends at the last ')'
+int parse_stat(const char* buff, size_t len, proc_info_t* info)
+{
+    if (buff == NULL || info == NULL)
+    {
+        fprintf(stderr, "[parse_stat] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    const char* end = buff + len;
+    long long value = 0;
+
+    const char* pos = parse_int(buff, end, &value);
+    if (pos == NULL || end - pos < 2 || pos[0] != ' ' || pos[1] != '(')
+        return EXIT_FAILURE;
+    info->pid = value;
+
+    const char* comm = pos + 2;
+    const char* comm_end = memrchr(comm, ')', end - comm);
+    if (comm_end == NULL || end - comm_end < 5)
+        return EXIT_FAILURE;
+
+    size_t comm_len = comm_end - comm;
+    if (comm_len >= COMM_LEN)
+        comm_len = COMM_LEN - 1;
+    memcpy(info->comm, comm, comm_len);
+    info->comm[comm_len] = '\0';
+
+    // ") S ppid"
+    pos = comm_end + 2;
+    info->state = *pos;
+    pos = parse_int(pos + 2, end, &value);
+    if (pos == NULL)
+        return EXIT_FAILURE;
+    info->ppid = value;
+
+    // numeric fields 5 to 24 follow in one pass
+    long long fields[25] = {};
+    for (int field = 5; field <= 24 && pos < end && *pos == ' '; field++)
+    {
+        pos = parse_int(pos + 1, end, &fields[field]);
+        if (pos == NULL)
+            return EXIT_FAILURE;
+    }
+
+    info->utime     = fields[14];
+    info->stime     = fields[15];
+    info->threads   = fields[20];
+    info->starttime = fields[22];
+    info->vsize     = fields[23];
+    info->rss       = fields[24];
+    return 0;
+}
+
+static int starts_with(const char* pos, const char* end, const char* key,
+                       size_t key_len)
+{
+    return (size_t)(end - pos) >= key_len && memcmp(pos, key, key_len) == 0;
+}
+
+// "Key:\tvalue ..." lines, only the keys of columns are picked up
+int parse_status(const char* buff, size_t len, proc_info_t* info)
+{
+    if (buff == NULL || info == NULL)
+    {
+        fprintf(stderr, "[parse_status] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    static const struct
+    {
+        const char* key;
+        size_t      key_len;
+        size_t      offset;
+    } keys[] =
+    {
+        {"Uid:",                        4,  offsetof(proc_info_t, uid)},
+        {"VmSwap:",                     7,  offsetof(proc_info_t, vm_swap)},
+        {"voluntary_ctxt_switches:",    24, offsetof(proc_info_t, vol_ctxt)},
+        {"nonvoluntary_ctxt_switches:", 27,
+         offsetof(proc_info_t, nonvol_ctxt)},
+    };
+
+    const char* end = buff + len;
+    for (const char* pos = buff; pos < end;)
+    {
+        const char* line_end = memchr(pos, '\n', end - pos);
+        if (line_end == NULL)
+            line_end = end;
+
+        for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+        {
+            if (!starts_with(pos, line_end, keys[i].key, keys[i].key_len))
+                continue;
+
+            const char* value = pos + keys[i].key_len;
+            while (value < line_end && (*value == ' ' || *value == '\t'))
+                value++;
+            parse_int(value, line_end, (long long*)((char*)info +
+                                                    keys[i].offset));
+            break;
+        }
+
+        pos = line_end + 1;
     }
-    if (errno < 0)
-        PRINT_ERROR("[main] Read next entry returned error\n");
 
-    closedir(proc_dir);
     return 0;
 }
 
-int is_piddir(const char* dir_name)
+// "size resident shared text lib data dt"
+int parse_statm(const char* buff, size_t len, proc_info_t* info)
 {
-    if (dir_name == NULL)
+    if (buff == NULL || info == NULL)
+    {
+        fprintf(stderr, "[parse_statm] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    const char* end = buff + len;
+    const char* pos = buff;
+    long long fields[7] = {};
+    for (int field = 0; field < 7 && pos != NULL && pos < end; field++)
     {
-        fprintf(stderr, "[is_piddir] Null iput string\n");
+        pos = parse_int(pos, end, &fields[field]);
+        if (pos != NULL && pos < end)
+            pos++;
+    }
+
+    info->shared = fields[2];
+    info->text   = fields[3];
+    info->data   = fields[5];
+    return 0;
+}
+
+static int list_reserve(proc_list_t* list, size_t need)
+{
+    if (need <= list->cap)
         return 0;
+
+    size_t new_cap = (list->cap == 0) ? 256 : 2 * list->cap;
+    while (new_cap < need)
+        new_cap *= 2;
+
+    errno = 0;
+    proc_info_t* new_infos = (proc_info_t*) realloc(list->infos,
+                                               new_cap * sizeof(proc_info_t));
+    if (new_infos == NULL)
+        PRINT_ERROR("[list_reserve] Reallocation failed\n");
+
+    list->infos = new_infos;
+    list->cap   = new_cap;
+    return 0;
+}
+
+// parses one text facet of entry, -1 when the process is gone
+static int collect_source(proc_snapshot_t* snap, proc_entry_t* entry,
+                          int facet, char* buff, proc_arena_t* arena,
+                          proc_info_t* info)
+{
+    const proc_text_t* text = proc_entry_text(snap, entry, facet, arena, buff);
+    if (text == NULL)
+    {
+        if (errno == ENOENT || errno == ESRCH)
+            return -1;
+
+        fprintf(stderr, "[collect_source] Reading %s of %d failed: %s\n",
+                proc_facet_names[facet], entry->pid, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    const char* data = text->data;
+    size_t len = text->len;
+    int err = 0;
+    switch (facet)
+    {
+        case PROC_STAT:
+            err = parse_stat(data, len, info);
+            break;
+        case PROC_STATUS:
+            err = parse_status(data, len, info);
+            break;
+        case PROC_STATM:
+            err = parse_statm(data, len, info);
+            break;
+        case PROC_CMDLINE:
+            // NUL separated arguments, kernel threads have none
+            if (len >= ARGS_LEN)
+                len = ARGS_LEN - 1;
+            for (size_t i = 0; i < len; i++)
+                info->args[i] = (data[i] == '\0') ? ' ' : data[i];
+            while (len > 0 && info->args[len - 1] == ' ')
+                len--;
+            info->args[len] = '\0';
+            break;
+    }
+
+    if (err != 0)
+        fprintf(stderr, "[collect_source] Can't parse %s of %d\n",
+                proc_facet_names[facet], entry->pid);
+    return err;
+}
+
+// appends info of the entry's process to list, facets are loaded into arena,
+// a process which already exited is skipped
+int collect_proc(proc_snapshot_t* snap, proc_entry_t* entry, int sources,
+                 char* buff, proc_arena_t* arena, proc_list_t* list)
+{
+    if (snap == NULL || entry == NULL || buff == NULL || arena == NULL ||
+        list == NULL)
+    {
+        fprintf(stderr, "[collect_proc] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    if (list_reserve(list, list->num + 1) != 0)
+        return EXIT_FAILURE;
+
+    proc_info_t* info = &list->infos[list->num];
+    memset(info, 0, sizeof(*info));
+    info->pid = entry->pid;
+
+    for (int facet = 0; facet < PROC_NUM_TEXT_FACETS; facet++)
+    {
+        if (!(sources & (1 << facet)))
+            continue;
+
+        int err = collect_source(snap, entry, facet, buff, arena, info);
+        if (err == -1)
+            return 0;
+        if (err != 0)
+            return EXIT_FAILURE;
+    }
+
+    if (sources & SRC_FDS)
+    {
+        if (proc_entry_fds(snap, entry, 1, arena, buff) != 0)
+            return EXIT_FAILURE;
+        info->fds     = entry->fds;
+        info->num_fds = entry->num_fds;
     }
 
+    list->num++;
+    return 0;
+}
+
+static void* worker_main(void* arg)
+{
+    proc_worker_t* worker = (proc_worker_t*) arg;
+    proc_pool_t* pool = worker->pool;
+
+    while (worker->err == 0)
+    {
+        size_t first = __atomic_fetch_add(&pool->next, PIDS_PER_TAKE,
+                                          __ATOMIC_RELAXED);
+        size_t num_pids = pool->snap->num_pids;
+        if (first >= num_pids)
+            break;
+
+        size_t last = first + PIDS_PER_TAKE;
+        if (last > num_pids)
+            last = num_pids;
+
+        // every entry is taken by one worker only
+        for (size_t i = first; i < last && worker->err == 0; i++)
+            worker->err = collect_proc(pool->snap, &pool->snap->entries[i],
+                                       pool->sources, worker->buff,
+                                       &worker->arena, &worker->list);
+    }
+
+    return NULL;
+}
+
+static int cmp_infos(const void* lhs, const void* rhs)
+{
+    int lhs_pid = ((const proc_info_t*)lhs)->pid;
+    int rhs_pid = ((const proc_info_t*)rhs)->pid;
+    return (lhs_pid > rhs_pid) - (lhs_pid < rhs_pid);
+}
+
+// reads all listed pids with up to num_threads workers, list is sorted by pid
+int collect_all(proc_snapshot_t* snap, size_t num_threads, int sources,
+                proc_list_t* list)
+{
+    if (snap == NULL || list == NULL)
+    {
+        fprintf(stderr, "[collect_all] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
+
+    list->num = 0;
+    if (proc_snapshot_entries(snap) != 0)
+        return EXIT_FAILURE;
+
+    // pool overhead is not worth it for a handful of processes
+    size_t max_threads = snap->num_pids / PIDS_PER_THREAD;
+    if (num_threads > max_threads)
+        num_threads = max_threads;
+
+    if (num_threads <= 1)
+    {
+        char* buff = proc_get_buff(snap);
+        int err = (buff == NULL) ? EXIT_FAILURE : 0;
+        for (size_t i = 0; err == 0 && i < snap->num_pids; i++)
+            err = collect_proc(snap, &snap->entries[i], sources, buff,
+                               &snap->arena, list);
+
+        proc_put_buff(snap, buff);
+        return err;
+    }
+
+    proc_pool_t pool = {
+        .snap        = snap,
+        .sources     = sources,
+        .next        = 0,
+        .num_workers = num_threads,
+    };
+
     errno = 0;
-    char* endptr = NULL;
-    long int pid = strtol(dir_name, &endptr, 10);
-    if (errno < 0)
+    pool.workers = (proc_worker_t*) calloc(num_threads, sizeof(proc_worker_t));
+    if (pool.workers == NULL)
+        PRINT_ERROR("[collect_all] Allocation of workers failed\n");
+
+    size_t num_started = 0;
+    int err = 0;
+    for (; num_started < num_threads; num_started++)
     {
-        perror("[is_piddir] Error in strtol of dirname\n");
-        return 0;
+        proc_worker_t* worker = &pool.workers[num_started];
+        worker->pool = &pool;
+        worker->buff = proc_get_buff(snap);
+        if (worker->buff == NULL ||
+            pthread_create(&worker->thread, NULL, worker_main, worker) != 0)
+        {
+            fprintf(stderr, "[collect_all] Starting worker failed\n");
+            proc_put_buff(snap, worker->buff);
+            err = EXIT_FAILURE;
+            break;
+        }
     }
 
-    if (endptr == dir_name)
-        return 0;
+    size_t total = 0;
+    for (size_t i = 0; i < num_started; i++)
+    {
+        pthread_join(pool.workers[i].thread, NULL);
+        proc_put_buff(snap, pool.workers[i].buff);
+        // facets point into the worker arenas, they live on in the snapshot
+        proc_arena_merge(&snap->arena, &pool.workers[i].arena);
+        err |= pool.workers[i].err;
+        total += pool.workers[i].list.num;
+    }
 
-    if (*endptr != '\0')
-        return 0;
+    // the pids left by a failed start are still read by running workers
+    if (err == 0 && list_reserve(list, total) != 0)
+        err = EXIT_FAILURE;
+
+    for (size_t i = 0; i < num_started; i++)
+    {
+        proc_list_t* part = &pool.workers[i].list;
+        if (err == 0)
+        {
+            memcpy(list->infos + list->num, part->infos,
+                   part->num * sizeof(proc_info_t));
+            list->num += part->num;
+        }
+        free(part->infos);
+    }
+
+    free(pool.workers);
+    if (err != 0)
+        return EXIT_FAILURE;
+
+    qsort(list->infos, list->num, sizeof(proc_info_t), cmp_infos);
+    return 0;
+}
+
+// comma separated column names, e.g. "pid,rss,args"
+int select_columns(const char* spec)
+{
+    if (spec == NULL)
+    {
+        fprintf(stderr, "[select_columns] Bad input pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    num_columns = 0;
+    for (const char* pos = spec; *pos != '\0';)
+    {
+        size_t len = strcspn(pos, ",");
+        size_t i = 0;
+        for (; i < sizeof(all_columns) / sizeof(all_columns[0]); i++)
+            if (strlen(all_columns[i].name) == len &&
+                strncmp(all_columns[i].name, pos, len) == 0)
+                break;
+
+        if (i == sizeof(all_columns) / sizeof(all_columns[0]))
+        {
+            fprintf(stderr, "[select_columns] Unknown column %.*s\n",
+                    (int) len, pos);
+            return EXIT_FAILURE;
+        }
+        if (num_columns == MAX_COLUMNS)
+        {
+            fprintf(stderr, "[select_columns] Too many columns\n");
+            return EXIT_FAILURE;
+        }
+
+        columns[num_columns++] = &all_columns[i];
+        pos += len;
+        if (*pos == ',')
+            pos++;
+    }
+
+    return 0;
+}
+
+void print_header()
+{
+    if (num_columns == 0)
+    {
+        printf("pid    status ppid  name\n");
+        return;
+    }
+
+    for (size_t i = 0; i < num_columns; i++)
+    {
+        // the last left aligned column is not padded
+        int width = (i + 1 == num_columns && columns[i]->width < 0) ?
+                    0 : columns[i]->width;
+        printf("%s%*s", i ? " " : "", width, columns[i]->header);
+    }
+    printf("\n");
+}
+
+// open files of the combined report, right under their process
+static void print_fds(const proc_info_t* info)
+{
+    for (size_t i = 0; i < info->num_fds; i++)
+    {
+        const proc_fd_info_t* fd = &info->fds[i];
+        printf("%14s%5d %10lu %10ld %s\n", "fd ", fd->fd, fd->ino, fd->size,
+               fd->name ? fd->name : "");
+    }
+}
+
+// depth indents the names under their parent in tree output
+void print_info(const proc_info_t* info, int depth)
+{
+    if (num_columns == 0)
+    {
+        printf("%5d  %c  %5d     %*s%s%s\n", info->pid, info->state,
+               info->ppid, 2 * depth, "", depth ? "\\_ " : "", info->comm);
+        print_fds(info);
+        return;
+    }
+
+    for (size_t i = 0; i < num_columns; i++)
+    {
+        const column_t* column = columns[i];
+        const void* field = (const char*)info + column->offset;
+        int width = (i + 1 == num_columns && column->width < 0) ?
+                    0 : column->width;
+        if (i)
+            putchar(' ');
+
+        switch (column->kind)
+        {
+            case COL_INT:
+                printf("%*d", width, *(const int*)field);
+                break;
+            case COL_LLONG:
+                printf("%*lld", width, *(const long long*)field);
+                break;
+            case COL_TICKS:
+                printf("%*.2f", width, (double)*(const unsigned long long*)
+                                       field / clk_tck);
+                break;
+            case COL_PAGES:
+                printf("%*lld", width, *(const long long*)field * page_kb);
+                break;
+            case COL_BYTES:
+                printf("%*lld", width, *(const long long*)field / 1024);
+                break;
+            case COL_CHAR:
+                printf("%*c", width, *(const char*)field);
+                break;
+            case COL_STR:
+                // only the first name column is indented
+                if (depth > 0)
+                {
+                    // the prefix takes 2 * depth + 1 of a left aligned width
+                    printf("%*s\\_ ", 2 * depth - 2, "");
+                    if (width < 0)
+                        width = (-width > 2 * depth + 1) ?
+                                width + 2 * depth + 1 : 0;
+                    depth = 0;
+                }
+                printf("%*s", width, (const char*)field);
+                break;
+        }
+    }
+    printf("\n");
+    print_fds(info);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// process tree
+
+// list is sorted by pid, returns index of pid or -1
+long find_info(const proc_list_t* list, int pid)
+{
+    size_t lo = 0;
+    size_t hi = list->num;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (list->infos[mid].pid < pid)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo < list->num && list->infos[lo].pid == pid) ? (long) lo : -1;
+}
+
+// counts children per parent, then places them, both passes go in pid order
+// so children come out sorted
+int tree_build(const proc_list_t* list, proc_tree_t* tree)
+{
+    if (list == NULL || tree == NULL)
+    {
+        fprintf(stderr, "[tree_build] Bad input pointers\n");
+        return EXIT_FAILURE;
+    }
 
-    return 1;
+    errno = 0;
+    tree->first    = (size_t*) calloc(list->num + 1, sizeof(size_t));
+    tree->children = (size_t*) malloc((list->num + 1) * sizeof(size_t));
+    long* parents  = (long*) malloc((list->num + 1) * sizeof(long));
+    if (tree->first == NULL || tree->children == NULL || parents == NULL)
+    {
+        perror("[tree_build] Allocation failed\n");
+        free(parents);
+        tree_free(tree);
+        return EXIT_FAILURE;
+    }
+
+    for (size_t i = 0; i < list->num; i++)
+    {
+        const proc_info_t* info = &list->infos[i];
+        parents[i] = (info->ppid == info->pid) ? -1 :
+                     find_info(list, info->ppid);
+        if (parents[i] >= 0)
+            tree->first[parents[i] + 1]++;
+    }
+
+    for (size_t i = 0; i < list->num; i++)
+        tree->first[i + 1] += tree->first[i];
+
+    // first[parent] serves as the fill cursor and is restored afterwards
+    for (size_t i = 0; i < list->num; i++)
+        if (parents[i] >= 0)
+            tree->children[tree->first[parents[i]]++] = i;
+
+    for (size_t i = list->num; i > 0; i--)
+        tree->first[i] = tree->first[i - 1];
+    tree->first[0] = 0;
+
+    free(parents);
+    return 0;
+}
+
+void tree_free(proc_tree_t* tree)
+{
+    if (tree == NULL)
+        return;
+
+    free(tree->first);
+    free(tree->children);
+    tree->first    = NULL;
+    tree->children = NULL;
 }
 
-int get_stat_path(char* file_path, size_t buf_size, const char* dir_name)
+void print_tree(const proc_list_t* list, const proc_tree_t* tree, size_t pos,
+                int depth)
 {
-    // "/proc/"
-    if (buf_size < 7)
-        PRINT_ERROR("[get_stat_path] Not enough space for proc folder");
-    if (file_path == NULL || dir_name == NULL)
-        PRINT_ERROR("[get_stat_path] Bad input pointer");
+    print_info(&list->infos[pos], depth);
 
-    size_t stop = buf_size - 7 - 5; // "/proc/*/stat"
-    if (stop > PATH_MAX)
-        stop = PATH_MAX;
+    for (size_t i = tree->first[pos]; i < tree->first[pos + 1]; i++)
+        print_tree(list, tree, tree->children[i], depth + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// watch mode
 
-    size_t dir_name_len = strnlen(dir_name, stop);
-    if (dir_name_len == stop)
-        PRINT_ERROR("[get_stat_path] string buff is too short\n");
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-    strncpy(file_path, "/proc/", 7);
-    file_path[6] = '\0';
+static size_t hash_pid(int pid, size_t cap)
+{
+    return ((unsigned) pid * 2654435761u) & (cap - 1);
+}
 
-    strncat(file_path, dir_name, stop);
-    file_path[7 + stop - 1] = '\0';
+// returns the slot of pid or the free slot where it would go
+static watch_entry_t* table_slot(watch_table_t* table, int pid)
+{
+    size_t pos = hash_pid(pid, table->cap);
+    while (table->entries[pos].pid != 0 && table->entries[pos].pid != pid)
+        pos = (pos + 1) & (table->cap - 1);
 
-    strncat(file_path, "/stat", 6);
-    file_path[stop + 11] = '\0';
-    //printf("%s\n", file_path);
+    return &table->entries[pos];
+}
 
+static int table_grow(watch_table_t* table)
+{
+    watch_table_t bigger = {.cap = table->cap ? 2 * table->cap :
+                                                WATCH_TABLE_SIZE};
+    errno = 0;
+    bigger.entries = (watch_entry_t*) calloc(bigger.cap, sizeof(watch_entry_t));
+    if (bigger.entries == NULL)
+        PRINT_ERROR("[table_grow] Allocation failed\n");
+
+    for (size_t i = 0; i < table->cap; i++)
+        if (table->entries[i].pid != 0)
+            *table_slot(&bigger, table->entries[i].pid) = table->entries[i];
+
+    bigger.num = table->num;
+    free(table->entries);
+    *table = bigger;
     return 0;
 }
 
-int print_stat(const char* stat_file_path)
+// backward shift deletion keeps probe chains intact without tombstones
+static void table_remove(watch_table_t* table, watch_entry_t* entry)
+{
+    size_t mask = table->cap - 1;
+    size_t hole = entry - table->entries;
+    size_t pos  = hole;
+    while (1)
+    {
+        pos = (pos + 1) & mask;
+        watch_entry_t* next = &table->entries[pos];
+        if (next->pid == 0)
+            break;
+
+        // move next into the hole unless its home lies cyclically in (hole, pos]
+        size_t home = hash_pid(next->pid, table->cap);
+        if (((pos - home) & mask) >= ((pos - hole) & mask))
+        {
+            table->entries[hole] = *next;
+            hole = pos;
+        }
+    }
+
+    table->entries[hole].pid = 0;
+    table->num--;
+}
+
+static void table_free(watch_table_t* table)
 {
-    if (stat_file_path == NULL)
-        PRINT_ERROR("[print_stat] Null input pointer\n");
+    for (size_t i = 0; i < table->cap; i++)
+        if (table->entries[i].pid != 0 && table->entries[i].fd >= 0)
+            close(table->entries[i].fd);
+
+    free(table->entries);
+    memset(table, 0, sizeof(*table));
+}
+
+// re-reads stat through the kept descriptor, -1 with errno when gone
+static ssize_t watch_read(int proc_fd, watch_entry_t* entry, char* buff)
+{
+    if (entry->fd < 0)
+        return proc_read_file(proc_fd, entry->pid, "stat", buff,
+                              PROC_BUFF_SIZE);
 
     errno = 0;
-    FILE* stat_ptr = fopen(stat_file_path, "r");
-    if (stat_ptr == NULL)
-        PRINT_ERROR("[print_stat] Can't open input file\n");
+    ssize_t len = pread(entry->fd, buff, PROC_BUFF_SIZE - 1, 0);
+    if (len < 0)
+        return -1;
+    // a dead process still reads as an empty file on some kernels
+    if (len == 0)
+    {
+        errno = ESRCH;
+        return -1;
+    }
+
+    buff[len] = '\0';
+    return len;
+}
+
+static void watch_open(int proc_fd, watch_entry_t* entry)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%d/stat", entry->pid);
+    entry->fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+}
 
-    int pid = 0;
-    char comm[PATH_MAX] = {};
-    char test[PATH_MAX] = {};
-    char state = 0;
-    int ppid = 0;
+static void print_sample(const char* mark, const proc_info_t* info,
+                         double cpu, long long rss_kb, long long drss_kb)
+{
+    printf("%s%5d  %c  %5d %6.1f %9lld %+8lld  %s\n", mark, info->pid,
+           info->state, info->ppid, cpu, rss_kb, drss_kb, info->comm);
+}
+
+// samples one listed pid, new processes get a table entry and a kept fd
+static int watch_pid(proc_snapshot_t* snap, watch_table_t* table, int pid,
+                     char* buff, unsigned long tick, double ticks_per_interval)
+{
+    if (2 * (table->num + 1) > table->cap && table_grow(table) != 0)
+        return EXIT_FAILURE;
+
+    watch_entry_t* entry = table_slot(table, pid);
+    int is_new = (entry->pid == 0);
+    if (is_new)
+    {
+        entry->pid = pid;
+        watch_open(snap->proc_fd, entry);
+        table->num++;
+    }
+
+    ssize_t len = watch_read(snap->proc_fd, entry, buff);
+    if (len < 0 && !is_new && entry->fd >= 0 &&
+        (errno == ESRCH || errno == ENOENT))
+    {
+        // kept fd belongs to a dead process, the pid may have been reused
+        close(entry->fd);
+        watch_open(snap->proc_fd, entry);
+        len = watch_read(snap->proc_fd, entry, buff);
+        if (len >= 0)
+        {
+            printf("-%5d %41s  %s\n", pid, "", entry->comm);
+            is_new = 1;
+        }
+    }
 
-    int num_scaned = fscanf(stat_ptr, "%d %[^)]%[^ ] %c %d", &pid, comm, test,
-                            &state, &ppid);
+    if (len < 0)
+    {
+        if (errno != ENOENT && errno != ESRCH)
+            PRINT_ERROR("[watch_pid] Reading stat file failed\n");
+
+        // gone between listing and reading, a new entry was never printed
+        // so it goes silently, a known one is reported as exited later
+        if (is_new)
+        {
+            if (entry->fd >= 0)
+                close(entry->fd);
+            table_remove(table, entry);
+        }
+        return 0;
+    }
 
-    fclose(stat_ptr);
-    if (num_scaned != 5)
-        //num_scaned = fscanf(stat_ptr, "%d %s %c %d", &pid, comm, &state, &ppid);
-        PRINT_ERROR("[print_stat] Can't scan stat file\n");
+    proc_info_t info;
+    if (parse_stat(buff, len, &info) != 0)
+    {
+        fprintf(stderr, "[watch_pid] Can't parse stat of %d\n", pid);
+        return EXIT_FAILURE;
+    }
 
-    printf("%5d  %c  %5d     %s\n", pid, state, ppid, comm + 1);
+    unsigned long long cpu = info.utime + info.stime;
+    if (is_new)
+        print_sample("+", &info, 0, info.rss * page_kb, 0);
+    else if (cpu != entry->cpu || info.rss != entry->rss)
+        print_sample(" ", &info, 100.0 * (cpu - entry->cpu) /
+                                 ticks_per_interval,
+                     info.rss * page_kb, (info.rss - entry->rss) * page_kb);
 
+    entry->tick = tick;
+    entry->cpu  = cpu;
+    entry->rss  = info.rss;
+    if (is_new)
+        memcpy(entry->comm, info.comm, COMM_LEN);
     return 0;
 }
+
+// prints processes that changed every interval seconds, count < 0 is endless,
+// root > 0 limits the samples to its subtree which is relisted every tick
+int watch(proc_snapshot_t* snap, double interval, long count, int root)
+{
+    if (snap == NULL)
+    {
+        fprintf(stderr, "[watch] Bad input pointer\n");
+        return EXIT_FAILURE;
+    }
+
+    // every watched process keeps one descriptor
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    watch_table_t table = {};
+    char* buff = proc_get_buff(snap);
+    if (buff == NULL || table_grow(&table) != 0)
+    {
+        proc_put_buff(snap, buff);
+        return EXIT_FAILURE;
+    }
+
+    int err = 0;
+    double last = now_seconds();
+    double deadline = last;
+    for (unsigned long tick = 1; err == 0; tick++)
+    {
+        double now = now_seconds();
+        double ticks_per_interval = clk_tck * ((tick == 1) ? interval :
+                                               now - last);
+        last = now;
+
+        printf("--- %.3f\n", now);
+        if (tick == 1)
+            printf(" pid    status ppid   cpu%%   rss(kB)    delta  name\n");
+
+        // there is no tree to pick the subtree from all pids here
+        err = (root > 0) ? list_descendants(snap, root) :
+                           proc_snapshot_list_pids(snap);
+        if (err == 1)
+        {
+            fprintf(stderr, "[watch] --subtree needs /proc children files\n");
+            break;
+        }
+        for (size_t i = 0; err == 0 && i < snap->num_pids; i++)
+            err = watch_pid(snap, &table, snap->pids[i], buff, tick,
+                            ticks_per_interval);
+
+        // whatever was not seen this tick has exited, a shift can wrap an
+        // unvisited entry to the front so passes repeat until nothing moves
+        for (int removed = 1; err == 0 && removed;)
+        {
+            removed = 0;
+            for (size_t i = 0; i < table.cap;)
+            {
+                watch_entry_t* entry = &table.entries[i];
+                if (entry->pid == 0 || entry->tick == tick)
+                {
+                    i++;
+                    continue;
+                }
+
+                printf("-%5d %41s  %s\n", entry->pid, "", entry->comm);
+                if (entry->fd >= 0)
+                    close(entry->fd);
+                // the shift may pull an unvisited entry into slot i
+                table_remove(&table, entry);
+                removed = 1;
+            }
+        }
+
+        fflush(stdout);
+        if (count >= 0 && tick >= (unsigned long)count)
+            break;
+
+        // sleep to an absolute deadline so ticks don't drift
+        deadline += interval;
+        struct timespec ts;
+        ts.tv_sec  = (time_t) deadline;
+        ts.tv_nsec = (long)((deadline - ts.tv_sec) * 1e9);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR)
+            ;
+    }
+
+    table_free(&table);
+    proc_put_buff(snap, buff);
+    return err;
+}